@@ -13,155 +13,631 @@
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
 #include "error.h"
 #include "imgfs.h"
-#include <string.h>
+#include "util.h" // for _unused
 
 static int passive_socket = -1;
 static EventCallback cb;
+static enum http_server_mode server_mode = HTTP_THREAD_POOL;
+
+// Pool of worker threads serving the accepted connections
+#define DEFAULT_NB_WORKERS 8
+#define DEFAULT_QUEUE_CAPACITY 64
+#define HTTP_UNAVAILABLE "503 Service Unavailable"
+
+// Event loop
+#define MAX_EVENTS 64
+#define INITIAL_READ_SIZE 4096 // first buffer of a request, doubled up to MAX_HEADER_SIZE
+#define CONNECTION_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+// Streamed bodies
+#define DISCARD_SIZE 4096 // buffer of the body bytes a callback did not read
+
+// Persistent connections
+#define KEEP_ALIVE_TIMEOUT_MS 15000 // a connection idle for longer is closed
+#define WAIT_SLICE_MS 100           // how often a worker waiting for bytes checks whether the server stops
+#define IDLE_SWEEP_MS 1000          // how often the event loop looks for idle connections
+#define CONNECTION_CLOSE "Connection: close" HTTP_LINE_DELIM
+
+/*
+ * Connection watched by the event loop. An idle connection owns no
+ * buffer: it costs this structure only.
+ */
+struct event_connection
+{
+    int socket;
+    char *buffer;                 // request being received, NULL if idle
+    size_t buffer_size;           // allocated size of buffer
+    size_t received;              // number of bytes received in buffer
+    int content_len;              // Content-Length of the request, once its headers are received
+    struct http_message *message; // request handed over to a worker, NULL if idle
+    struct http_parser *parser;   // where the parsing of the request stopped, NULL if idle
+    int watched;                  // whether it belongs to the event loop rather than to a worker
+    uint64_t last_active_ms;      // when its last bytes were received or its last reply sent
+    struct event_connection *prev, *next; // list of the open connections
+};
+
+// Work of a worker: a whole connection, or one request of an event_connection
+struct connection_job
+{
+    int socket;
+    struct event_connection *connection; // NULL in HTTP_THREAD_POOL mode
+};
+
+struct connection_queue
+{
+    struct connection_job *jobs; // ring buffer of the jobs waiting for a worker
+    size_t capacity;             // size of the ring buffer
+    size_t head;                 // index of the oldest job
+    size_t count;                // number of jobs waiting
+    int stopping;                // set by http_close()
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+static size_t nb_workers = DEFAULT_NB_WORKERS;
+static pthread_t *worker_threads; // the nb_started workers, joined by http_close()
+static size_t nb_started;
+static struct connection_queue queue = {.capacity = DEFAULT_QUEUE_CAPACITY,
+                                        .lock = PTHREAD_MUTEX_INITIALIZER,
+                                        .not_empty = PTHREAD_COND_INITIALIZER};
+static int epoll_fd = -1;
 
-#define MK_OUR_ERR(X) \
-    static int our_##X = X
+// Written by http_interrupt(), so that http_receive() returns instead of waiting
+static int wake_pipe[2] = {-1, -1};
 
-MK_OUR_ERR(ERR_NONE);
-MK_OUR_ERR(ERR_INVALID_ARGUMENT);
-MK_OUR_ERR(ERR_OUT_OF_MEMORY);
-MK_OUR_ERR(ERR_IO);
+// Connection whose reply being sent by this thread is the last one, see format_header():
+// the request asks so, or its body could not be read
+static _Thread_local int closing_connection = -1;
+
+// Open event connections, so that the idle ones can be closed
+static struct
+{
+    struct event_connection *head;
+    uint64_t last_sweep_ms;
+    pthread_mutex_t lock; // protects the list and the watched field of its connections
+} connections = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
 /*******************************************************************
- * Manages the HTTP connection with the client
+ * Current time, in milliseconds
  *******************************************************************/
-static void *handle_connection(void *arg)
+static uint64_t now_ms(void)
 {
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGTERM);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*******************************************************************
+ * Moves the bytes received after a request at the start of the buffer,
+ * and starts parsing them. Returns the number of these bytes.
+ *******************************************************************/
+static size_t keep_leftover(char *buffer, size_t received, struct http_parser *parser,
+                            const struct http_message *message)
+{
+    // The part of a streamed body in the buffer is its body
+    const size_t consumed = parser->body_start + message->body.len;
+    http_parser_init(parser);
+    const size_t leftover = received > consumed ? received - consumed : 0;
+    memmove(buffer, buffer + received - leftover, leftover);
+    buffer[leftover] = '\0';
+    return leftover;
+}
+
+/*******************************************************************
+ * Tells whether a worker waiting for bytes should stop waiting: the
+ * server stops, or the connection is idle between two requests while
+ * other connections wait for a worker
+ *******************************************************************/
+static int stop_waiting(int idle)
+{
+    pthread_mutex_lock(&queue.lock);
+    const int stop = queue.stopping || (idle && queue.count > 0);
+    pthread_mutex_unlock(&queue.lock);
+    return stop;
+}
+
+/*******************************************************************
+ * Waits until a connection has bytes to read. Returns 0 if it stayed
+ * silent for too long, or if stop_waiting() tells so.
+ *******************************************************************/
+static int wait_readable(int socket_fd, int idle)
+{
+    struct pollfd fd = {.fd = socket_fd, .events = POLLIN};
+    for (int waited = 0; waited < KEEP_ALIVE_TIMEOUT_MS; waited += WAIT_SLICE_MS)
+    {
+        const int ret = poll(&fd, ONE_ELEMENT, WAIT_SLICE_MS);
+        if (ret > 0 || (ret < 0 && errno != EINTR))
+        {
+            return ret;
+        }
+        if (stop_waiting(idle))
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************
+ * Hands a request whose headers are received over to the callback
+ * before its body, if the body is too large to be buffered
+ *******************************************************************/
+static int start_streamed_body(struct http_message *message, const struct http_parser *parser,
+                               const char *buffer, size_t received, int content_len)
+{
+    if (parser->state != HTTP_PARSE_BODY || content_len <= STREAMED_BODY_SIZE)
+    {
+        return NOT_FOUND;
+    }
+    const char *body = buffer + parser->body_start;
+
+    size_t len = received - (size_t)(body - buffer);
+    if (len > (size_t)content_len)
+    {
+        len = (size_t)content_len;
+    }
+    message->body.val = body;
+    message->body.len = len;
+    message->body_remaining = (size_t)content_len - len;
+    return FOUND;
+}
+
+/*******************************************************************
+ * Skips the part of a streamed body the callback did not read, so that
+ * the next request of the connection can be read
+ *******************************************************************/
+static int discard_body(int socket_fd, struct http_message *message)
+{
+    char buffer[DISCARD_SIZE];
+    while (message->body_remaining > 0)
+    {
+        const int ret = http_read_body(socket_fd, message, buffer, sizeof(buffer));
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return ERR_NONE;
+}
 
-    if (arg == NULL)
+/*******************************************************************
+ * Hands a request over to the callback. Tells in keep_alive whether
+ * the connection stays open afterwards: if so, skips the part of a
+ * streamed body the callback did not read.
+ *******************************************************************/
+static int serve_message(int socket_fd, struct http_message *message, int *keep_alive)
+{
+    *keep_alive = http_keep_alive(message) > 0;
+    closing_connection = *keep_alive ? -1 : socket_fd;
+    int ret = cb(message, socket_fd);
+    *keep_alive = *keep_alive && closing_connection != socket_fd;
+    if (ret == ERR_NONE && *keep_alive)
     {
-        return &our_ERR_INVALID_ARGUMENT;
+        ret = discard_body(socket_fd, message);
     }
+    closing_connection = -1;
+    return ret;
+}
 
-    int *socket_fd = (int *)arg;
+/*******************************************************************
+ * Manages the HTTP connection with the client
+ *******************************************************************/
+static int handle_connection(int socket_fd)
+{
     int buffer_size = MAX_HEADER_SIZE + NULL_TERMINATOR;
 
     char *buffer = calloc(ONE_ELEMENT, (size_t)buffer_size);
     if (buffer == NULL)
     {
-        close(*socket_fd);
-        free(socket_fd);
-        socket_fd = NULL;
-        return &our_ERR_OUT_OF_MEMORY;
+        close(socket_fd);
+        return ERR_OUT_OF_MEMORY;
     }
     int total_read = EMPTY, currently_read = EMPTY, extended = EMPTY, content_len = EMPTY;
+    int pipelined = EMPTY; // whether the buffer may already hold the next request
+    int served = EMPTY;    // whether a request was already served on this connection
+    int keep_alive = NON_EMPTY;
     struct http_message message;
+    struct http_parser parser;
 
     memset(&message, 0, sizeof(struct http_message));
+    http_parser_init(&parser);
     while (1)
     {
-        // Read data from socket
-        currently_read = (int)tcp_read(*socket_fd, buffer + total_read, (size_t)(buffer_size - total_read - 1));
-        if (currently_read < 0)
+        if (!pipelined)
         {
-            free(buffer);
-            buffer = NULL;
-            close(*socket_fd);
-            free(socket_fd);
-            socket_fd = NULL;
-            return &our_ERR_IO;
-        }
-        if (currently_read == 0)
-        {
-            break;
-        }
+            // Close a keep-alive connection left idle, or a request which stalls. An idle
+            // one is closed as soon as other connections wait for this worker.
+            const int readable = wait_readable(socket_fd, served && total_read == EMPTY);
+            if (readable < 0)
+            {
+                free(buffer);
+                close(socket_fd);
+                return ERR_IO;
+            }
+            if (readable == 0)
+            {
+                break;
+            }
 
-        total_read += currently_read;
-        buffer[total_read] = '\0';
+            // Read data from socket
+            currently_read = (int)tcp_read(socket_fd, buffer + total_read, (size_t)(buffer_size - total_read - 1));
+            if (currently_read < 0)
+            {
+                free(buffer);
+                close(socket_fd);
+                return ERR_IO;
+            }
+            if (currently_read == 0)
+            {
+                break;
+            }
 
-        int parse_result = http_parse_message(buffer, (size_t)total_read, &message, &content_len);
+            total_read += currently_read;
+            buffer[total_read] = '\0';
+        }
+        pipelined = EMPTY;
+
+        int parse_result = http_parser_execute(&parser, buffer, (size_t)total_read, &message, &content_len);
         if (parse_result < 0)
         {
             free(buffer);
-            buffer = NULL;
-            close(*socket_fd);
-            free(socket_fd);
-            socket_fd = NULL;
-            return &our_ERR_IO;
+            close(socket_fd);
+            return ERR_IO;
+        }
+        // A large body is read by the callback itself, as it arrives
+        if (parse_result == 0 && start_streamed_body(&message, &parser, buffer, (size_t)total_read, content_len) == FOUND)
+        {
+            parse_result = 1;
         }
-        // Check if messsage has not been received completely
+        // Check if messsage has not been received completely: its headers, or its body
         if (parse_result == 0)
         {
-            if (content_len > 0)
+            if (content_len > 0 && !extended)
             {
-                if (!extended)
+                buffer_size = MAX_HEADER_SIZE + content_len + NULL_TERMINATOR;
+                char *extended_buffer = realloc(buffer, (size_t)buffer_size);
+                if (extended_buffer == NULL)
                 {
-                    buffer_size = MAX_HEADER_SIZE + content_len + NULL_TERMINATOR;
-                    buffer = realloc(buffer, (size_t)buffer_size);
-                    if (!buffer)
-                    {
-                        free(buffer);
-                        buffer = NULL;
-                        close(*socket_fd);
-                        free(socket_fd);
-                        socket_fd = NULL;
-                        return &our_ERR_OUT_OF_MEMORY;
-                    }
-                    extended = NON_EMPTY;
-                }
-                else
-                {
-                    continue;
+                    free(buffer);
+                    close(socket_fd);
+                    return ERR_OUT_OF_MEMORY;
                 }
+                buffer = extended_buffer;
+                extended = NON_EMPTY;
             }
-            else // Should not happen since content_len should be > 0
-            {
-                free(buffer);
-                buffer = NULL;
-                close(*socket_fd);
-                free(socket_fd);
-                socket_fd = NULL;
-                return &our_ERR_IO;
-            }
+            continue;
         }
-        if (parse_result > 0)
+
+        if (serve_message(socket_fd, &message, &keep_alive) != ERR_NONE)
         {
-            if (cb(&message, *socket_fd) != ERR_NONE)
-            {
-                free(buffer);
-                buffer = NULL;
-                close(*socket_fd);
-                free(socket_fd);
-                socket_fd = NULL;
-                return &our_ERR_IO;
-            }
-            total_read = 0;
-            extended = 0;
-            memset(&message, 0, sizeof(struct http_message));
-            buffer_size = MAX_HEADER_SIZE + NULL_TERMINATOR;
-            buffer = realloc(buffer, (size_t)buffer_size);
-            if (!buffer)
-            {
-                free(buffer);
-                buffer = NULL;
-                close(*socket_fd);
-                free(socket_fd);
-                socket_fd = NULL;
-                return &our_ERR_OUT_OF_MEMORY;
-            }
+            free(buffer);
+            close(socket_fd);
+            return ERR_IO;
+        }
+        if (!keep_alive)
+        {
+            break;
         }
+        served = NON_EMPTY;
+
+        // The bytes after the request are the start of the next one
+        total_read = (int)keep_leftover(buffer, (size_t)total_read, &parser, &message);
+        pipelined = total_read > 0;
+        extended = 0;
+        content_len = EMPTY;
+        memset(&message, 0, sizeof(struct http_message));
+        buffer_size = MAX_HEADER_SIZE + NULL_TERMINATOR;
+        char *shrunk_buffer = realloc(buffer, (size_t)buffer_size);
+        if (shrunk_buffer == NULL)
+        {
+            free(buffer);
+            close(socket_fd);
+            return ERR_OUT_OF_MEMORY;
+        }
+        buffer = shrunk_buffer;
     }
     free(buffer);
-    buffer = NULL;
-    close(*socket_fd);
-    free(socket_fd);
-    socket_fd = NULL;
-    return &our_ERR_NONE;
+    close(socket_fd);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Sets a socket in non-blocking mode, or back in blocking mode
+ *******************************************************************/
+static int set_nonblocking(int socket_fd, int nonblocking)
+{
+    const int flags = fcntl(socket_fd, F_GETFL);
+    if (flags == -1)
+    {
+        return ERR_IO;
+    }
+    const int new_flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(socket_fd, F_SETFL, new_flags) == -1 ? ERR_IO : ERR_NONE;
+}
+
+/*******************************************************************
+ * Frees the request an event connection was receiving
+ *******************************************************************/
+static void release_request(struct event_connection *connection)
+{
+    free(connection->buffer);
+    connection->buffer = NULL;
+    free(connection->message);
+    connection->message = NULL;
+    free(connection->parser);
+    connection->parser = NULL;
+    connection->buffer_size = EMPTY;
+    connection->received = EMPTY;
+    connection->content_len = EMPTY;
+}
+
+/*******************************************************************
+ * Removes a connection from the list of the open ones, whose lock
+ * must be held
+ *******************************************************************/
+static void unlink_connection(struct event_connection *connection)
+{
+    if (connection->prev != NULL)
+    {
+        connection->prev->next = connection->next;
+    }
+    else if (connections.head == connection)
+    {
+        connections.head = connection->next;
+    }
+    if (connection->next != NULL)
+    {
+        connection->next->prev = connection->prev;
+    }
+    connection->prev = NULL;
+    connection->next = NULL;
+}
+
+/*******************************************************************
+ * Closes an event connection, which also removes it from the epoll set
+ *******************************************************************/
+static void close_event_connection(struct event_connection *connection)
+{
+    pthread_mutex_lock(&connections.lock);
+    unlink_connection(connection);
+    pthread_mutex_unlock(&connections.lock);
+
+    close(connection->socket);
+    release_request(connection);
+    free(connection);
+}
+
+/*******************************************************************
+ * Closes the connections the event loop watched for too long without
+ * receiving anything
+ *******************************************************************/
+static void close_idle_connections(void)
+{
+    const uint64_t now = now_ms();
+    if (now - connections.last_sweep_ms < IDLE_SWEEP_MS)
+    {
+        return;
+    }
+    connections.last_sweep_ms = now;
+
+    pthread_mutex_lock(&connections.lock);
+    struct event_connection *connection = connections.head;
+    while (connection != NULL)
+    {
+        struct event_connection *next = connection->next;
+        if (connection->watched && now - connection->last_active_ms > KEEP_ALIVE_TIMEOUT_MS)
+        {
+            unlink_connection(connection);
+            close(connection->socket);
+            release_request(connection);
+            free(connection);
+        }
+        connection = next;
+    }
+    pthread_mutex_unlock(&connections.lock);
+}
+
+/*******************************************************************
+ * Asks the event loop to report the next data of a connection
+ *******************************************************************/
+static int watch_connection(struct event_connection *connection, int operation)
+{
+    struct epoll_event event = {.events = CONNECTION_EVENTS, .data.ptr = connection};
+    return epoll_ctl(epoll_fd, operation, connection->socket, &event) == -1 ? ERR_IO : ERR_NONE;
+}
+
+/*******************************************************************
+ * Serves the request of an event connection, from a worker thread,
+ * then the requests pipelined after it
+ *******************************************************************/
+static int serve_request(struct event_connection *connection)
+{
+    // The callback sends its whole reply at once: let it block meanwhile
+    int ret = set_nonblocking(connection->socket, 0);
+    int keep_alive = NON_EMPTY;
+    while (ret == ERR_NONE)
+    {
+        ret = serve_message(connection->socket, connection->message, &keep_alive);
+        if (ret != ERR_NONE || !keep_alive)
+        {
+            keep_alive = EMPTY;
+            break;
+        }
+
+        // No event will announce the requests already received: serve them now
+        connection->received = keep_leftover(connection->buffer, connection->received, connection->parser,
+                                             connection->message);
+        connection->content_len = EMPTY;
+        memset(connection->message, 0, sizeof(struct http_message));
+        if (connection->received == EMPTY)
+        {
+            break;
+        }
+        const int parse_result = http_parser_execute(connection->parser, connection->buffer, connection->received,
+                                                     connection->message, &connection->content_len);
+        if (parse_result < 0)
+        {
+            ret = ERR_IO;
+        }
+        else if (parse_result == 0 && start_streamed_body(connection->message, connection->parser, connection->buffer,
+                                                          connection->received, connection->content_len) != FOUND)
+        {
+            break;
+        }
+    }
+    if (ret == ERR_NONE && keep_alive)
+    {
+        ret = set_nonblocking(connection->socket, 1);
+    }
+    if (connection->received == EMPTY)
+    {
+        release_request(connection);
+    }
+
+    // Once watched again, the connection belongs to the event loop
+    if (ret == ERR_NONE && keep_alive)
+    {
+        pthread_mutex_lock(&connections.lock);
+        connection->last_active_ms = now_ms();
+        ret = watch_connection(connection, EPOLL_CTL_MOD);
+        connection->watched = ret == ERR_NONE;
+        pthread_mutex_unlock(&connections.lock);
+    }
+    if (ret != ERR_NONE || !keep_alive)
+    {
+        close_event_connection(connection);
+    }
+    return ret;
+}
+
+/*******************************************************************
+ * Worker thread: serves the queued jobs one after the other
+ *******************************************************************/
+static void *connection_worker(void *arg _unused)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1)
+    {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0 && !queue.stopping)
+        {
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+        }
+        if (queue.stopping)
+        {
+            pthread_mutex_unlock(&queue.lock);
+            return NULL;
+        }
+        const struct connection_job job = queue.jobs[queue.head];
+        queue.head = (queue.head + 1) % queue.capacity;
+        queue.count--;
+        pthread_mutex_unlock(&queue.lock);
+
+        const int ret = job.connection == NULL ? handle_connection(job.socket) : serve_request(job.connection);
+        if (ret != ERR_NONE)
+        {
+            debug_printf("connection_worker(): %s\n", ERR_MSG(ret));
+        }
+    }
+}
+
+/*******************************************************************
+ * Set the size of the worker pool
+ *******************************************************************/
+int http_set_pool_size(size_t workers, size_t queue_capacity)
+{
+    if (workers == 0 || queue_capacity == 0 || passive_socket != -1)
+    {
+        return ERR_INVALID_ARGUMENT;
+    }
+    nb_workers = workers;
+    queue.capacity = queue_capacity;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Set how the connections are waited for
+ *******************************************************************/
+int http_set_mode(enum http_server_mode mode)
+{
+    if ((mode != HTTP_THREAD_POOL && mode != HTTP_EVENT_LOOP) || passive_socket != -1)
+    {
+        return ERR_INVALID_ARGUMENT;
+    }
+    server_mode = mode;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Start the worker pool
+ *******************************************************************/
+static int start_workers(void)
+{
+    queue.jobs = calloc(queue.capacity, sizeof(struct connection_job));
+    if (queue.jobs == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    queue.head = EMPTY;
+    queue.count = EMPTY;
+    queue.stopping = EMPTY;
+
+    worker_threads = calloc(nb_workers, sizeof(pthread_t));
+    if (worker_threads == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    // The workers already started are joined by http_close()
+    for (nb_started = 0; nb_started < nb_workers; nb_started++)
+    {
+        if (pthread_create(&worker_threads[nb_started], NULL, connection_worker, NULL))
+        {
+            return ERR_THREADING;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Start watching the passive socket
+ *******************************************************************/
+static int start_event_loop(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        return ERR_IO;
+    }
+
+    // The passive socket is the only one watched with a NULL pointer, the wake pipe with its own address
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event wake_event = {.events = EPOLLIN, .data.ptr = wake_pipe};
+    if (set_nonblocking(passive_socket, 1) != ERR_NONE
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, passive_socket, &event) == -1
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_pipe[0], &wake_event) == -1)
+    {
+        return ERR_IO;
+    }
+    return ERR_NONE;
 }
 
 /*******************************************************************
@@ -171,6 +647,34 @@ int http_init(uint16_t port, EventCallback callback)
 {
     passive_socket = tcp_server_init(port);
     cb = callback;
+    if (passive_socket < 0)
+    {
+        return passive_socket;
+    }
+
+    int ret = ERR_NONE;
+    if (pipe(wake_pipe) == -1)
+    {
+        wake_pipe[0] = wake_pipe[1] = -1;
+        ret = ERR_IO;
+    }
+    else if (set_nonblocking(wake_pipe[0], 1) != ERR_NONE || set_nonblocking(wake_pipe[1], 1) != ERR_NONE)
+    {
+        ret = ERR_IO;
+    }
+    if (ret == ERR_NONE && server_mode == HTTP_EVENT_LOOP)
+    {
+        ret = start_event_loop();
+    }
+    if (ret == ERR_NONE)
+    {
+        ret = start_workers();
+    }
+    if (ret != ERR_NONE)
+    {
+        http_close();
+        return ret;
+    }
     return passive_socket;
 }
 
@@ -186,49 +690,334 @@ void http_close(void)
         else
             passive_socket = -1;
     }
+
+    // Stop the workers once their current job is done
+    pthread_mutex_lock(&queue.lock);
+    queue.stopping = NON_EMPTY;
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+    for (size_t i = 0; i < nb_started; i++)
+    {
+        pthread_join(worker_threads[i], NULL);
+    }
+    free(worker_threads);
+    worker_threads = NULL;
+    nb_started = EMPTY;
+
+    // Drop the jobs they did not take
+    for (; queue.count > 0; queue.count--)
+    {
+        const struct connection_job job = queue.jobs[queue.head];
+        if (job.connection != NULL)
+        {
+            close_event_connection(job.connection);
+        }
+        else
+        {
+            close(job.socket);
+        }
+        queue.head = (queue.head + 1) % queue.capacity;
+    }
+    free(queue.jobs);
+    queue.jobs = NULL;
+
+    // Close the connections the event loop was still watching
+    while (connections.head != NULL)
+    {
+        close_event_connection(connections.head);
+    }
+    if (epoll_fd != -1)
+    {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (wake_pipe[i] != -1)
+        {
+            close(wake_pipe[i]);
+            wake_pipe[i] = -1;
+        }
+    }
 }
 
 /*******************************************************************
- * Receive content
+ * Wakes up http_receive(), from a signal handler
  */
-int http_receive(void)
+void http_interrupt(void)
 {
-    if (passive_socket == -1)
+    const int saved_errno = errno;
+    if (wake_pipe[1] != -1)
     {
-        return ERR_IO;
+        // A full pipe already wakes http_receive() up
+        const ssize_t written = write(wake_pipe[1], "", ONE_ELEMENT);
+        (void)written;
+    }
+    errno = saved_errno;
+}
+
+/*******************************************************************
+ * Empties the wake pipe, once http_receive() is awake
+ *******************************************************************/
+static void drain_wake_pipe(void)
+{
+    char bytes[MAX_EVENTS];
+    while (read(wake_pipe[0], bytes, sizeof(bytes)) > 0)
+        ;
+}
+
+/*******************************************************************
+ * Hands a job over to the workers. Returns 0 if they are all busy
+ * and too many jobs are already waiting.
+ *******************************************************************/
+static int enqueue_job(int socket_fd, struct event_connection *connection)
+{
+    pthread_mutex_lock(&queue.lock);
+    const int accepted = queue.count < queue.capacity && !queue.stopping;
+    if (accepted)
+    {
+        struct connection_job *job = &queue.jobs[(queue.head + queue.count) % queue.capacity];
+        job->socket = socket_fd;
+        job->connection = connection;
+        queue.count++;
+        pthread_cond_signal(&queue.not_empty);
+    }
+    pthread_mutex_unlock(&queue.lock);
+
+    // Shed the load rather than letting the backlog grow without bound
+    if (!accepted)
+    {
+        http_reply(socket_fd, HTTP_UNAVAILABLE, CONNECTION_CLOSE, "", 0);
     }
-    int *active_socket = malloc(sizeof(int));
-    if (active_socket == NULL)
+    return accepted;
+}
+
+/*******************************************************************
+ * Makes room for the next bytes of a request
+ *******************************************************************/
+static int grow_request(struct event_connection *connection)
+{
+    size_t size = 2 * connection->buffer_size;
+    if (connection->content_len > 0)
+    {
+        // Same room as handle_connection(): the headers, then the whole body
+        if (connection->content_len > MAX_REQUEST_SIZE)
+        {
+            return ERR_INVALID_ARGUMENT;
+        }
+        size = MAX_HEADER_SIZE + (size_t)connection->content_len + NULL_TERMINATOR;
+    }
+    else if (size > MAX_HEADER_SIZE + NULL_TERMINATOR)
+    {
+        size = MAX_HEADER_SIZE + NULL_TERMINATOR;
+    }
+    if (size <= connection->buffer_size)
+    {
+        // Headers or body longer than allowed
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char *buffer = realloc(connection->buffer, size);
+    if (buffer == NULL)
     {
         return ERR_OUT_OF_MEMORY;
     }
-    *active_socket = tcp_accept(passive_socket);
-    if (*active_socket == -1)
+    connection->buffer = buffer;
+    connection->buffer_size = size;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Reads all the bytes a connection received, and hands its request
+ * over to the workers once it is complete
+ *******************************************************************/
+static int receive_request(struct event_connection *connection)
+{
+    if (connection->buffer == NULL)
     {
-        free(active_socket);
-        active_socket = NULL;
-        return ERR_IO;
+        connection->buffer = malloc(INITIAL_READ_SIZE);
+        connection->message = malloc(sizeof(struct http_message));
+        connection->parser = malloc(sizeof(struct http_parser));
+        if (connection->buffer == NULL || connection->message == NULL || connection->parser == NULL)
+        {
+            return ERR_OUT_OF_MEMORY;
+        }
+        connection->buffer_size = INITIAL_READ_SIZE;
+        http_parser_init(connection->parser);
     }
 
-    // Initialize pthread attributes
-    pthread_attr_t attr;
-    pthread_t thread;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1)
+    {
+        if (connection->received + NULL_TERMINATOR == connection->buffer_size)
+        {
+            const int ret = grow_request(connection);
+            if (ret != ERR_NONE)
+            {
+                return ret;
+            }
+        }
+
+        const ssize_t currently_read = tcp_read(connection->socket, connection->buffer + connection->received,
+                                                connection->buffer_size - connection->received - NULL_TERMINATOR);
+        if (currently_read < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Wait for the rest of the request without holding a thread
+                if (connection->received == EMPTY)
+                {
+                    release_request(connection);
+                }
+                return watch_connection(connection, EPOLL_CTL_MOD);
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ERR_IO;
+        }
+        if (currently_read == 0)
+        {
+            // Closed by the client
+            return ERR_IO;
+        }
+
+        connection->received += (size_t)currently_read;
+        connection->buffer[connection->received] = '\0';
+        connection->last_active_ms = now_ms();
+
+        const int parse_result = http_parser_execute(connection->parser, connection->buffer, connection->received,
+                                                     connection->message, &connection->content_len);
+        if (parse_result < 0)
+        {
+            return ERR_IO;
+        }
+        if (parse_result > 0 || start_streamed_body(connection->message, connection->parser, connection->buffer,
+                                                    connection->received, connection->content_len) == FOUND)
+        {
+            // The connection is not watched until the worker is done with it
+            pthread_mutex_lock(&connections.lock);
+            connection->watched = EMPTY;
+            pthread_mutex_unlock(&connections.lock);
+            return enqueue_job(connection->socket, connection) ? ERR_NONE : ERR_THREADING;
+        }
+    }
+}
 
-    // Create a detached thread to handle the connection
-    if (pthread_create(&thread, &attr, (void *(*)(void *))handle_connection, (void *)active_socket))
+/*******************************************************************
+ * Accepts all the pending connections and starts watching them
+ *******************************************************************/
+static int accept_connections(void)
+{
+    while (1)
     {
-        pthread_attr_destroy(&attr);
-        return ERR_THREADING;
+        const int socket_fd = tcp_accept(passive_socket);
+        if (socket_fd == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+            {
+                return ERR_NONE;
+            }
+            return ERR_IO;
+        }
+
+        struct event_connection *connection = calloc(ONE_ELEMENT, sizeof(struct event_connection));
+        if (connection == NULL)
+        {
+            close(socket_fd);
+            continue;
+        }
+        connection->socket = socket_fd;
+        connection->last_active_ms = now_ms();
+        connection->watched = NON_EMPTY;
+        pthread_mutex_lock(&connections.lock);
+        connection->next = connections.head;
+        if (connections.head != NULL)
+        {
+            connections.head->prev = connection;
+        }
+        connections.head = connection;
+        pthread_mutex_unlock(&connections.lock);
+
+        if (set_nonblocking(socket_fd, 1) != ERR_NONE || watch_connection(connection, EPOLL_CTL_ADD) != ERR_NONE)
+        {
+            close_event_connection(connection);
+        }
     }
+}
 
-    // Destroy pthread attributes after use
-    if (pthread_attr_destroy(&attr))
+/*******************************************************************
+ * Waits for events and reacts to them
+ *******************************************************************/
+static int receive_events(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    // Wake up regularly, to close the idle connections even if nothing happens
+    const int nb_events = epoll_wait(epoll_fd, events, MAX_EVENTS, IDLE_SWEEP_MS);
+    if (nb_events == -1)
     {
-        return ERR_THREADING;
+        return errno == EINTR ? ERR_NONE : ERR_IO;
     }
 
+    for (int i = 0; i < nb_events; i++)
+    {
+        struct event_connection *connection = events[i].data.ptr;
+        if (events[i].data.ptr == wake_pipe)
+        {
+            drain_wake_pipe();
+        }
+        else if (connection == NULL)
+        {
+            const int ret = accept_connections();
+            if (ret != ERR_NONE)
+            {
+                return ret;
+            }
+        }
+        else if ((events[i].events & EPOLLERR) || receive_request(connection) != ERR_NONE)
+        {
+            close_event_connection(connection);
+        }
+    }
+    close_idle_connections();
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Receive content
+ */
+int http_receive(void)
+{
+    if (passive_socket == -1)
+    {
+        return ERR_IO;
+    }
+    if (server_mode == HTTP_EVENT_LOOP)
+    {
+        return receive_events();
+    }
+
+    // Wait for a connection, or for http_interrupt()
+    struct pollfd fds[] = {{.fd = passive_socket, .events = POLLIN}, {.fd = wake_pipe[0], .events = POLLIN}};
+    if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) == -1)
+    {
+        return errno == EINTR ? ERR_NONE : ERR_IO;
+    }
+    if (fds[1].revents)
+    {
+        drain_wake_pipe();
+        return ERR_NONE;
+    }
+
+    const int active_socket = tcp_accept(passive_socket);
+    if (active_socket == -1)
+    {
+        return errno == EINTR || errno == ECONNABORTED ? ERR_NONE : ERR_IO;
+    }
+    if (!enqueue_job(active_socket, NULL))
+    {
+        close(active_socket);
+    }
     return ERR_NONE;
 }
 
@@ -288,54 +1077,167 @@ int http_serve_file(int connection, const char *filename)
     return ret;
 }
 
-// /*******************************************************************
-//  * Create and send HTTP reply
-//  */
+/*******************************************************************
+ * Formats the status line and the headers of a reply, telling the
+ * client when the connection is closed after it
+ */
+static int format_header(char **header, int connection, const char *status, const char *headers, size_t body_len)
+{
+    const char *closing = connection == closing_connection ? CONNECTION_CLOSE : "";
+    const int header_length = snprintf(NULL, 0, "%s%s%s%s%sContent-Length: %zu%s",
+                                       HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, closing, body_len,
+                                       HTTP_HDR_END_DELIM);
+    if (header_length < 0)
+    {
+        return ERR_IO;
+    }
+
+    *header = malloc((size_t)header_length + NULL_TERMINATOR);
+    if (*header == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    snprintf(*header, (size_t)header_length + NULL_TERMINATOR, "%s%s%s%s%sContent-Length: %zu%s",
+             HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, closing, body_len, HTTP_HDR_END_DELIM);
+    return header_length;
+}
+
+/*******************************************************************
+ * Sends all the buffers, however many calls it takes
+ */
+static int writev_all(int connection, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(connection, iov, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ERR_IO;
+        }
+
+        // Skip what was sent
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Create and send HTTP reply
+ */
 int http_reply(int connection, const char *status, const char *headers, const char *body, size_t body_len)
 {
     M_REQUIRE_NON_NULL(status);
     M_REQUIRE_NON_NULL(headers);
 
-    size_t content_length_size = (size_t)snprintf(NULL, 0, "%zu", body_len);
-    if (content_length_size < 0)
+    char *header = NULL;
+    const int header_length = format_header(&header, connection, status, headers, body_len);
+    if (header_length < 0)
     {
-        return ERR_IO;
+        return header_length;
     }
 
-    size_t header_size = strlen(HTTP_PROTOCOL_ID) + strlen(status) + strlen(HTTP_LINE_DELIM) +
-                         strlen(headers) + strlen("Content-Length: ") + content_length_size +
-                         strlen(HTTP_HDR_END_DELIM);
+    // The body is sent from where it is rather than copied after the header
+    struct iovec iov[] = {{.iov_base = header, .iov_len = (size_t)header_length},
+                          {.iov_base = (void *)(uintptr_t)body, .iov_len = body == NULL ? 0 : body_len}};
+    const int ret = writev_all(connection, iov, sizeof(iov) / sizeof(iov[0]));
+    free(header);
+    return ret;
+}
+
+/*******************************************************************
+ * Create and send HTTP reply whose body is a part of a file
+ */
+int http_reply_file(int connection, const char *status, const char *headers, int fd, uint64_t offset, size_t body_len)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
 
-    size_t total_size = header_size + body_len + 1;
+    char *header = NULL;
+    const int header_length = format_header(&header, connection, status, headers, body_len);
+    if (header_length < 0)
+    {
+        return header_length;
+    }
+    struct iovec iov = {.iov_base = header, .iov_len = (size_t)header_length};
+    const int ret = writev_all(connection, &iov, ONE_ELEMENT);
+    free(header);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
 
-    char *buffer = calloc(1, total_size);
-    if (buffer == NULL)
+    // The kernel copies the body from the page cache to the socket
+    off_t file_offset = (off_t)offset;
+    size_t remaining = body_len;
+    while (remaining > 0)
     {
-        return ERR_OUT_OF_MEMORY;
+        const ssize_t sent = sendfile(connection, fd, &file_offset, remaining);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            // Error, or the file is shorter than announced
+            return ERR_IO;
+        }
+        remaining -= (size_t)sent;
     }
+    return ERR_NONE;
+}
 
-    int header_length = snprintf(buffer, total_size, "%s%s%s%sContent-Length: %zu%s",
-                                 HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, body_len, HTTP_HDR_END_DELIM);
+/*******************************************************************
+ * Read the next bytes of the body of a request
+ */
+int http_read_body(int connection, struct http_message *message, char *buffer, size_t size)
+{
+    M_REQUIRE_NON_NULL(message);
+    M_REQUIRE_NON_NULL(buffer);
 
-    if (header_length < 0)
+    if (size > message->body_remaining)
     {
-        free(buffer);
-        buffer = NULL;
-        return ERR_IO;
+        size = message->body_remaining;
+    }
+    if (size > INT_MAX)
+    {
+        size = INT_MAX;
+    }
+    if (size == 0)
+    {
+        return 0;
     }
 
-    if (body)
+    // A body which stalls, like headers which stall, holds a worker no longer
+    ssize_t currently_read = -1;
+    if (wait_readable(connection, EMPTY) > 0)
     {
-        memcpy(buffer + header_length, body, body_len);
+        do
+        {
+            currently_read = tcp_read(connection, buffer, size);
+        } while (currently_read < 0 && errno == EINTR);
     }
 
-    if (tcp_send(connection, buffer, (size_t)header_length + body_len) == -1)
+    // The connection was closed, or stalled, before the end of the body:
+    // the rest of the body cannot be skipped, so the reply is the last one
+    if (currently_read <= 0)
     {
-        free(buffer);
-        buffer = NULL;
+        closing_connection = connection;
         return ERR_IO;
     }
-    free(buffer);
-    buffer = NULL;
-    return ERR_NONE;
+    message->body_remaining -= (size_t)currently_read;
+    return (int)currently_read;
 }
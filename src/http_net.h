@@ -12,6 +12,7 @@
 
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
 #define MAX_HEADER_SIZE    16384 // 2^14 -> to handle http headers
+#define STREAMED_BODY_SIZE 65536 // 2^16 -> larger bodies are not buffered, see http_read_body()
 
 /* **********************************************************************
  * TODO WEEK 11: DEFINE EventCallback HERE
@@ -24,6 +25,39 @@
 
 typedef int (*EventCallback)(struct http_message*, int);
 
+/**
+ * @brief Sets the number of worker threads serving the connections and the
+ *        number of accepted connections which may wait for one of them.
+ *
+ * Must be called before http_init(). Connections accepted while the queue
+ * is full get a "503 Service Unavailable" reply.
+ *
+ * Returns: some error code. 0 if no error.
+ */
+int http_set_pool_size(size_t workers, size_t queue_capacity);
+
+/**
+ * @brief How the server waits for the requests of its clients.
+ *
+ * HTTP_THREAD_POOL: each connection holds a worker thread until it is closed.
+ * HTTP_EVENT_LOOP: http_receive() watches every connection with epoll and
+ * only hands complete requests over to the worker threads, so that idle
+ * keep-alive connections hold neither a thread nor a buffer.
+ */
+enum http_server_mode {
+    HTTP_THREAD_POOL,
+    HTTP_EVENT_LOOP
+};
+
+/**
+ * @brief Sets how the server waits for requests (HTTP_THREAD_POOL by default).
+ *
+ * Must be called before http_init().
+ *
+ * Returns: some error code. 0 if no error.
+ */
+int http_set_mode(enum http_server_mode mode);
+
 int http_init(uint16_t port, EventCallback cb);
 
 int http_receive(void);
@@ -32,4 +66,43 @@ int http_serve_file(int connection, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Sends a reply whose body is body_len bytes of the file fd, starting at offset.
+ *
+ * The body is sent with sendfile(): it goes from the page cache to the
+ * socket without being copied in userspace.
+ *
+ * Returns: some error code. 0 if no error.
+ */
+int http_reply_file(int connection, const char* status, const char* headers, int fd, uint64_t offset, size_t body_len);
+
+/**
+ * @brief Reads the next bytes of the body of a request.
+ *
+ * The body of a request larger than STREAMED_BODY_SIZE is not buffered:
+ * the callback gets the request as soon as its headers are received,
+ * with the first bytes of the body in message->body and the number of
+ * bytes still to come in message->body_remaining. The callback reads
+ * them (or not: they are then skipped) with this function, and can
+ * block meanwhile: at most until the client stays silent for as long as
+ * an idle keep-alive connection, or until the server stops.
+ *
+ * Returns: the number of bytes put in buffer (0 once the whole body is
+ * read), or some (negative) error code, e.g. ERR_IO if the body stalls.
+ */
+int http_read_body(int connection, struct http_message* message, char* buffer, size_t size);
+
+/**
+ * @brief Stops the server: waits for the worker threads to finish their
+ *        current request, then closes every connection.
+ */
 void http_close(void);
+
+/**
+ * @brief Makes the http_receive() call in progress, or the next one,
+ *        return ERR_NONE without waiting for a connection.
+ *
+ * Async-signal-safe: a signal handler calls it after having set the flag
+ * the loop calling http_receive() checks.
+ */
+void http_interrupt(void);
@@ -1,8 +1,11 @@
 #include "http_prot.h"
+#include "http_scan.h"
 #include <string.h>
 #include "util.h"
 #include "error.h"
 #include <stdlib.h>
+#include <limits.h>  // INT_MAX
+#include <strings.h> // strncasecmp
 #include "imgfs.h"
 
 /*************************************************************************
@@ -16,6 +19,21 @@ int http_match_uri(const struct http_message *message, const char *target_uri)
     return !strncmp(message->uri.val, target_uri, strlen(target_uri));
 }
 
+/*************************************************************************
+ * Gives the path of an URI: the URI without its query string, if any
+ ************************************************************************* */
+int http_uri_path(const struct http_string *uri, struct http_string *path)
+{
+    M_REQUIRE_NON_NULL(uri);
+    M_REQUIRE_NON_NULL(uri->val);
+    M_REQUIRE_NON_NULL(path);
+
+    const char *query = memchr(uri->val, '?', uri->len);
+    path->val = uri->val;
+    path->len = query == NULL ? uri->len : (size_t)(query - uri->val);
+    return ERR_NONE;
+}
+
 /************************************************************************
  * Compare method with verb and return 1 if they are equal, 0 otherwise
  ************************************************************************ */
@@ -36,168 +54,447 @@ int http_match_verb(const struct http_string *method, const char *verb)
 }
 
 /************************************************************************
- * Writes the value of parameter `name` from URL in message to buffer out.
+ * Tells whether a string is `expected`, ignoring case
  ************************************************************************ */
-int http_get_var(const struct http_string *url, const char *name, char *out, size_t out_len)
+static int http_string_is(const struct http_string *string, const char *expected)
 {
-    M_REQUIRE_NON_NULL(url);
-    M_REQUIRE_NON_NULL(url->val);
-    M_REQUIRE_NON_NULL(name);
-    M_REQUIRE_NON_NULL(out);
+    return string->len == strlen(expected) && !strncasecmp(string->val, expected, string->len);
+}
 
-    char parameter[strlen(name) + 1 + NULL_TERMINATOR]; // +1 for '='
-    if (snprintf(parameter, sizeof(parameter), "%s=", name) < 0)
+/************************************************************************
+ * Tells whether the connection stays open after the reply to a request
+ ************************************************************************ */
+int http_keep_alive(const struct http_message *message)
+{
+    M_REQUIRE_NON_NULL(message);
+
+    for (size_t i = 0; i < message->num_headers; i++)
     {
-        return ERR_IO;
+        const struct http_header *header = &message->headers[i];
+        if (http_string_is(&header->key, "Connection"))
+        {
+            if (http_string_is(&header->value, "close"))
+            {
+                return 0;
+            }
+            if (http_string_is(&header->value, "keep-alive"))
+            {
+                return 1;
+            }
+        }
     }
 
-    // Look for '?' in the url
-    const char *url_args = strchr(url->val, '?');
-    if (!url_args)
+    // Persistent connections are the default since HTTP/1.1 only
+    return message->version.len > 0 && !http_string_is(&message->version, "HTTP/1.0")
+           && !http_string_is(&message->version, "HTTP/0.9");
+}
+
+/************************************************************************
+ * Splits the variable starting at var, up to the next '&' or to end,
+ * into its key and its value. Returns the end of the variable.
+ ************************************************************************ */
+static const char *split_var(const char *var, const char *end, struct http_header *pair)
+{
+    const char *var_end = memchr(var, '&', (size_t)(end - var));
+    if (var_end == NULL)
     {
-        return 0;
+        var_end = end;
     }
-    url_args++;
+    const char *equal = memchr(var, '=', (size_t)(var_end - var));
+    pair->key.val = var;
+    pair->key.len = (size_t)((equal == NULL ? var_end : equal) - var);
+    pair->value.val = equal == NULL ? var_end : equal + 1;
+    pair->value.len = (size_t)(var_end - pair->value.val);
+    return var_end;
+}
+
+/************************************************************************
+ * Splits the query string of an URI into its variables
+ ************************************************************************ */
+int http_parse_query(const struct http_string *uri, struct http_query *query)
+{
+    M_REQUIRE_NON_NULL(uri);
+    M_REQUIRE_NON_NULL(uri->val);
+    M_REQUIRE_NON_NULL(query);
 
-    // Look for the parameter in the url
-    const char *param_start = strstr(url_args, parameter);
-    if (!param_start)
+    query->num_vars = 0;
+    const char *end = uri->val + uri->len;
+    query->rest = (struct http_string){end, 0};
+    const char *var = memchr(uri->val, '?', uri->len);
+    if (var == NULL)
     {
-        return 0;
+        return ERR_NONE;
     }
-    param_start += strlen(parameter);
 
-    // Look for the end of the parameter
-    const char *param_end = strchr(param_start, '&');
-    if (!param_end)
+    while (var < end)
     {
-        param_end = url->val + url->len;
+        // The other variables are scanned by http_query_get(), if ever needed
+        if (query->num_vars == MAX_QUERY_VARS)
+        {
+            query->rest = (struct http_string){var, (size_t)(end - var)};
+            break;
+        }
+
+        var++; // skip the '?' or '&'
+        struct http_header pair;
+        const char *var_end = split_var(var, end, &pair);
+
+        // "a&&b" has no empty variable between a and b
+        if (var_end > var)
+        {
+            query->vars[query->num_vars++] = pair;
+        }
+        var = var_end;
     }
+    return ERR_NONE;
+}
 
-    int value_len = (int)(param_end - param_start);
-    if (value_len >= (int)out_len)
+/************************************************************************
+ * Value of an hexadecimal digit, -1 if it is none
+ ************************************************************************ */
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
     {
-        return ERR_RUNTIME;
+        return c - '0';
     }
-
-    strncpy(out, param_start, (size_t)value_len);
-    out[value_len] = '\0';
-    return value_len;
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
 }
 
-/************************************************************************************************************
- * Writes the message, until the delimiter, in the output struct and returns the next char after the delimiter
- ************************************************************************************************************ */
-static const char *get_next_token(const char *message, const char *delimiter, struct http_string *output)
+/************************************************************************
+ * Writes the percent-decoded value of a variable of a query string.
+ ************************************************************************ */
+int http_query_get(const struct http_query *query, const char *name, char *out, size_t out_len)
 {
-    if (message == NULL || delimiter == NULL)
-        return NULL;
+    M_REQUIRE_NON_NULL(query);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(out);
 
-    const char *end = strstr(message, delimiter);
-    if (!end)
+    const size_t name_len = strlen(name);
+    const struct http_string *value = NULL;
+    for (size_t i = 0; i < query->num_vars && value == NULL; i++)
     {
-        if (output)
+        const struct http_string *key = &query->vars[i].key;
+        if (key->len == name_len && !memcmp(key->val, name, name_len))
         {
-            output->val = message;
-            output->len = strlen(message);
+            value = &query->vars[i].value;
         }
-        return message + strlen(message);
     }
 
-    if (output)
+    // A query string with more variables than the parsed ones
+    struct http_header pair;
+    const char *end = query->rest.val + query->rest.len;
+    for (const char *var = query->rest.val; var < end && value == NULL;)
     {
-        output->val = message;
-        output->len = (size_t)(end - message);
+        var = split_var(var + 1, end, &pair);
+        if (pair.key.len == name_len && !memcmp(pair.key.val, name, name_len))
+        {
+            value = &pair.value;
+        }
     }
+    if (value == NULL)
+    {
+        return 0;
+    }
+    if (out_len == 0)
+    {
+        return ERR_RUNTIME;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < value->len; i++, len++)
+    {
+        if (len + NULL_TERMINATOR >= out_len || len >= INT_MAX)
+        {
+            return ERR_RUNTIME;
+        }
+        if (value->val[i] != '%')
+        {
+            out[len] = value->val[i] == '+' ? ' ' : value->val[i];
+            continue;
+        }
 
-    return end + strlen(delimiter);
+        const int high = i + 2 < value->len ? hex_value(value->val[i + 1]) : -1;
+        const int low = high >= 0 ? hex_value(value->val[i + 2]) : -1;
+        if (low < 0)
+        {
+            return ERR_INVALID_ARGUMENT;
+        }
+        out[len] = (char)(16 * high + low);
+        i += 2;
+    }
+    out[len] = '\0';
+    return (int)len;
 }
 
-/************************************************************************************************************
- * Parses the headers of the message and returns the next char after the last header
- ************************************************************************************************************ */
-static const char *http_parse_headers(const char *header_start, struct http_message *output)
+/************************************************************************
+ * Writes the value of parameter `name` from URL in message to buffer out.
+ ************************************************************************ */
+int http_get_var(const struct http_string *url, const char *name, char *out, size_t out_len)
 {
-    // Static assert to check that one delimiter is twice the other
-    _Static_assert(strcmp(HTTP_HDR_END_DELIM, HTTP_LINE_DELIM HTTP_LINE_DELIM) == 0, "HTTP_HDR_END_DELIM is not twice HTTP_LINE_DELIM");
+    M_REQUIRE_NON_NULL(url);
+    M_REQUIRE_NON_NULL(url->val);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(out);
 
-    if (header_start == NULL || output == NULL)
-        return NULL;
+    struct http_query query;
+    const int ret = http_parse_query(url, &query);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+    return http_query_get(&query, name, out, out_len);
+}
 
-    const char *remaining = header_start;
-    struct http_string pair;
+/************************************************************************
+ * Value of the Content-Length header, 0 if there is none, or a negative
+ * value if it is not a valid length
+ ************************************************************************ */
+static int parsed_content_len(const struct http_parser *parser, const char *stream)
+{
+    static const char key[] = "Content-Length";
+    for (size_t i = 0; i < parser->num_headers; i++)
+    {
+        if (parser->keys[i].len != strlen(key) || strncasecmp(stream + parser->keys[i].offset, key, strlen(key)))
+        {
+            continue;
+        }
 
-    // Put key in output
-    remaining = get_next_token(remaining, HTTP_HDR_KV_DELIM, &pair);
-    if (remaining == NULL)
-        return NULL;
-    output->headers[output->num_headers].key = pair;
-    pair.val = NULL;
-    remaining = get_next_token(remaining, HTTP_LINE_DELIM, &pair);
-    output->headers[output->num_headers].value = pair;
+        const char *digits = stream + parser->values[i].offset;
+        long value = 0;
+        size_t n = 0;
+        for (; n < parser->values[i].len && digits[n] >= '0' && digits[n] <= '9'; n++)
+        {
+            value = 10 * value + (digits[n] - '0');
+            if (value > INT_MAX)
+            {
+                return -1;
+            }
+        }
+        return n == 0 ? -1 : (int)value;
+    }
+    return 0;
+}
 
-    return remaining;
+/************************************************************************
+ * Start parsing a new request
+ ************************************************************************ */
+void http_parser_init(struct http_parser *parser)
+{
+    if (parser != NULL)
+    {
+        parser->state = HTTP_PARSE_METHOD;
+        parser->position = 0;
+        parser->token_start = 0;
+        parser->num_headers = 0;
+        parser->body_start = 0;
+        parser->content_len = 0;
+    }
 }
 
 /************************************************************************
- * Accepts a potentially partial TCP stream and parses an HTTP message.
+ * Parses the bytes of the request line and of the headers received
+ * since the last call. Returns a negative value if they are malformed.
  ************************************************************************ */
-int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
+static int parse_headers(struct http_parser *parser, const char *stream, size_t bytes_received)
 {
-    M_REQUIRE_NON_NULL(stream);
-    M_REQUIRE_NON_NULL(out);
-    M_REQUIRE_NON_NULL(content_len);
+    size_t pos = parser->position;
+    while (parser->state != HTTP_PARSE_BODY && pos < bytes_received)
+    {
+        switch (parser->state)
+        {
+        case HTTP_PARSE_METHOD:
+            // Empty lines may come before a request, e.g. after the body of the previous one
+            if (pos == parser->token_start && (stream[pos] == '\r' || stream[pos] == '\n'))
+            {
+                parser->token_start = ++pos;
+                break;
+            }
+            pos = http_scan(stream, pos, bytes_received, ' ', '\r');
+            if (pos < bytes_received)
+            {
+                if (stream[pos] != ' ' || pos == parser->token_start)
+                {
+                    return -1;
+                }
+                parser->method = (struct http_span){parser->token_start, pos - parser->token_start};
+                parser->token_start = ++pos;
+                parser->state = HTTP_PARSE_URI;
+            }
+            break;
 
-    // Check that headers have been completly received
-    if (!strstr(stream, HTTP_HDR_END_DELIM))
-        return 0;
+        case HTTP_PARSE_URI:
+            pos = http_scan(stream, pos, bytes_received, ' ', '\r');
+            if (pos < bytes_received)
+            {
+                parser->uri = (struct http_span){parser->token_start, pos - parser->token_start};
+                parser->version = (struct http_span){pos, 0};
+                parser->state = stream[pos] == ' ' ? HTTP_PARSE_VERSION : HTTP_PARSE_LINE_END;
+                parser->token_start = ++pos;
+            }
+            break;
 
-    // Initialize number of headers
-    out->num_headers = 0;
+        case HTTP_PARSE_VERSION:
+            pos = http_scan(stream, pos, bytes_received, '\r', '\r');
+            if (pos < bytes_received)
+            {
+                parser->version = (struct http_span){parser->token_start, pos - parser->token_start};
+                parser->state = HTTP_PARSE_LINE_END;
+                pos++;
+            }
+            break;
 
-    // Parse the first line
-    const char *after_key = stream;
-    struct http_string pair;
-    *content_len = 0;
+        case HTTP_PARSE_LINE_END:
+            if (stream[pos] != '\n')
+            {
+                return -1;
+            }
+            parser->state = HTTP_PARSE_HEADER;
+            pos++;
+            break;
 
-    after_key = get_next_token(after_key, " ", &pair);
-    out->method = pair;
-    pair.val = NULL;
-    after_key = get_next_token(after_key, " ", &pair);
-    out->uri = pair;
-    pair.val = NULL;
-    after_key = get_next_token(after_key, HTTP_LINE_DELIM, NULL);
+        case HTTP_PARSE_HEADER:
+            if (stream[pos] == '\r')
+            {
+                parser->state = HTTP_PARSE_HEADERS_END;
+                pos++;
+            }
+            else if (parser->num_headers == MAX_HEADERS)
+            {
+                return -1;
+            }
+            else
+            {
+                parser->token_start = pos;
+                parser->state = HTTP_PARSE_KEY;
+            }
+            break;
 
-    // Extract all header key-value pairs
-    while (after_key != NULL && strncmp(after_key, HTTP_LINE_DELIM, strlen(HTTP_LINE_DELIM)))
-    {
-        after_key = http_parse_headers(after_key, out);
-        out->num_headers++;
-    }
+        case HTTP_PARSE_KEY:
+            pos = http_scan(stream, pos, bytes_received, ':', '\r');
+            if (pos < bytes_received)
+            {
+                if (stream[pos] != ':' || pos == parser->token_start)
+                {
+                    return -1;
+                }
+                parser->keys[parser->num_headers] = (struct http_span){parser->token_start, pos - parser->token_start};
+                parser->state = HTTP_PARSE_SPACE;
+                pos++;
+            }
+            break;
 
-    after_key = get_next_token(after_key, HTTP_LINE_DELIM, NULL); // skip the \n
+        case HTTP_PARSE_SPACE:
+            if (stream[pos] == ' ' || stream[pos] == '\t')
+            {
+                pos++;
+            }
+            else
+            {
+                parser->token_start = pos;
+                parser->state = HTTP_PARSE_VALUE;
+            }
+            break;
 
-    // Get the content length from the headers
-    for (size_t i = 0; i < out->num_headers; i++)
-    {
-        if (!strncmp(out->headers[i].key.val, "Content-Length", out->headers[i].key.len))
-        {
-            *content_len = atoi(out->headers[i].value.val);
+        case HTTP_PARSE_VALUE:
+            pos = http_scan(stream, pos, bytes_received, '\r', '\r');
+            if (pos < bytes_received)
+            {
+                parser->values[parser->num_headers] = (struct http_span){parser->token_start, pos - parser->token_start};
+                parser->num_headers++;
+                parser->state = HTTP_PARSE_LINE_END;
+                pos++;
+            }
             break;
+
+        case HTTP_PARSE_HEADERS_END:
+            if (stream[pos] != '\n')
+            {
+                return -1;
+            }
+            pos++;
+            parser->body_start = pos;
+            parser->content_len = parsed_content_len(parser, stream);
+            if (parser->content_len < 0)
+            {
+                return -1;
+            }
+            parser->state = HTTP_PARSE_BODY;
+            break;
+
+        default:
+            return -1;
         }
     }
-    if (*content_len < 0)
+    parser->position = pos;
+    return ERR_NONE;
+}
+
+/************************************************************************
+ * Goes on parsing a request from where the previous call stopped
+ ************************************************************************ */
+int http_parser_execute(struct http_parser *parser, const char *stream, size_t bytes_received,
+                        struct http_message *out, int *content_len)
+{
+    M_REQUIRE_NON_NULL(parser);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(content_len);
+
+    if (parse_headers(parser, stream, bytes_received) != ERR_NONE)
+    {
         return -1;
+    }
+    // Check that headers have been completly received
+    if (parser->state != HTTP_PARSE_BODY)
+    {
+        return 0;
+    }
+
+    out->method = (struct http_string){stream + parser->method.offset, parser->method.len};
+    out->uri = (struct http_string){stream + parser->uri.offset, parser->uri.len};
+    out->version = (struct http_string){stream + parser->version.offset, parser->version.len};
+    for (size_t i = 0; i < parser->num_headers; i++)
+    {
+        out->headers[i].key = (struct http_string){stream + parser->keys[i].offset, parser->keys[i].len};
+        out->headers[i].value = (struct http_string){stream + parser->values[i].offset, parser->values[i].len};
+    }
+    out->num_headers = parser->num_headers;
+    out->body = (struct http_string){NULL, 0};
+    out->body_remaining = 0;
+    *content_len = parser->content_len;
 
     if (*content_len == 0)
         return 1;
 
-    if (after_key == NULL || (int)bytes_received - (after_key - stream) < *content_len)
+    if (bytes_received - parser->body_start < (size_t)*content_len)
     {
         return 0;
     }
 
-    out->body.val = after_key;
+    out->body.val = stream + parser->body_start;
     out->body.len = (size_t)*content_len;
     return 1;
 }
+
+/************************************************************************
+ * Accepts a potentially partial TCP stream and parses an HTTP message.
+ ************************************************************************ */
+int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(content_len);
+
+    struct http_parser parser;
+    http_parser_init(&parser);
+    return http_parser_execute(&parser, stream, bytes_received, out, content_len);
+}
@@ -8,6 +8,7 @@
 #pragma once
 
 #define MAX_HEADERS 40
+#define MAX_QUERY_VARS 16
 
 #define HTTP_HDR_KV_DELIM  ": "
 #define HTTP_LINE_DELIM    "\r\n"
@@ -31,9 +32,56 @@ struct http_header {
 struct http_message {
     struct http_string method;
     struct http_string uri;
+    struct http_string version; // e.g. "HTTP/1.1", empty if the request line has none
     struct http_header headers[MAX_HEADERS];
     size_t num_headers;
     struct http_string body;
+    size_t body_remaining; // bytes of the body not received yet, see http_read_body()
+};
+
+// Variables of the query string of an URI, still percent-encoded: they point into the URI
+struct http_query {
+    struct http_header vars[MAX_QUERY_VARS];
+    size_t num_vars;
+    struct http_string rest; // query string after the first MAX_QUERY_VARS variables, empty if none
+};
+
+// Bytes of a stream, as an offset: the stream may move between two parsing steps
+struct http_span {
+    size_t offset;
+    size_t len;
+};
+
+// Steps of http_parser_execute(): what the next byte of the stream belongs to
+enum http_parse_state {
+    HTTP_PARSE_METHOD,
+    HTTP_PARSE_URI,
+    HTTP_PARSE_VERSION,
+    HTTP_PARSE_LINE_END,    // '\n' ending the request line or a header
+    HTTP_PARSE_HEADER,      // start of a header, or of the empty line ending the headers
+    HTTP_PARSE_KEY,
+    HTTP_PARSE_SPACE,       // between the ':' of a header and its value
+    HTTP_PARSE_VALUE,
+    HTTP_PARSE_HEADERS_END, // '\n' of the empty line ending the headers
+    HTTP_PARSE_BODY
+};
+
+/**
+ * @brief Request being parsed as its bytes arrive. Each byte of the
+ *        stream is looked at once, however many pieces the request comes in.
+ */
+struct http_parser {
+    enum http_parse_state state;
+    size_t position;    // number of bytes of the stream already parsed
+    size_t token_start; // offset of the token being parsed
+    struct http_span method;
+    struct http_span uri;
+    struct http_span version;
+    struct http_span keys[MAX_HEADERS];
+    struct http_span values[MAX_HEADERS];
+    size_t num_headers;
+    size_t body_start;  // offset of the body, once the headers are parsed
+    int content_len;    // Content-Length of the request, once the headers are parsed
 };
 
 /**
@@ -44,6 +92,15 @@ struct http_message {
  */
 int http_match_uri(const struct http_message *message, const char *target_uri);
 
+/**
+ * @brief Gives the path of an URI: the URI without its query string, if any.
+ *
+ * The path points into the URI.
+ *
+ * Returns: some error code. 0 if no error.
+ */
+int http_uri_path(const struct http_string *uri, struct http_string *path);
+
 /**
  * @brief Accepts a potentially partial TCP stream and parses an HTTP message.
  *
@@ -60,6 +117,62 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
  */
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
 
+/**
+ * @brief Starts parsing a new request: the next call to http_parser_execute()
+ *        expects a stream starting with its request line.
+ */
+void http_parser_init(struct http_parser *parser);
+
+/**
+ * @brief Goes on parsing a request whose first bytes_received bytes are in
+ *        stream, from where the previous call for this request stopped.
+ *
+ * Same results as http_parse_message(). The stream must keep the bytes
+ * already parsed, but may have been moved (e.g. by realloc()) since the
+ * previous call: out only points into the stream given to the last call.
+ * parser->body_start + *content_len is the length of a complete request:
+ * the bytes after it belong to the next request.
+ */
+int http_parser_execute(struct http_parser *parser, const char *stream, size_t bytes_received,
+                        struct http_message *out, int *content_len);
+
+/**
+ * @brief Tells whether the connection stays open after the reply to `message`.
+ *
+ * An HTTP/1.1 connection is persistent unless the request has "Connection: close".
+ * An HTTP/1.0 one, or a request without version, is closed unless the request
+ * has "Connection: keep-alive".
+ *
+ * Returns: 1 if it stays open, 0 if it is closed, a negative error code if message is NULL.
+ */
+int http_keep_alive(const struct http_message *message);
+
+/**
+ * @brief Splits the query string of an URI into its variables, once for
+ *        all the variables a request handler needs.
+ *
+ * A variable without '=' has an empty value. An URI without query string
+ * has no variable. The variables after the first MAX_QUERY_VARS ones are
+ * left in query->rest rather than rejected.
+ *
+ * Returns: some error code. 0 if no error.
+ */
+int http_parse_query(const struct http_string *uri, struct http_query *query);
+
+/**
+ * @brief Writes the decoded value of the variable `name` of a parsed
+ *        query string to buffer out, null-terminated: "%XX" is the byte
+ *        0xXX and '+' a space.
+ *
+ * Only variables named exactly `name` match. The first MAX_QUERY_VARS
+ * variables are looked up without scanning the URI; the rest of the query
+ * string is scanned only if none of them matches.
+ *
+ * Return the length of the value.
+ * 0 or negative return values indicate an error.
+ */
+int http_query_get(const struct http_query *query, const char *name, char *out, size_t out_len);
+
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
  *
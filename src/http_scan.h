@@ -0,0 +1,73 @@
+/**
+ * @file http_scan.h
+ * @brief Search of the delimiters of HTTP requests (such as '\r' or ':'),
+ *        16 or 32 bytes at a time where the processor allows it.
+ *
+ * The vectorized search is used on x86-64, where SSE2 is always there,
+ * and uses AVX2 when built for it (e.g. with -mavx2). Anywhere else, and
+ * for the last bytes of a stream, the bytes are compared one at a time.
+ * No byte past the end of the stream is ever read.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Offset of the first byte equal to a or b between from and to,
+ *        or to if there is none. Compares one byte at a time.
+ */
+static inline size_t http_scan_scalar(const char *stream, size_t from, size_t to, char a, char b)
+{
+    while (from < to && stream[from] != a && stream[from] != b)
+    {
+        from++;
+    }
+    return from;
+}
+
+/**
+ * @brief Same as http_scan_scalar(), comparing as many bytes at a time as
+ *        the processor allows.
+ */
+static inline size_t http_scan(const char *stream, size_t from, size_t to, char a, char b)
+{
+#if defined(__AVX2__)
+    const __m256i a32 = _mm256_set1_epi8(a);
+    const __m256i b32 = _mm256_set1_epi8(b);
+    while (from < to && to - from >= sizeof(__m256i))
+    {
+        const __m256i bytes = _mm256_loadu_si256((const __m256i *)(const void *)(stream + from));
+        const unsigned found = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, a32), _mm256_cmpeq_epi8(bytes, b32)));
+        if (found)
+        {
+            return from + (size_t)__builtin_ctz(found);
+        }
+        from += sizeof(__m256i);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i a16 = _mm_set1_epi8(a);
+    const __m128i b16 = _mm_set1_epi8(b);
+    while (from < to && to - from >= sizeof(__m128i))
+    {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *)(const void *)(stream + from));
+        const unsigned found = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, a16), _mm_cmpeq_epi8(bytes, b16)));
+        if (found)
+        {
+            return from + (size_t)__builtin_ctz(found);
+        }
+        from += sizeof(__m128i);
+    }
+#endif
+    return http_scan_scalar(stream, from, to, a, b);
+}
@@ -3,164 +3,395 @@
 #include <vips/vips.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 // Index of the width value for different resolutions
 #define THUMB_RES_WIDTH_INDEX 0
 #define SMALL_RES_WIDTH_INDEX 2
 
-// Error if the ftell function fails
-#define ERR_FTELL -1
-
 #define OFFSET_ZERO 0
 
-/**
- * @brief Free memory allocated to the original and resized images, as well as their corresponding VipsImage
- *
- * @param original_image Pointer to the original image
- * @param resized_image Pointer to the resized image
- * @param original_vipsimage Pointer to the original VipsImage
- * @param resized_vipsimage Pointer to the resized VipsImage
- *
- * @return some error code
- */
-int free_images(void *original_image, void *resized_image, VipsImage *original_vipsimage, VipsImage *resized_vipsimage)
+// JPEG markers read to find the resolution of an image
+#define JPEG_MARKER 0xFF
+#define JPEG_SOI 0xD8  // start of image
+#define JPEG_EOI 0xD9  // end of image
+#define JPEG_SOS 0xDA  // start of scan
+#define JPEG_SOF0 0xC0 // start of frame, baseline
+#define JPEG_SOF2 0xC2 // start of frame, progressive
+#define JPEG_MARKER_SIZE 2
+#define JPEG_LENGTH_SIZE 2
+#define JPEG_SOF_MIN_LENGTH 7 // length, precision, height and width
+
+/**********************************************************************
+ * Finds the size of one of the resized resolutions
+ ********************************************************************** */
+static void resized_dimensions(const struct imgfs_header *header, int resolution, int *width, int *height)
 {
-    free(original_image);
-    original_image = NULL;
-    free(resized_image);
-    resized_image = NULL;
-    g_object_unref(original_vipsimage);
-    original_vipsimage = NULL;
-    g_object_unref(resized_vipsimage);
-    resized_vipsimage = NULL;
-    return ERR_NONE;
+    const int index = (resolution == THUMB_RES) ? THUMB_RES_WIDTH_INDEX : SMALL_RES_WIDTH_INDEX;
+    *width = header->resized_res[index];
+    *height = header->resized_res[index + 1];
 }
 
 /**********************************************************************
- * Resize the image to the given resolution, if needed.
+ * Encodes a resized image
  ********************************************************************** */
-int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t index)
-{ // Check if arguments are valid
-    if (resolution != THUMB_RES && resolution != SMALL_RES && resolution != ORIG_RES)
-        return ERR_RESOLUTIONS;
+static int encode_resized(VipsImage *vips_resized_img, void **resized_img, size_t *resized_size)
+{
+    const int err = vips_jpegsave_buffer(vips_resized_img, resized_img, resized_size, NULL);
+    return err ? ERR_IMGLIB : ERR_NONE;
+}
 
-    M_REQUIRE_NON_NULL(imgfs_file);
-    M_REQUIRE_NON_NULL(imgfs_file->file);
+/**********************************************************************
+ * Encodes one resized version of an already shrunk image
+ ********************************************************************** */
+static int resize_decoded(const struct imgfs_header *header, int resolution, VipsImage *vips_img,
+                          void **resized_img, size_t *resized_size)
+{
+    int width = 0, height = 0;
+    resized_dimensions(header, resolution, &width, &height);
 
-    if (index < 0 || index >= imgfs_file->header.max_files)
+    VipsImage *vips_resized_img = NULL;
+    if (vips_thumbnail_image(vips_img, &vips_resized_img, width, "height", height, NULL))
     {
-        return ERR_INVALID_IMGID;
+        return ERR_IMGLIB;
     }
 
-    if (imgfs_file->metadata[index].is_valid == EMPTY)
+    const int ret = encode_resized(vips_resized_img, resized_img, resized_size);
+    g_object_unref(vips_resized_img);
+    vips_resized_img = NULL;
+    return ret;
+}
+
+/**********************************************************************
+ * Resizes an original image to several resized resolutions.
+ ********************************************************************** */
+int resize_contents(const struct imgfs_header *header, unsigned int resolutions,
+                    const void *orig_img, size_t orig_size,
+                    void *resized_img[NB_RES], size_t resized_size[NB_RES])
+{
+    M_REQUIRE_NON_NULL(header);
+    M_REQUIRE_NON_NULL(orig_img);
+    M_REQUIRE_NON_NULL(resized_img);
+    M_REQUIRE_NON_NULL(resized_size);
+    if (resolutions == 0 || (resolutions & ~(RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES))))
+        return ERR_RESOLUTIONS;
+
+    for (int res = 0; res < NB_RES; res++)
     {
-        return ERR_INVALID_IMGID;
+        resized_img[res] = NULL;
+        resized_size[res] = 0;
     }
 
-    if (resolution == ORIG_RES)
+    // The largest resolution asked for is the only one made from the original
+    int largest = -1;
+    int largest_width = 0, largest_height = 0;
+    for (int res = 0; res < NB_RES; res++)
     {
-        return ERR_NONE;
+        int width = 0, height = 0;
+        resized_dimensions(header, res, &width, &height);
+        if ((resolutions & RES_MASK(res)) && (largest < 0 || width > largest_width))
+        {
+            largest = res;
+            largest_width = width;
+            largest_height = height;
+        }
     }
 
-    // Check if image already exists in given resolution
-    if (imgfs_file->metadata[index].size[resolution])
+    // Let the JPEG decoder shrink the original while loading it (in the
+    // DCT domain), so that the decoding cost follows the resized size
+    VipsImage *vips_largest_img = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    const int err_load = vips_thumbnail_buffer((void *)orig_img, orig_size, &vips_largest_img, largest_width,
+                                               "height", largest_height, NULL);
+#pragma GCC diagnostic pop
+    if (err_load)
     {
-        return ERR_NONE;
+        return ERR_IMGLIB;
     }
 
-    // Find the correct width according to the resolution
-    uint16_t width = (resolution == THUMB_RES) ? imgfs_file->header.resized_res[THUMB_RES_WIDTH_INDEX] : imgfs_file->header.resized_res[SMALL_RES_WIDTH_INDEX];
-    uint16_t height = (resolution == THUMB_RES) ? imgfs_file->header.resized_res[THUMB_RES_WIDTH_INDEX + 1] : imgfs_file->header.resized_res[SMALL_RES_WIDTH_INDEX + 1];
+    // The loader decodes sequentially, for a single pass: an image feeding
+    // several outputs must be in memory, or the second one would decode the
+    // original again (or fail with "out of order read")
+    if (resolutions != RES_MASK(largest))
+    {
+        VipsImage *vips_memory_img = vips_image_copy_memory(vips_largest_img);
+        g_object_unref(vips_largest_img);
+        vips_largest_img = vips_memory_img;
+        if (vips_largest_img == NULL)
+        {
+            return ERR_IMGLIB;
+        }
+    }
+
+    int ret = encode_resized(vips_largest_img, &resized_img[largest], &resized_size[largest]);
 
-    if (fseek(imgfs_file->file, (long)imgfs_file->metadata[index].offset[ORIG_RES], SEEK_SET))
+    // The smaller resolutions are made from the largest one, not decoded again
+    for (int res = 0; res < NB_RES && ret == ERR_NONE; res++)
     {
-        return ERR_IO;
+        if (res != largest && (resolutions & RES_MASK(res)))
+        {
+            ret = resize_decoded(header, res, vips_largest_img, &resized_img[res], &resized_size[res]);
+        }
     }
+    g_object_unref(vips_largest_img);
+    vips_largest_img = NULL;
 
-    // Resize the original image to the requested resolution and free allocated memory in case of error
-    void *orig_img = calloc(1, imgfs_file->metadata[index].size[ORIG_RES]);
-    if (orig_img == NULL)
+    if (ret != ERR_NONE)
     {
-        return ERR_IO;
+        for (int res = 0; res < NB_RES; res++)
+        {
+            free(resized_img[res]);
+            resized_img[res] = NULL;
+            resized_size[res] = 0;
+        }
     }
-    if (fread(orig_img, imgfs_file->metadata[index].size[ORIG_RES], ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
+    return ret;
+}
+
+/**********************************************************************
+ * Resizes an original image to one of the resized resolutions.
+ ********************************************************************** */
+int resize_content(const struct imgfs_header *header, int resolution,
+                   const void *orig_img, size_t orig_size, void **resized_img, size_t *resized_size)
+{
+    M_REQUIRE_NON_NULL(resized_img);
+    M_REQUIRE_NON_NULL(resized_size);
+    if (resolution != THUMB_RES && resolution != SMALL_RES)
+        return ERR_RESOLUTIONS;
+
+    void *resized_imgs[NB_RES] = {NULL};
+    size_t resized_sizes[NB_RES] = {0};
+    const int ret = resize_contents(header, RES_MASK(resolution), orig_img, orig_size, resized_imgs, resized_sizes);
+    *resized_img = resized_imgs[resolution];
+    *resized_size = resized_sizes[resolution];
+    return ret;
+}
+
+/**********************************************************************
+ * Appends resized images and records them in the metadata.
+ ********************************************************************** */
+int store_resized_contents(struct imgfs_file *imgfs_file, size_t index,
+                           void *const resized_img[NB_RES], const size_t resized_size[NB_RES])
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(resized_img);
+    M_REQUIRE_NON_NULL(resized_size);
+    if (resized_img[ORIG_RES] != NULL)
+        return ERR_RESOLUTIONS;
+    if (index >= imgfs_file->header.max_files || imgfs_file->metadata[index].is_valid == EMPTY)
+        return ERR_INVALID_IMGID;
+
+    // Put the resized images one after the other, to append them at once
+    size_t total_size = 0;
+    for (int res = 0; res < NB_RES; res++)
     {
-        free(orig_img);
-        orig_img = NULL;
-        return ERR_IO;
+        if (resized_img[res] != NULL)
+            total_size += resized_size[res];
     }
+    if (total_size == 0)
+        return ERR_NONE;
 
-    VipsImage *vips_orig_img = NULL;
-    if (vips_jpegload_buffer(orig_img, imgfs_file->metadata[index].size[ORIG_RES], &vips_orig_img, NULL))
+    char *contents = malloc(total_size);
+    if (contents == NULL)
+        return ERR_OUT_OF_MEMORY;
+    size_t position = 0;
+    for (int res = 0; res < NB_RES; res++)
     {
-        free(orig_img);
-        orig_img = NULL;
-        return ERR_IMGLIB;
+        if (resized_img[res] != NULL)
+        {
+            memcpy(contents + position, resized_img[res], resized_size[res]);
+            position += resized_size[res];
+        }
     }
 
-    VipsImage *vips_resized_img = NULL;
-    if (vips_thumbnail_image(vips_orig_img, &vips_resized_img, width, "height", height, NULL))
+    // Write the resized images at the end of the file
+    uint64_t offset = OFFSET_ZERO;
+    const int ret = append_content(imgfs_file, contents, total_size, &offset);
+    free(contents);
+    contents = NULL;
+    if (ret != ERR_NONE)
     {
-        free(orig_img);
-        orig_img = NULL;
-        g_object_unref(vips_orig_img);
-        vips_orig_img = NULL;
-        return ERR_IMGLIB;
+        return ERR_IO;
     }
 
-    size_t len = 0;
-    void *resized_img = NULL;
-    if (vips_jpegsave_buffer(vips_resized_img, &resized_img, &len, NULL))
+    // Update the metadata with the correct sizes and offsets, then write it back to the file once
+    struct img_metadata *metadata = &imgfs_file->metadata[index];
+    const struct img_metadata before = *metadata;
+    for (int res = 0; res < NB_RES; res++)
     {
-        free(orig_img);
-        orig_img = NULL;
-        g_object_unref(vips_orig_img);
-        vips_orig_img = NULL;
-        g_object_unref(vips_resized_img);
-        vips_resized_img = NULL;
-        return ERR_IMGLIB;
+        if (resized_img[res] != NULL)
+        {
+            metadata->size[res] = (uint32_t)resized_size[res];
+            metadata->offset[res] = offset;
+            offset += resized_size[res];
+        }
     }
 
-    // Write the resized image at the end of the file
-    if (fseek(imgfs_file->file, OFFSET_ZERO, SEEK_END))
+    if (write_metadata(imgfs_file, (uint32_t)index) != ERR_NONE || commit_writes(imgfs_file) != ERR_NONE)
     {
-        free_images(orig_img, resized_img, vips_orig_img, vips_resized_img);
+        *metadata = before;
         return ERR_IO;
     }
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Appends a resized image and records it in the metadata.
+ ********************************************************************** */
+int store_resized(int resolution, struct imgfs_file *imgfs_file, size_t index,
+                  const void *resized_img, size_t resized_size)
+{
+    M_REQUIRE_NON_NULL(resized_img);
+    if (resolution != THUMB_RES && resolution != SMALL_RES)
+        return ERR_RESOLUTIONS;
+
+    void *resized_imgs[NB_RES] = {NULL};
+    size_t resized_sizes[NB_RES] = {0};
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    resized_imgs[resolution] = (void *)resized_img;
+#pragma GCC diagnostic pop
+    resized_sizes[resolution] = resized_size;
+    return store_resized_contents(imgfs_file, index, resized_imgs, resized_sizes);
+}
+
+/**********************************************************************
+ * Creates the missing resized images of an image, decoding it once.
+ ********************************************************************** */
+int lazily_resize_all(unsigned int resolutions, struct imgfs_file *imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (resolutions & ~(RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES) | RES_MASK(ORIG_RES)))
+        return ERR_RESOLUTIONS;
+    if (index >= imgfs_file->header.max_files || imgfs_file->metadata[index].is_valid == EMPTY)
+        return ERR_INVALID_IMGID;
+
+    // Only the resized images not there yet (the original always is)
+    const struct img_metadata *metadata = &imgfs_file->metadata[index];
+    unsigned int missing = 0;
+    for (int res = 0; res < NB_RES; res++)
+    {
+        if (res != ORIG_RES && (resolutions & RES_MASK(res)) && !metadata->size[res])
+            missing |= RES_MASK(res);
+    }
+    if (missing == 0)
+    {
+        return ERR_NONE;
+    }
 
-    if (fwrite(resized_img, len, ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
+    void *orig_img = malloc(metadata->size[ORIG_RES]);
+    if (orig_img == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (read_content(imgfs_file, metadata->offset[ORIG_RES], orig_img, metadata->size[ORIG_RES]) != ERR_NONE)
     {
-        free_images(orig_img, resized_img, vips_orig_img, vips_resized_img);
+        free(orig_img);
+        orig_img = NULL;
         return ERR_IO;
     }
 
-    // Update the metadata with the correct size and offset, then write it back to the file
-    imgfs_file->metadata[index].size[resolution] = (uint32_t)len;
-    long end_of_file = ftell(imgfs_file->file);
+    void *resized_img[NB_RES];
+    size_t resized_size[NB_RES];
+    int ret = resize_contents(&imgfs_file->header, missing, orig_img, metadata->size[ORIG_RES],
+                              resized_img, resized_size);
+    free(orig_img);
+    orig_img = NULL;
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
 
-    if (end_of_file == ERR_FTELL)
+    ret = store_resized_contents(imgfs_file, index, resized_img, resized_size);
+    for (int res = 0; res < NB_RES; res++)
     {
-        free_images(orig_img, resized_img, vips_orig_img, vips_resized_img);
-        return ERR_IO;
+        free(resized_img[res]);
     }
+    return ret;
+}
 
-    imgfs_file->metadata[index].offset[resolution] = (uint64_t)end_of_file - len;
+/**********************************************************************
+ * Resize the image to the given resolution, if needed.
+ ********************************************************************** */
+int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t index)
+{ // Check if arguments are valid
+    if (resolution != THUMB_RES && resolution != SMALL_RES && resolution != ORIG_RES)
+        return ERR_RESOLUTIONS;
 
-    size_t metadata_offset = sizeof(imgfs_file->header) + index * sizeof(struct img_metadata);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
 
-    if (fseek(imgfs_file->file, (long)metadata_offset, SEEK_SET))
+    if (index < 0 || index >= imgfs_file->header.max_files)
     {
-        free_images(orig_img, resized_img, vips_orig_img, vips_resized_img);
-        return ERR_IO;
+        return ERR_INVALID_IMGID;
     }
 
-    if (fwrite(&(imgfs_file->metadata[index]), sizeof(struct img_metadata), ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
+    if (imgfs_file->metadata[index].is_valid == EMPTY)
     {
-        free_images(orig_img, resized_img, vips_orig_img, vips_resized_img);
-        return ERR_IO;
+        return ERR_INVALID_IMGID;
     }
 
-    return free_images(orig_img, resized_img, vips_orig_img, vips_resized_img);
+    return lazily_resize_all(RES_MASK(resolution), imgfs_file, index);
+}
+
+/**********************************************************************
+ * Reads a big-endian 16-bit value of a JPEG segment
+ ********************************************************************** */
+static uint32_t jpeg_u16(const unsigned char *bytes)
+{
+    return (uint32_t)bytes[0] << 8 | bytes[1];
+}
+
+/**********************************************************************
+ * Reads the resolution in the start of frame of a JPEG without decoding
+ * it. Only the Huffman coded frames (baseline, extended and progressive)
+ * are understood: any other file is left to libvips.
+ ********************************************************************** */
+static int jpeg_frame_resolution(uint32_t *height, uint32_t *width,
+                                 const unsigned char *bytes, size_t size)
+{
+    if (size < JPEG_MARKER_SIZE || bytes[0] != JPEG_MARKER || bytes[1] != JPEG_SOI)
+        return NOT_FOUND;
+
+    size_t pos = JPEG_MARKER_SIZE;
+    while (pos + JPEG_MARKER_SIZE + JPEG_LENGTH_SIZE <= size)
+    {
+        if (bytes[pos] != JPEG_MARKER)
+            return NOT_FOUND;
+
+        // Any number of fill bytes may precede a marker
+        const unsigned char marker = bytes[pos + 1];
+        if (marker == JPEG_MARKER)
+        {
+            pos++;
+            continue;
+        }
+
+        // The scans (and thus the pixels) come after the start of frame
+        if (marker == JPEG_SOS || marker == JPEG_EOI)
+            return NOT_FOUND;
+
+        const size_t length = jpeg_u16(bytes + pos + JPEG_MARKER_SIZE);
+        if (length < JPEG_LENGTH_SIZE || pos + JPEG_MARKER_SIZE + length > size)
+            return NOT_FOUND;
+
+        if (marker >= JPEG_SOF0 && marker <= JPEG_SOF2)
+        {
+            // Length, sample precision, height, width
+            const unsigned char *frame = bytes + pos + JPEG_MARKER_SIZE;
+            if (length < JPEG_SOF_MIN_LENGTH)
+                return NOT_FOUND;
+            *height = jpeg_u16(frame + 3);
+            *width = jpeg_u16(frame + 5);
+
+            // A zero height is only given later, by a DNL marker
+            return *height != 0 && *width != 0 ? FOUND : NOT_FOUND;
+        }
+        pos += JPEG_MARKER_SIZE + length;
+    }
+    return NOT_FOUND;
 }
 
 /**********************************************************************
@@ -173,6 +404,9 @@ int get_resolution(uint32_t *height, uint32_t *width,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    if (jpeg_frame_resolution(height, width, (const unsigned char *)image_buffer, image_size) == FOUND)
+        return ERR_NONE;
+
     VipsImage *original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
@@ -12,6 +12,9 @@
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint16_t, uint32_t, uint64_t
 
+// Bit of a resolution in a set of resolutions
+#define RES_MASK(res) (1u << (res))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -19,6 +22,9 @@ extern "C" {
 /**
  * @brief Gets the resolution of an image.
  *
+ * The resolution is read from the start of frame of the JPEG when it
+ * can be, and only asked to libvips otherwise.
+ *
  * @param height Where to put the calculated image height.
  * @param width Where to put the calculated image width.
  * @param filename The image file name.
@@ -26,6 +32,81 @@ extern "C" {
  */
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
 
+/**
+ * @brief Resizes an original image to one of the resized resolutions of an imgFS.
+ *
+ * Only works on memory: can run without any lock on the imgFS.
+ *
+ * @param header The header of the imgFS, giving the resized resolutions
+ * @param resolution THUMB_RES or SMALL_RES
+ * @param orig_img The content of the original image
+ * @param orig_size The size of the original image
+ * @param resized_img Where to put the (to be freed) resized content
+ * @param resized_size Where to put the size of the resized content
+ * @return Some error code. 0 if no error.
+ */
+int resize_content(const struct imgfs_header *header, int resolution,
+                   const void *orig_img, size_t orig_size, void **resized_img, size_t *resized_size);
+
+/**
+ * @brief Resizes an original image to several resized resolutions of an
+ *        imgFS, decoding it only once.
+ *
+ * The original is shrunk while being decoded to the largest resolution
+ * asked for, and the smaller ones are made from that one.
+ *
+ * Only works on memory: can run without any lock on the imgFS.
+ *
+ * @param header The header of the imgFS, giving the resized resolutions
+ * @param resolutions The resolutions to create, as a set of RES_MASK(THUMB_RES) and RES_MASK(SMALL_RES)
+ * @param orig_img The content of the original image
+ * @param orig_size The size of the original image
+ * @param resized_img Where to put the (to be freed) resized contents, NULL for the resolutions not created
+ * @param resized_size Where to put the sizes of the resized contents
+ * @return Some error code. 0 if no error.
+ */
+int resize_contents(const struct imgfs_header *header, unsigned int resolutions,
+                    const void *orig_img, size_t orig_size,
+                    void *resized_img[NB_RES], size_t resized_size[NB_RES]);
+
+/**
+ * @brief Appends a resized image to the imgFS and updates its metadata on the disk.
+ *
+ * @param resolution THUMB_RES or SMALL_RES
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param resized_img The resized content
+ * @param resized_size The size of the resized content
+ * @return Some error code. 0 if no error.
+ */
+int store_resized(int resolution, struct imgfs_file *imgfs_file, size_t index,
+                  const void *resized_img, size_t resized_size);
+
+/**
+ * @brief Appends several resized images to the imgFS at once and updates
+ *        the metadata of the image on the disk once.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param resized_img The resized contents, NULL for the resolutions to leave as they are
+ * @param resized_size The sizes of the resized contents
+ * @return Some error code. 0 if no error.
+ */
+int store_resized_contents(struct imgfs_file *imgfs_file, size_t index,
+                           void *const resized_img[NB_RES], const size_t resized_size[NB_RES]);
+
+/**
+ * @brief Creates the missing resized images of an image, decoding the
+ *        original only once and updating the imgFS with a single append
+ *        and a single metadata write.
+ *
+ * @param resolutions The set of RES_MASK() of the resolutions wanted
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int lazily_resize_all(unsigned int resolutions, struct imgfs_file *imgfs_file, size_t index);
+
 /**
  * @brief Calls the create_resized_img function and updates the metadata on the disk
  *
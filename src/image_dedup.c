@@ -1,5 +1,6 @@
 #include "image_dedup.h"
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -15,26 +16,20 @@ int do_name_and_content_dedup(struct imgfs_file *imgfs_file, uint32_t index)
     if (index < 0 || index >= imgfs_file->header.max_files)
         return ERR_IMAGE_NOT_FOUND;
 
-    // Check among all images (metadata) for duplicated image ID or content
-    int duplicate = EMPTY;
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++)
+    if (imgfs_index_find_id(imgfs_file, imgfs_file->metadata[index].img_id, index) != NO_SLOT)
     {
-        if (i != index && imgfs_file->metadata[i].is_valid == NON_EMPTY)
-        {
-            if (!strcmp(imgfs_file->metadata[i].img_id, imgfs_file->metadata[index].img_id))
-            {
-                return ERR_DUPLICATE_ID;
-            }
-            else if (!memcmp(imgfs_file->metadata[i].SHA, imgfs_file->metadata[index].SHA, SHA256_DIGEST_LENGTH))
-            {
-                // If the content is duplicated, we copy the size and offset of the original image to the indexed image
-                memcpy(imgfs_file->metadata[index].size, imgfs_file->metadata[i].size, sizeof(imgfs_file->metadata[i].size));
-                memcpy(imgfs_file->metadata[index].offset, imgfs_file->metadata[i].offset, sizeof(imgfs_file->metadata[i].offset));
-                duplicate = NON_EMPTY;
-            }
-        }
+        return ERR_DUPLICATE_ID;
     }
-    if (duplicate == EMPTY)
+
+    // Look for an image with the same content
+    const uint32_t i = imgfs_index_find_sha(imgfs_file, imgfs_file->metadata[index].SHA, index);
+    if (i != NO_SLOT)
+    {
+        // If the content is duplicated, we copy the size and offset of the original image to the indexed image
+        memcpy(imgfs_file->metadata[index].size, imgfs_file->metadata[i].size, sizeof(imgfs_file->metadata[i].size));
+        memcpy(imgfs_file->metadata[index].offset, imgfs_file->metadata[i].offset, sizeof(imgfs_file->metadata[i].offset));
+    }
+    else
     {
         imgfs_file->metadata[index].offset[ORIG_RES] = OFFSET_ZERO;
     }
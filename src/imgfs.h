@@ -20,6 +20,7 @@
                     * but we provide it here, as it is required by
                     * all the functions of this lib.
                     */
+#include <openssl/evp.h> // for EVP_MD_CTX
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <stdint.h>      // for uint32_t, uint64_t
 #include <stdio.h>       // for FILE
@@ -40,6 +41,13 @@
 #define ORIG_RES 2
 #define NB_RES 3
 
+// For flags in imgfs_header
+#define IMGFS_EAGER_RESIZE 0x1 // resized resolutions are created when an image is inserted
+
+// Durability of the changes of the header and metadata, see set_write_policy()
+#define IMGFS_DURABILITY_WRITTEN 0 // written changes are in the file: they survive a crash of the process
+#define IMGFS_DURABILITY_SYNCED 1  // written changes are on the disk: they survive a power loss
+
 #define ONE_ELEMENT 1
 #define FOUND 1
 #define NOT_FOUND 0
@@ -62,7 +70,7 @@ extern "C"
         uint32_t nb_files;
         uint32_t max_files;
         uint16_t resized_res[2 * (NB_RES - 1)];
-        uint32_t unused_32;
+        uint32_t flags; // IMGFS_EAGER_RESIZE or 0
         uint64_t unused_64;
     };
 
@@ -77,11 +85,45 @@ extern "C"
         uint16_t unused_16;
     };
 
+    /**
+     * @brief In-memory open-addressing hash table from a key of the metadata
+     *        (the image ID or the SHA) to its slot in the metadata array.
+     *        Never stored on disk: it is rebuilt by do_open() and do_create().
+     */
+    struct imgfs_index
+    {
+        uint32_t *buckets; // metadata slot + 1, or one of the special bucket values
+        size_t capacity;   // number of buckets, always a power of two
+        size_t used;       // number of non-empty buckets, tombstones included
+    };
+
+    /**
+     * @brief Changes of the header and metadata not written to the file yet,
+     *        and when to write them (see commit_writes()).
+     */
+    struct imgfs_pending
+    {
+        uint64_t *dirty_slots;     // bitmap of the metadata slots changed since the last flush, allocated when needed
+        int header_dirty;          // whether the header changed since the last flush
+        uint32_t updates;          // number of updates committed since the last flush
+        uint64_t first_update_ns;  // when the first of them was committed
+        uint32_t max_updates;      // number of updates written together, 0 or 1 to write each of them
+        uint32_t max_delay_ms;     // longest time an update waits to be written, see commit_due_writes(), 0 for no limit
+        int durability;            // IMGFS_DURABILITY_WRITTEN or IMGFS_DURABILITY_SYNCED
+    };
+
     struct imgfs_file
     {
         FILE *file;
         struct imgfs_header header;
         struct img_metadata *metadata;
+        struct imgfs_index id_index;
+        struct imgfs_index sha_index;
+        uint64_t *free_slots;   // bitmap of the empty metadata slots
+        size_t free_slots_hint; // index of the first word of free_slots which may be non-zero
+        void *mapping;        // header and metadata region if opened by do_open_mapped(), NULL otherwise
+        int mapping_writable; // whether changes to the mapping reach the file
+        struct imgfs_pending pending;
     };
 
     /**
@@ -110,12 +152,176 @@ extern "C"
                 struct imgfs_file *imgfs_file);
 
     /**
-     * @brief Do some clean-up for imgFS file handling.
+     * @brief Open imgFS file and map its header and metadata in memory.
+     *
+     * Instead of being read, the metadata array points directly into a
+     * shared mapping of the file, so that it is loaded lazily and shares
+     * the page cache with every other process mapping the same file.
+     * Read-only modes get a private mapping: changes then never reach the file.
+     *
+     * @param imgfs_filename Path to the imgFS file
+     * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+     * @param imgfs_file Structure for header, metadata and file pointer.
+     */
+    int do_open_mapped(const char *imgfs_filename,
+                       const char *open_mode,
+                       struct imgfs_file *imgfs_file);
+
+    /**
+     * @brief Do some clean-up for imgFS file handling. The pending changes
+     *        of the header and metadata are written first.
      *
      * @param imgfs_file Structure for header, metadata and file pointer to be freed/closed.
      */
     void do_close(struct imgfs_file *imgfs_file);
 
+    /**
+     * @brief Records that the in-memory header changed. It is written back
+     *        to the imgFS file by the flush which follows (see commit_writes()).
+     *
+     * @param imgfs_file The main in-memory structure
+     * @return Some error code. 0 if no error.
+     */
+    int write_header(struct imgfs_file *imgfs_file);
+
+    /**
+     * @brief Records that one entry of the in-memory metadata changed. It is
+     *        written back to the imgFS file by the flush which follows (see
+     *        commit_writes()).
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param index The index of the entry in the metadata array
+     * @return Some error code. 0 if no error.
+     */
+    int write_metadata(struct imgfs_file *imgfs_file, uint32_t index);
+
+    /**
+     * @brief Ends an update of the header and metadata, and writes the
+     *        pending changes when the write policy says so.
+     *
+     * The changed header and metadata slots are written in ascending offset
+     * order, each run of consecutive slots in a single write. An error means
+     * that the changes are still pending: the caller should undo its own.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @return Some error code. 0 if no error.
+     */
+    int commit_writes(struct imgfs_file *imgfs_file);
+
+    /**
+     * @brief Chooses when the updates of the header and metadata are written.
+     *
+     * By default, each update is written when it is committed. Grouping
+     * them trades the last updates, lost if the process crashes, for
+     * fewer and sequential writes. Pending changes are written first.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param max_updates Number of updates written together, 0 or 1 to write each of them
+     * @param max_delay_ms Longest time an update waits to be written, 0 for no limit.
+     *        It is checked by commit_writes() and commit_due_writes(): without a
+     *        further update, the owner must call the latter regularly.
+     * @param durability IMGFS_DURABILITY_WRITTEN or IMGFS_DURABILITY_SYNCED
+     * @return Some error code. 0 if no error.
+     */
+    int set_write_policy(struct imgfs_file *imgfs_file, uint32_t max_updates,
+                         uint32_t max_delay_ms, int durability);
+
+    /**
+     * @brief Writes the pending updates if the oldest of them has waited
+     *        for max_delay_ms, so that it is written even if no update follows.
+     *
+     * Meant to be called regularly, e.g. from a timer or an idle loop.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @return Some error code. 0 if no error.
+     */
+    int commit_due_writes(struct imgfs_file *imgfs_file);
+
+    /**
+     * @brief Flush barrier: writes every pending change and waits until the
+     *        imgFS file, contents included, is on the disk.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @return Some error code. 0 if no error.
+     */
+    int do_flush(struct imgfs_file *imgfs_file);
+
+    /**
+     * @brief Reads a content of the imgFS file at the given offset.
+     *
+     * Positional reads do not move the file cursor, so that several of
+     * them can run in parallel on the same imgFS.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param offset Where the content starts in the file
+     * @param buffer Where to put the content
+     * @param size The size of the content
+     * @return Some error code. 0 if no error.
+     */
+    int read_content(const struct imgfs_file *imgfs_file, uint64_t offset, void *buffer, size_t size);
+
+    /**
+     * @brief Appends a content at the end of the imgFS file.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param buffer The content
+     * @param size The size of the content
+     * @param offset Where to put the offset of the content in the file
+     * @return Some error code. 0 if no error.
+     */
+    int append_content(struct imgfs_file *imgfs_file, const void *buffer, size_t size, uint64_t *offset);
+
+    /**
+     * @brief Writes a content at the given offset of the imgFS file.
+     *
+     * Like read_content(), it does not move the file cursor.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param offset Where the content starts in the file
+     * @param buffer The content
+     * @param size The size of the content
+     * @return Some error code. 0 if no error.
+     */
+    int write_content(struct imgfs_file *imgfs_file, uint64_t offset, const void *buffer, size_t size);
+
+    /**
+     * @brief Writes several contents one after the other, starting at the
+     *        given offset of the imgFS file, in a single sequential write.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param offset Where the first content starts in the file
+     * @param buffers The contents
+     * @param sizes The sizes of the contents
+     * @param count The number of contents
+     * @return Some error code. 0 if no error.
+     */
+    int write_contents(struct imgfs_file *imgfs_file, uint64_t offset,
+                       const void *const buffers[], const size_t sizes[], size_t count);
+
+    /**
+     * @brief Reserves room for a content at the end of the imgFS file, so
+     *        that it can be written (see write_content()) while other
+     *        contents are appended after it.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param size The size of the content
+     * @param offset Where to put the offset of the room in the file
+     * @return Some error code. 0 if no error.
+     */
+    int reserve_content(struct imgfs_file *imgfs_file, size_t size, uint64_t *offset);
+
+    /**
+     * @brief Gives back a room reserved by reserve_content() which will
+     *        not be used. The file only shrinks if nothing was appended
+     *        after the room.
+     *
+     * @param imgfs_file The main in-memory structure
+     * @param offset The offset of the room
+     * @param size The size of the room
+     * @return Some error code. 0 if no error.
+     */
+    int release_content(struct imgfs_file *imgfs_file, uint64_t offset, size_t size);
+
     /**
      * @brief List of possible output modes for do_list()
      *
@@ -154,8 +360,8 @@ extern "C"
      *
      * Effectively, it only invalidates the is_valid field and updates the
      * metadata.  The raw data content is not erased, it stays where it
-     * was (and  new content is always appended to the end; no garbage
-     * collection).
+     * was (and  new content is always appended to the end) until the
+     * next garbage collection (see do_gbcollect()).
      *
      * @param img_id The ID of the image to be deleted.
      * @param imgfs_file The main in-memory data structure
@@ -196,9 +402,108 @@ extern "C"
     int do_insert(const char *image_buffer, size_t image_size,
                   const char *img_id, struct imgfs_file *imgfs_file);
 
+    /**
+     * @brief One image of a batch given to do_insert_batch().
+     */
+    struct imgfs_batch_image
+    {
+        const char *img_id;       // Image ID
+        const char *image_buffer; // raw image content
+        size_t image_size;        // image size
+        int result;               // set by do_insert_batch(): error code of this image, 0 if inserted
+    };
+
+    /**
+     * @brief Inserts several images in the imgFS file at once.
+     *
+     * The images are hashed and their resolution is read in parallel.
+     * They are then inserted in their order, with the same checks as
+     * do_insert() (an image can share the content of a previous image of
+     * the batch), their contents are appended in a single sequential
+     * write and the header is written only once.
+     *
+     * @param images The images to insert, whose result field is set
+     * @param nb_images The number of images
+     * @param imgfs_file The main in-memory data structure
+     * @return Some error code if the whole batch failed. 0 otherwise,
+     *         even if some images could not be inserted.
+     */
+    int do_insert_batch(struct imgfs_batch_image *images, size_t nb_images, struct imgfs_file *imgfs_file);
+
+    /**
+     * @brief Image inserted while its content is being received, so that
+     *        the content never has to be held in memory as a whole.
+     */
+    struct imgfs_insert_stream
+    {
+        EVP_MD_CTX *sha; // SHA-256 of the content written so far
+        uint64_t offset; // where the content is written in the imgFS file
+        size_t size;     // size of the whole content
+        size_t written;  // number of bytes of the content written so far
+    };
+
+    /**
+     * @brief Starts inserting an image whose content will be given in
+     *        pieces by do_insert_stream_write().
+     *
+     * The room of the content is reserved at the end of the imgFS file.
+     * The imgFS must not be used concurrently with this call.
+     *
+     * @param imgfs_file The main in-memory data structure
+     * @param image_size The size of the whole content
+     * @param stream The insertion to start
+     * @return Some error code. 0 if no error.
+     */
+    int do_insert_stream_begin(struct imgfs_file *imgfs_file, size_t image_size,
+                               struct imgfs_insert_stream *stream);
+
+    /**
+     * @brief Writes the next piece of the content of an image being inserted.
+     *
+     * Only writes into the room of the content: can run alongside any
+     * use of the imgFS, as long as its file is not replaced (see
+     * imgfs_gbcollect_finish()).
+     *
+     * @param imgfs_file The main in-memory data structure
+     * @param stream The insertion
+     * @param buffer The piece of content
+     * @param size The size of the piece
+     * @return Some error code. 0 if no error.
+     */
+    int do_insert_stream_write(struct imgfs_file *imgfs_file, struct imgfs_insert_stream *stream,
+                               const void *buffer, size_t size);
+
+    /**
+     * @brief Finishes inserting an image once its whole content is written:
+     *        same checks and metadata as do_insert().
+     *
+     * The insertion is released, whether it succeeds or not. The imgFS
+     * must not be used concurrently with this call.
+     *
+     * @param imgfs_file The main in-memory data structure
+     * @param stream The insertion
+     * @param img_id Image ID
+     * @return Some error code. 0 if no error.
+     */
+    int do_insert_stream_end(struct imgfs_file *imgfs_file, struct imgfs_insert_stream *stream,
+                             const char *img_id);
+
+    /**
+     * @brief Gives up inserting an image. The imgFS must not be used
+     *        concurrently with this call.
+     *
+     * @param imgfs_file The main in-memory data structure
+     * @param stream The insertion
+     */
+    void do_insert_stream_abort(struct imgfs_file *imgfs_file, struct imgfs_insert_stream *stream);
+
     /**
      * @brief Removes the deleted images by moving the existing ones
      *
+     * The existing contents are copied into a new imgFS, which then
+     * replaces the old one (see imgfs_gbcollect.h to do it step by step
+     * on an open imgFS).
+     *
      * @param imgfs_path The path to the imgFS file
      * @param imgfs_tmp_bkp_path The path to the a (to be created) temporary imgFS backup file
      * @return Some error code. 0 if no error.
@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -18,8 +19,11 @@ int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file)
     strcpy(imgfs_file->header.name, CAT_TXT);
     imgfs_file->header.version = EMPTY;
     imgfs_file->header.nb_files = EMPTY;
-    imgfs_file->header.unused_32 = EMPTY;
+    imgfs_file->header.flags &= IMGFS_EAGER_RESIZE; // only keep the known flags
     imgfs_file->header.unused_64 = EMPTY;
+    imgfs_file->mapping = NULL;
+    imgfs_file->mapping_writable = EMPTY;
+    memset(&imgfs_file->pending, 0, sizeof(struct imgfs_pending));
 
     imgfs_file->metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
     if (imgfs_file->metadata == NULL)
@@ -31,12 +35,21 @@ int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file)
         imgfs_file->metadata[i].is_valid = EMPTY;
     }
 
+    int ret = imgfs_index_build(imgfs_file);
+    if (ret != ERR_NONE)
+    {
+        free(imgfs_file->metadata);
+        imgfs_file->metadata = NULL;
+        return ret;
+    }
+
     size_t items_written = EMPTY;
 
     // Write the imgfs_file to the file, whose path is given by imgfs_filename, in the database
     FILE *imgfs = fopen(imgfs_filename, "wb");
     if (imgfs == NULL)
     {
+        imgfs_index_free(imgfs_file);
         free(imgfs_file->metadata);
         imgfs_file->metadata = NULL;
         return ERR_INVALID_ARGUMENT;
@@ -46,6 +59,7 @@ int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file)
 
     if (fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
     {
+        imgfs_index_free(imgfs_file);
         free(imgfs_file->metadata);
         imgfs_file->metadata = NULL;
         fclose(imgfs_file->file);
@@ -53,10 +67,10 @@ int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file)
     }
 
     items_written++;
-    int ret = ERR_NONE;
 
     if (fwrite(imgfs_file->metadata, sizeof(struct img_metadata), imgfs_file->header.max_files, imgfs_file->file) != imgfs_file->header.max_files)
     {
+        imgfs_index_free(imgfs_file);
         free(imgfs_file->metadata);
         imgfs_file->metadata = NULL;
         fclose(imgfs_file->file);
@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "imgfscmd_functions.h"
 #include "util.h" // for _unused
 
@@ -15,25 +16,13 @@ int do_delete(const char *img_id, struct imgfs_file *imgfs_file)
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgfs_file);
 
-    int image = NOT_FOUND;
-    uint32_t index = EMPTY;
-
     if (imgfs_file->metadata == NULL)
     {
         return ERR_OUT_OF_MEMORY; // Ensure memory allocation succeeded
     }
 
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++)
-    {
-        if (imgfs_file->metadata[i].is_valid == NON_EMPTY && !strcmp(imgfs_file->metadata[i].img_id, img_id))
-        {
-            image = FOUND;
-            index = i;
-            break;
-        }
-    }
-
-    if (image == NOT_FOUND)
+    const uint32_t index = imgfs_index_find_id(imgfs_file, img_id, NO_SLOT);
+    if (index == NO_SLOT)
     {
         return ERR_IMAGE_NOT_FOUND;
     }
@@ -45,20 +34,11 @@ int do_delete(const char *img_id, struct imgfs_file *imgfs_file)
     imgfs_file->header.version++;
     imgfs_file->header.nb_files--;
 
-    size_t metadata_offset = sizeof(imgfs_file->header) + index * sizeof(struct img_metadata);
-
-    if (!fseek(imgfs_file->file, (long)metadata_offset, SEEK_SET))
+    if (write_metadata(imgfs_file, index) == ERR_NONE && write_header(imgfs_file) == ERR_NONE
+        && commit_writes(imgfs_file) == ERR_NONE)
     {
-        if (fwrite(&(imgfs_file->metadata[index]), sizeof(struct img_metadata), ONE_ELEMENT, imgfs_file->file) == ONE_ELEMENT)
-        {
-            if (!fseek(imgfs_file->file, 0, SEEK_SET))
-            {
-                if (fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), ONE_ELEMENT, imgfs_file->file) == ONE_ELEMENT)
-                {
-                    return ERR_NONE;
-                }
-            }
-        }
+        imgfs_index_remove(imgfs_file, index);
+        return ERR_NONE;
     }
     imgfs_file->metadata[index].is_valid = NON_EMPTY;
     imgfs_file->header.version = old_version;
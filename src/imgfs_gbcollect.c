@@ -0,0 +1,359 @@
+/**
+ * @file imgfs_gbcollect.c
+ * @brief Incremental garbage collection of an imgFS.
+ *
+ * The compacted copy keeps every image in the same metadata slot, so
+ * that the slots can be copied in any order and copied again when they
+ * change. Contents are copied once per source offset: images sharing
+ * their content (see image_dedup.c) still share it in the copy.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#include "imgfs.h"
+#include "imgfs_gbcollect.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // for fsync
+
+// Key of an empty pair of the remap table (offset 0 is inside the header)
+#define NO_OFFSET 0
+
+// Smallest number of pairs of the remap table
+#define MIN_REMAP_CAPACITY 16
+
+// 64-bit Fibonacci hashing constant
+#define GOLDEN_64 0x9E3779B97F4A7C15ULL
+
+/********************************************************************
+ * Hashes a source offset
+ *******************************************************************/
+static size_t remap_hash(uint64_t offset, size_t capacity)
+{
+    const uint64_t h = offset * GOLDEN_64;
+    return (size_t)(h ^ (h >> 32)) & (capacity - 1);
+}
+
+/********************************************************************
+ * Finds the pair of a source offset, or the empty pair where it goes
+ *******************************************************************/
+static uint64_t *remap_slot(uint64_t *remap, size_t capacity, uint64_t offset)
+{
+    size_t i = remap_hash(offset, capacity);
+    while (remap[2 * i] != NO_OFFSET && remap[2 * i] != offset)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &remap[2 * i];
+}
+
+/********************************************************************
+ * Doubles the capacity of the remap table
+ *******************************************************************/
+static int remap_grow(struct imgfs_gbcollect *gc)
+{
+    const size_t capacity = 2 * gc->remap_capacity;
+    uint64_t *remap = calloc(2 * capacity, sizeof(uint64_t));
+    if (remap == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < gc->remap_capacity; i++)
+    {
+        if (gc->remap[2 * i] != NO_OFFSET)
+        {
+            uint64_t *pair = remap_slot(remap, capacity, gc->remap[2 * i]);
+            pair[0] = gc->remap[2 * i];
+            pair[1] = gc->remap[2 * i + 1];
+        }
+    }
+    free(gc->remap);
+    gc->remap = remap;
+    gc->remap_capacity = capacity;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Frees everything held by a collection
+ *******************************************************************/
+static void gbcollect_release(struct imgfs_gbcollect *gc)
+{
+    if (gc->target != NULL)
+    {
+        fclose(gc->target);
+        gc->target = NULL;
+    }
+    free(gc->target_path);
+    gc->target_path = NULL;
+    free(gc->metadata);
+    gc->metadata = NULL;
+    free(gc->copied);
+    gc->copied = NULL;
+    free(gc->remap);
+    gc->remap = NULL;
+    gc->remap_capacity = EMPTY;
+    gc->remap_used = EMPTY;
+    gc->source = NULL;
+}
+
+/********************************************************************
+ * Copies a content of the source at the end of the target, unless it
+ * was already copied
+ *******************************************************************/
+static int copy_content(struct imgfs_gbcollect *gc, uint64_t offset, uint32_t size, uint64_t *new_offset)
+{
+    uint64_t *pair = remap_slot(gc->remap, gc->remap_capacity, offset);
+    if (pair[0] == offset)
+    {
+        *new_offset = pair[1];
+        return ERR_NONE;
+    }
+
+    char *buffer = malloc(size);
+    if (buffer == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if (read_content(gc->source, offset, buffer, size) != ERR_NONE
+        || fseek(gc->target, 0, SEEK_END))
+    {
+        free(buffer);
+        return ERR_IO;
+    }
+
+    const long end_of_file = ftell(gc->target);
+    if (end_of_file < 0 || fwrite(buffer, size, ONE_ELEMENT, gc->target) != ONE_ELEMENT)
+    {
+        free(buffer);
+        return ERR_IO;
+    }
+    free(buffer);
+    *new_offset = (uint64_t)end_of_file;
+
+    pair[0] = offset;
+    pair[1] = *new_offset;
+    gc->remap_used++;
+
+    // Keep the table at most half full, so that probing stays short
+    if (2 * gc->remap_used > gc->remap_capacity)
+    {
+        return remap_grow(gc);
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Copies one metadata slot and the contents it refers to
+ *******************************************************************/
+static int copy_slot(struct imgfs_gbcollect *gc, uint32_t slot)
+{
+    const struct img_metadata *metadata = &gc->source->metadata[slot];
+    struct img_metadata *copy = &gc->metadata[slot];
+
+    memcpy(&gc->copied[slot], metadata, sizeof(struct img_metadata));
+    if (metadata->is_valid != NON_EMPTY)
+    {
+        memset(copy, 0, sizeof(struct img_metadata));
+        return ERR_NONE;
+    }
+
+    memcpy(copy, metadata, sizeof(struct img_metadata));
+    for (int res = 0; res < NB_RES; res++)
+    {
+        // Resized contents which were never created have no offset
+        if (metadata->size[res] != EMPTY && metadata->offset[res] != NO_OFFSET)
+        {
+            const int ret = copy_content(gc, metadata->offset[res], metadata->size[res], &copy->offset[res]);
+            if (ret != ERR_NONE)
+            {
+                return ret;
+            }
+        }
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Starts collecting an open imgFS.
+ *******************************************************************/
+int imgfs_gbcollect_start(struct imgfs_gbcollect *gc, struct imgfs_file *imgfs_file, const char *tmp_path)
+{
+    M_REQUIRE_NON_NULL(gc);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(tmp_path);
+
+    memset(gc, 0, sizeof(struct imgfs_gbcollect));
+    gc->source = imgfs_file;
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    gc->remap_capacity = MIN_REMAP_CAPACITY;
+    while (gc->remap_capacity < 2 * NB_RES * (size_t)max_files)
+    {
+        gc->remap_capacity *= 2;
+    }
+
+    gc->target_path = strdup(tmp_path);
+    gc->metadata = calloc(max_files, sizeof(struct img_metadata));
+    gc->copied = calloc(max_files, sizeof(struct img_metadata));
+    gc->remap = calloc(2 * gc->remap_capacity, sizeof(uint64_t));
+    if (gc->target_path == NULL || gc->remap == NULL
+        || (max_files > 0 && (gc->metadata == NULL || gc->copied == NULL)))
+    {
+        gbcollect_release(gc);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Reserve the room of the header and of the metadata, written when finishing
+    gc->target = fopen(tmp_path, "wb");
+    if (gc->target == NULL)
+    {
+        gbcollect_release(gc);
+        return ERR_IO;
+    }
+    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), ONE_ELEMENT, gc->target) != ONE_ELEMENT
+        || fwrite(gc->metadata, sizeof(struct img_metadata), max_files, gc->target) != max_files)
+    {
+        imgfs_gbcollect_abort(gc);
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Copies the content of the next metadata slots.
+ *******************************************************************/
+int imgfs_gbcollect_step(struct imgfs_gbcollect *gc, uint32_t max_slots)
+{
+    M_REQUIRE_NON_NULL(gc);
+    M_REQUIRE_NON_NULL(gc->source);
+
+    for (uint32_t n = 0; n < max_slots && !imgfs_gbcollect_done(gc); n++)
+    {
+        const int ret = copy_slot(gc, gc->next_slot);
+        if (ret != ERR_NONE)
+        {
+            return ret;
+        }
+        gc->next_slot++;
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Tells whether every slot has been copied.
+ *******************************************************************/
+int imgfs_gbcollect_done(const struct imgfs_gbcollect *gc)
+{
+    return gc == NULL || gc->source == NULL || gc->next_slot >= gc->source->header.max_files;
+}
+
+/********************************************************************
+ * Replaces the imgFS by its compacted copy.
+ *******************************************************************/
+int imgfs_gbcollect_finish(struct imgfs_gbcollect *gc, const char *imgfs_path)
+{
+    M_REQUIRE_NON_NULL(gc);
+    M_REQUIRE_NON_NULL(gc->source);
+    M_REQUIRE_NON_NULL(imgfs_path);
+
+    struct imgfs_file *source = gc->source;
+    const uint32_t max_files = source->header.max_files;
+
+    int ret = imgfs_gbcollect_step(gc, max_files);
+
+    // Catch up with the changes made to the slots already copied
+    for (uint32_t i = 0; ret == ERR_NONE && i < max_files; i++)
+    {
+        if (memcmp(&gc->copied[i], &source->metadata[i], sizeof(struct img_metadata)))
+        {
+            ret = copy_slot(gc, i);
+        }
+    }
+    if (ret != ERR_NONE)
+    {
+        imgfs_gbcollect_abort(gc);
+        return ret;
+    }
+
+    // The copy must be complete on disk before it replaces the source
+    if (fseek(gc->target, 0, SEEK_SET)
+        || fwrite(&source->header, sizeof(struct imgfs_header), ONE_ELEMENT, gc->target) != ONE_ELEMENT
+        || fwrite(gc->metadata, sizeof(struct img_metadata), max_files, gc->target) != max_files
+        || fflush(gc->target) || fsync(fileno(gc->target)))
+    {
+        imgfs_gbcollect_abort(gc);
+        return ERR_IO;
+    }
+
+    if (rename(gc->target_path, imgfs_path))
+    {
+        imgfs_gbcollect_abort(gc);
+        return ERR_IO;
+    }
+    gbcollect_release(gc);
+
+    // The copy has every pending change: the replaced file needs none of them
+    struct imgfs_pending policy = source->pending;
+    free(source->pending.dirty_slots);
+    memset(&source->pending, 0, sizeof(struct imgfs_pending));
+
+    // Reopen the imgFS the way it was opened
+    const int mapped = source->mapping != NULL;
+    do_close(source);
+    const int ret_open = mapped ? do_open_mapped(imgfs_path, "rb+", source) : do_open(imgfs_path, "rb+", source);
+    if (ret_open != ERR_NONE)
+    {
+        return ret_open;
+    }
+    return set_write_policy(source, policy.max_updates, policy.max_delay_ms, policy.durability);
+}
+
+/********************************************************************
+ * Gives up a collection.
+ *******************************************************************/
+void imgfs_gbcollect_abort(struct imgfs_gbcollect *gc)
+{
+    if (gc == NULL)
+    {
+        return;
+    }
+    if (gc->target != NULL)
+    {
+        fclose(gc->target);
+        gc->target = NULL;
+        remove(gc->target_path);
+    }
+    gbcollect_release(gc);
+}
+
+/********************************************************************
+ * Removes the deleted images by moving the existing ones.
+ *******************************************************************/
+int do_gbcollect(const char *imgfs_path, const char *imgfs_tmp_bkp_path)
+{
+    M_REQUIRE_NON_NULL(imgfs_path);
+    M_REQUIRE_NON_NULL(imgfs_tmp_bkp_path);
+
+    struct imgfs_file imgfs_file;
+    int ret = do_open(imgfs_path, "rb+", &imgfs_file);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+
+    // Nothing else uses the imgFS: it can be collected in a single step
+    struct imgfs_gbcollect gc;
+    ret = imgfs_gbcollect_start(&gc, &imgfs_file, imgfs_tmp_bkp_path);
+    if (ret == ERR_NONE)
+    {
+        ret = imgfs_gbcollect_finish(&gc, imgfs_path);
+    }
+    do_close(&imgfs_file);
+    return ret;
+}
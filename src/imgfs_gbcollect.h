@@ -0,0 +1,89 @@
+/**
+ * @file imgfs_gbcollect.h
+ * @brief Incremental garbage collection of an imgFS.
+ *
+ * The live images of an open imgFS are copied, a few metadata slots at a
+ * time, into a new file next to it. Between two steps the imgFS stays
+ * usable: the slots modified after having been copied are copied again
+ * when the collection is finished, and the new file then atomically
+ * replaces the old one.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct img_metadata
+
+#include <stdio.h>  // for FILE
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_gbcollect
+{
+    struct imgfs_file *source;      // imgFS being collected
+    char *target_path;              // where the compacted copy is built
+    FILE *target;                   // the compacted copy
+    struct img_metadata *metadata;  // metadata of the compacted copy
+    struct img_metadata *copied;    // source metadata, as it was when last copied
+    uint64_t *remap;                // pairs (source offset, target offset) of the copied contents
+    size_t remap_capacity;          // number of pairs of remap
+    size_t remap_used;              // number of non-empty pairs of remap
+    uint32_t next_slot;             // first slot not copied yet
+};
+
+/**
+ * @brief Starts collecting an open imgFS.
+ *
+ * @param gc The collection to start
+ * @param imgfs_file The imgFS to collect, opened in "rb+" mode
+ * @param tmp_path The path of the (to be created) compacted copy
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_gbcollect_start(struct imgfs_gbcollect *gc, struct imgfs_file *imgfs_file, const char *tmp_path);
+
+/**
+ * @brief Copies the content of the next metadata slots.
+ *
+ * @param gc The collection
+ * @param max_slots The maximum number of slots to copy
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_gbcollect_step(struct imgfs_gbcollect *gc, uint32_t max_slots);
+
+/**
+ * @brief Tells whether every slot has been copied.
+ *
+ * @param gc The collection
+ * @return Non-zero if imgfs_gbcollect_finish() can be called.
+ */
+int imgfs_gbcollect_done(const struct imgfs_gbcollect *gc);
+
+/**
+ * @brief Copies the slots not copied yet or changed since they were
+ *        copied, replaces the imgFS file by the compacted copy and
+ *        reopens it in place.
+ *
+ * The collection is released, whether it succeeds or not. The imgFS
+ * must not be used concurrently with this call.
+ *
+ * @param gc The collection
+ * @param imgfs_path The path of the imgFS being collected
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_gbcollect_finish(struct imgfs_gbcollect *gc, const char *imgfs_path);
+
+/**
+ * @brief Gives up a collection and removes the compacted copy.
+ *
+ * @param gc The collection
+ */
+void imgfs_gbcollect_abort(struct imgfs_gbcollect *gc);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,451 @@
+/**
+ * @file imgfs_index.c
+ * @brief In-memory lookup structures over the metadata array
+ *
+ * The hash tables use open addressing with linear probing. Buckets store
+ * the metadata slot + 1 so that a zeroed table is empty. Deleted entries
+ * leave a tombstone which is cleaned up when the table gets rebuilt.
+ * A table whose buckets are NULL is considered absent: lookups then fall
+ * back to a linear scan of the metadata.
+ *
+ * Empty slots are tracked in a bitmap (one bit per slot, set when empty),
+ * scanned word by word from a hint below which every word is known to be 0.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#include "imgfs_index.h"
+#include "util.h" // for MIN
+
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for strcmp, memcmp, memcpy
+
+#define EMPTY_BUCKET 0
+#define TOMBSTONE UINT32_MAX
+
+// The table is rebuilt once more than 3/4 of the buckets are in use
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+
+#define BITS_PER_WORD 64
+
+// 64-bit FNV-1a parameters
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * @brief Describes which key of the metadata an index is built on.
+ */
+struct index_kind
+{
+    const void *(*key_of)(const struct img_metadata *metadata);
+    uint64_t (*hash)(const void *key);
+    int (*equal)(const void *key1, const void *key2);
+};
+
+/********************************************************************
+ * Image ID key
+ *******************************************************************/
+static const void *id_of(const struct img_metadata *metadata)
+{
+    return metadata->img_id;
+}
+
+static uint64_t hash_id(const void *key)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (const unsigned char *c = key; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static int equal_id(const void *key1, const void *key2)
+{
+    return !strcmp(key1, key2);
+}
+
+static const struct index_kind id_kind = {id_of, hash_id, equal_id};
+
+/********************************************************************
+ * Content key
+ *******************************************************************/
+static const void *sha_of(const struct img_metadata *metadata)
+{
+    return metadata->SHA;
+}
+
+static uint64_t hash_sha(const void *key)
+{
+    // A SHA-256 digest is already uniformly distributed
+    uint64_t hash = EMPTY;
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static int equal_sha(const void *key1, const void *key2)
+{
+    return !memcmp(key1, key2, SHA256_DIGEST_LENGTH);
+}
+
+static const struct index_kind sha_kind = {sha_of, hash_sha, equal_sha};
+
+/********************************************************************
+ * Allocates an empty table able to hold max_files entries
+ *******************************************************************/
+static int index_init(struct imgfs_index *index, uint32_t max_files)
+{
+    // Keep the load factor of live entries under 1/2
+    size_t capacity = 1;
+    while (capacity < 2 * (size_t)max_files)
+    {
+        capacity <<= 1;
+    }
+
+    index->buckets = calloc(capacity, sizeof(uint32_t));
+    if (index->buckets == NULL)
+    {
+        index->capacity = EMPTY;
+        index->used = EMPTY;
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->capacity = capacity;
+    index->used = EMPTY;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Frees a table
+ *******************************************************************/
+static void index_release(struct imgfs_index *index)
+{
+    free(index->buckets);
+    index->buckets = NULL;
+    index->capacity = EMPTY;
+    index->used = EMPTY;
+}
+
+/********************************************************************
+ * Puts a slot in the first free bucket of its probe sequence
+ *******************************************************************/
+static void index_put(struct imgfs_index *index, uint64_t hash, uint32_t slot)
+{
+    const size_t mask = index->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (index->buckets[i] != EMPTY_BUCKET && index->buckets[i] != TOMBSTONE)
+    {
+        i = (i + 1) & mask;
+    }
+    if (index->buckets[i] == EMPTY_BUCKET)
+    {
+        index->used++;
+    }
+    index->buckets[i] = slot + 1;
+}
+
+/********************************************************************
+ * Rebuilds a table from its live entries, dropping the tombstones.
+ * If memory is lacking, the table is dropped altogether.
+ *******************************************************************/
+static void index_rehash(struct imgfs_index *index, const struct index_kind *kind,
+                         const struct img_metadata *metadata)
+{
+    struct imgfs_index rebuilt = {NULL, index->capacity, EMPTY};
+    rebuilt.buckets = calloc(rebuilt.capacity, sizeof(uint32_t));
+    if (rebuilt.buckets == NULL)
+    {
+        index_release(index);
+        return;
+    }
+
+    for (size_t i = 0; i < index->capacity; i++)
+    {
+        const uint32_t bucket = index->buckets[i];
+        if (bucket != EMPTY_BUCKET && bucket != TOMBSTONE)
+        {
+            index_put(&rebuilt, kind->hash(kind->key_of(&metadata[bucket - 1])), bucket - 1);
+        }
+    }
+
+    free(index->buckets);
+    *index = rebuilt;
+}
+
+/********************************************************************
+ * Adds a slot to a table
+ *******************************************************************/
+static void index_insert(struct imgfs_index *index, const struct index_kind *kind,
+                         const struct img_metadata *metadata, uint32_t slot)
+{
+    if (index->buckets == NULL)
+    {
+        return;
+    }
+
+    if ((index->used + 1) * MAX_LOAD_DENOMINATOR > index->capacity * MAX_LOAD_NUMERATOR)
+    {
+        index_rehash(index, kind, metadata);
+        if (index->buckets == NULL)
+        {
+            return;
+        }
+    }
+
+    index_put(index, kind->hash(kind->key_of(&metadata[slot])), slot);
+}
+
+/********************************************************************
+ * Removes a slot from a table
+ *******************************************************************/
+static void index_erase(struct imgfs_index *index, const struct index_kind *kind,
+                        const struct img_metadata *metadata, uint32_t slot)
+{
+    if (index->buckets == NULL)
+    {
+        return;
+    }
+
+    const size_t mask = index->capacity - 1;
+    for (size_t i = (size_t)kind->hash(kind->key_of(&metadata[slot])) & mask;
+         index->buckets[i] != EMPTY_BUCKET; i = (i + 1) & mask)
+    {
+        if (index->buckets[i] == slot + 1)
+        {
+            index->buckets[i] = TOMBSTONE;
+            return;
+        }
+    }
+}
+
+/********************************************************************
+ * Looks for a valid slot, other than exclude, whose key equals key
+ *******************************************************************/
+static uint32_t index_find(const struct imgfs_file *imgfs_file, const struct imgfs_index *index,
+                           const struct index_kind *kind, const void *key, uint32_t exclude)
+{
+    const struct img_metadata *metadata = imgfs_file->metadata;
+
+    if (index->buckets == NULL)
+    {
+        for (uint32_t i = 0; i < imgfs_file->header.max_files; i++)
+        {
+            if (i != exclude && metadata[i].is_valid == NON_EMPTY && kind->equal(kind->key_of(&metadata[i]), key))
+            {
+                return i;
+            }
+        }
+        return NO_SLOT;
+    }
+
+    const size_t mask = index->capacity - 1;
+    for (size_t i = (size_t)kind->hash(key) & mask; index->buckets[i] != EMPTY_BUCKET; i = (i + 1) & mask)
+    {
+        const uint32_t bucket = index->buckets[i];
+        if (bucket == TOMBSTONE)
+        {
+            continue;
+        }
+
+        // The metadata is checked again, as it is the only source of truth
+        const uint32_t slot = bucket - 1;
+        if (slot != exclude && metadata[slot].is_valid == NON_EMPTY && kind->equal(kind->key_of(&metadata[slot]), key))
+        {
+            return slot;
+        }
+    }
+    return NO_SLOT;
+}
+
+/********************************************************************
+ * Number of words of the free slots bitmap
+ *******************************************************************/
+static size_t bitmap_words(uint32_t max_files)
+{
+    return ((size_t)max_files + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
+
+/********************************************************************
+ * Marks a slot as empty in the free slots bitmap
+ *******************************************************************/
+static void bitmap_mark_free(struct imgfs_file *imgfs_file, uint32_t slot)
+{
+    if (imgfs_file->free_slots != NULL)
+    {
+        const size_t word = slot / BITS_PER_WORD;
+        imgfs_file->free_slots[word] |= (uint64_t)1 << (slot % BITS_PER_WORD);
+        imgfs_file->free_slots_hint = MIN(imgfs_file->free_slots_hint, word);
+    }
+}
+
+/********************************************************************
+ * Marks a slot as in use in the free slots bitmap
+ *******************************************************************/
+static void bitmap_mark_used(struct imgfs_file *imgfs_file, uint32_t slot)
+{
+    if (imgfs_file->free_slots != NULL)
+    {
+        imgfs_file->free_slots[slot / BITS_PER_WORD] &= ~((uint64_t)1 << (slot % BITS_PER_WORD));
+    }
+}
+
+/********************************************************************
+ * Builds the indexes from the metadata array.
+ *******************************************************************/
+int imgfs_index_build(struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    if (imgfs_file->header.max_files >= TOMBSTONE)
+    {
+        return ERR_MAX_FILES;
+    }
+
+    int ret = index_init(&imgfs_file->id_index, imgfs_file->header.max_files);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+
+    ret = index_init(&imgfs_file->sha_index, imgfs_file->header.max_files);
+    if (ret != ERR_NONE)
+    {
+        index_release(&imgfs_file->id_index);
+        return ret;
+    }
+
+    imgfs_file->free_slots = calloc(bitmap_words(imgfs_file->header.max_files), sizeof(uint64_t));
+    imgfs_file->free_slots_hint = EMPTY;
+    if (imgfs_file->free_slots == NULL && imgfs_file->header.max_files > 0)
+    {
+        index_release(&imgfs_file->id_index);
+        index_release(&imgfs_file->sha_index);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++)
+    {
+        if (imgfs_file->metadata[i].is_valid == NON_EMPTY)
+        {
+            index_insert(&imgfs_file->id_index, &id_kind, imgfs_file->metadata, i);
+            index_insert(&imgfs_file->sha_index, &sha_kind, imgfs_file->metadata, i);
+        }
+        else
+        {
+            bitmap_mark_free(imgfs_file, i);
+        }
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Frees the indexes.
+ *******************************************************************/
+void imgfs_index_free(struct imgfs_file *imgfs_file)
+{
+    if (imgfs_file != NULL)
+    {
+        index_release(&imgfs_file->id_index);
+        index_release(&imgfs_file->sha_index);
+        free(imgfs_file->free_slots);
+        imgfs_file->free_slots = NULL;
+        imgfs_file->free_slots_hint = EMPTY;
+    }
+}
+
+/********************************************************************
+ * Looks for a valid image with the given ID.
+ *******************************************************************/
+uint32_t imgfs_index_find_id(const struct imgfs_file *imgfs_file, const char *img_id, uint32_t exclude)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL || img_id == NULL)
+    {
+        return NO_SLOT;
+    }
+    return index_find(imgfs_file, &imgfs_file->id_index, &id_kind, img_id, exclude);
+}
+
+/********************************************************************
+ * Looks for a valid image with the given content hash.
+ *******************************************************************/
+uint32_t imgfs_index_find_sha(const struct imgfs_file *imgfs_file, const unsigned char *SHA, uint32_t exclude)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL || SHA == NULL)
+    {
+        return NO_SLOT;
+    }
+    return index_find(imgfs_file, &imgfs_file->sha_index, &sha_kind, SHA, exclude);
+}
+
+/********************************************************************
+ * Finds the first empty slot of the metadata array.
+ *******************************************************************/
+uint32_t imgfs_index_find_free(struct imgfs_file *imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL)
+    {
+        return NO_SLOT;
+    }
+
+    if (imgfs_file->free_slots == NULL)
+    {
+        for (uint32_t i = 0; i < imgfs_file->header.max_files; i++)
+        {
+            if (imgfs_file->metadata[i].is_valid == EMPTY)
+            {
+                return i;
+            }
+        }
+        return NO_SLOT;
+    }
+
+    const size_t words = bitmap_words(imgfs_file->header.max_files);
+    for (size_t word = imgfs_file->free_slots_hint; word < words; word++)
+    {
+        while (imgfs_file->free_slots[word] != 0)
+        {
+            const uint32_t slot = (uint32_t)(word * BITS_PER_WORD) + (uint32_t)__builtin_ctzll(imgfs_file->free_slots[word]);
+            imgfs_file->free_slots_hint = word;
+
+            // The metadata is checked again, as it is the only source of truth
+            if (imgfs_file->metadata[slot].is_valid == EMPTY)
+            {
+                return slot;
+            }
+            imgfs_file->free_slots[word] &= imgfs_file->free_slots[word] - 1;
+        }
+    }
+    imgfs_file->free_slots_hint = words;
+    return NO_SLOT;
+}
+
+/********************************************************************
+ * Registers a slot which just became valid.
+ *******************************************************************/
+void imgfs_index_add(struct imgfs_file *imgfs_file, uint32_t slot)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL || slot >= imgfs_file->header.max_files)
+    {
+        return;
+    }
+    index_insert(&imgfs_file->id_index, &id_kind, imgfs_file->metadata, slot);
+    index_insert(&imgfs_file->sha_index, &sha_kind, imgfs_file->metadata, slot);
+    bitmap_mark_used(imgfs_file, slot);
+}
+
+/********************************************************************
+ * Unregisters a slot which is being invalidated.
+ *******************************************************************/
+void imgfs_index_remove(struct imgfs_file *imgfs_file, uint32_t slot)
+{
+    if (imgfs_file == NULL || imgfs_file->metadata == NULL || slot >= imgfs_file->header.max_files)
+    {
+        return;
+    }
+    index_erase(&imgfs_file->id_index, &id_kind, imgfs_file->metadata, slot);
+    index_erase(&imgfs_file->sha_index, &sha_kind, imgfs_file->metadata, slot);
+    bitmap_mark_free(imgfs_file, slot);
+}
@@ -0,0 +1,87 @@
+/**
+ * @file imgfs_index.h
+ * @brief In-memory lookup structures over the metadata array.
+ *
+ * These structures are never written to disk: they are rebuilt from the
+ * metadata each time an imgFS is opened or created, and kept up to date
+ * by the functions that modify the metadata.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct imgfs_index
+
+#include <stdint.h> // for uint32_t
+
+// Slot value meaning "no slot"
+#define NO_SLOT UINT32_MAX
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Allocates and fills the indexes from the metadata array.
+ *
+ * @param imgfs_file The main in-memory structure, with its metadata loaded
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_index_build(struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Frees the indexes. Safe to call on indexes that were never built.
+ *
+ * @param imgfs_file The main in-memory structure
+ */
+void imgfs_index_free(struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Looks for a valid image with the given ID.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param img_id The ID to look for
+ * @param exclude A slot to ignore (NO_SLOT to consider every slot)
+ * @return The slot of the image in the metadata array, NO_SLOT if not found.
+ */
+uint32_t imgfs_index_find_id(const struct imgfs_file *imgfs_file, const char *img_id, uint32_t exclude);
+
+/**
+ * @brief Looks for a valid image with the given content hash.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param SHA The SHA-256 digest to look for
+ * @param exclude A slot to ignore (NO_SLOT to consider every slot)
+ * @return The slot of an image with that content, NO_SLOT if not found.
+ */
+uint32_t imgfs_index_find_sha(const struct imgfs_file *imgfs_file, const unsigned char *SHA, uint32_t exclude);
+
+/**
+ * @brief Finds the first empty slot of the metadata array.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @return The first empty slot, NO_SLOT if the metadata array is full.
+ */
+uint32_t imgfs_index_find_free(struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Registers a slot which just became valid.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param slot The slot in the metadata array
+ */
+void imgfs_index_add(struct imgfs_file *imgfs_file, uint32_t slot);
+
+/**
+ * @brief Unregisters a slot which is about to be (or has just been) invalidated.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param slot The slot in the metadata array
+ */
+void imgfs_index_remove(struct imgfs_file *imgfs_file, uint32_t slot);
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,11 +9,104 @@
 #include "imgfs.h"
 #include "image_content.h"
 #include "image_dedup.h"
+#include "imgfs_index.h"
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h> // for mmap, munmap
+#include <unistd.h>   // for sysconf
 
 #define WIDTH_INDEX 0
 #define HEIGHT_INDEX 1
 
+// Largest number of threads hashing the images of a batch
+#define BATCH_MAX_THREADS 8
+
+// What is found about an image of a batch before inserting it
+struct batch_probe
+{
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t width;
+    uint32_t height;
+    int result;
+};
+
+// Share of a batch probed by one thread: images first, first + stride, ...
+struct batch_probe_job
+{
+    const struct imgfs_batch_image *images;
+    struct batch_probe *probes;
+    size_t nb_images;
+    size_t first;
+    size_t stride;
+};
+
+/********************************************************************
+ * Fills the metadata of a new image, whose SHA is already computed,
+ * and checks it is not a duplicate of an existing image name.
+ *******************************************************************/
+static int describe_image(struct imgfs_file *imgfs_file, uint32_t i, const char *img_id,
+                          uint32_t width, uint32_t height)
+{
+    if (strcpy(imgfs_file->metadata[i].img_id, img_id) == NULL)
+    {
+        return ERR_IO;
+    }
+
+    imgfs_file->metadata[i].orig_res[WIDTH_INDEX] = width;
+    imgfs_file->metadata[i].orig_res[HEIGHT_INDEX] = height;
+
+    return do_name_and_content_dedup(imgfs_file, i);
+}
+
+/********************************************************************
+ * Records where the content of a new image is, and makes it valid
+ * in memory.
+ *******************************************************************/
+static void record_image(struct imgfs_file *imgfs_file, uint32_t i, uint64_t offset, size_t image_size)
+{
+    // Update the metadata, unless the image shares the content of another one
+    if (offset != OFFSET_ZERO)
+    {
+        imgfs_file->metadata[i].offset[ORIG_RES] = offset;
+        imgfs_file->metadata[i].offset[THUMB_RES] = EMPTY;
+        imgfs_file->metadata[i].offset[SMALL_RES] = EMPTY;
+
+        imgfs_file->metadata[i].size[ORIG_RES] = (uint32_t)image_size;
+        imgfs_file->metadata[i].size[THUMB_RES] = EMPTY;
+        imgfs_file->metadata[i].size[SMALL_RES] = EMPTY;
+    }
+
+    imgfs_file->metadata[i].is_valid = NON_EMPTY;
+    imgfs_index_add(imgfs_file, i);
+
+    // Update the header
+    imgfs_file->header.nb_files++;
+    imgfs_file->header.version++;
+}
+
+/********************************************************************
+ * Records a new image and writes its metadata to disk.
+ *******************************************************************/
+static int commit_image(struct imgfs_file *imgfs_file, uint32_t i, uint64_t offset, size_t image_size)
+{
+    record_image(imgfs_file, i, offset, image_size);
+
+    // Write the header and the corresponding metadata to disk
+    int ret = write_header(imgfs_file);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+
+    ret = write_metadata(imgfs_file, i);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+    return commit_writes(imgfs_file);
+}
+
 /********************************************************************
  * Insert an image into the imgFS.
  *******************************************************************/
@@ -28,91 +121,412 @@ int do_insert(const char *image_buffer, size_t image_size, const char *img_id, s
         return ERR_IMGFS_FULL;
     }
 
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++)
+    // Find an empty entry in the metadata table
+    const uint32_t i = imgfs_index_find_free(imgfs_file);
+    if (i == NO_SLOT)
+    {
+        return ERR_IMGFS_FULL;
+    }
+
+    if (SHA256((const unsigned char *)image_buffer, image_size, imgfs_file->metadata[i].SHA) == NULL)
+    {
+        return ERR_IO;
+    }
+
+    // Initialize the height and width to be determined
+    uint32_t height = 0;
+    uint32_t width = 0;
+    int ret = get_resolution(&height, &width, image_buffer, image_size);
+    if (ret != ERR_NONE)
     {
-        // Find an empty entry in the metadata table
-        if (!imgfs_file->metadata[i].is_valid)
+        return ret;
+    }
+
+    ret = describe_image(imgfs_file, i, img_id, width, height);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+
+    // Check if image was not duplicated
+    uint64_t offset = OFFSET_ZERO;
+    if (imgfs_file->metadata[i].offset[ORIG_RES] == OFFSET_ZERO)
+    {
+        ret = append_content(imgfs_file, image_buffer, image_size, &offset);
+        if (ret != ERR_NONE)
         {
-            if (SHA256((const unsigned char *)image_buffer, image_size, imgfs_file->metadata[i].SHA) == NULL)
-            {
-                return ERR_IO;
-            }
+            return ret;
+        }
+    }
+    return commit_image(imgfs_file, i, offset, image_size);
+}
 
-            if (strcpy(imgfs_file->metadata[i].img_id, img_id) == NULL)
-            {
-                return ERR_IO;
-            }
+/********************************************************************
+ * Starts inserting an image whose content is given in pieces.
+ *******************************************************************/
+int do_insert_stream_begin(struct imgfs_file *imgfs_file, size_t image_size,
+                           struct imgfs_insert_stream *stream)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(stream);
+
+    memset(stream, 0, sizeof(struct imgfs_insert_stream));
+    if (image_size == 0 || image_size > UINT32_MAX)
+    {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (imgfs_file->header.nb_files >= imgfs_file->header.max_files)
+    {
+        return ERR_IMGFS_FULL;
+    }
+
+    stream->sha = EVP_MD_CTX_new();
+    if (stream->sha == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = EVP_DigestInit_ex(stream->sha, EVP_sha256(), NULL) ? ERR_NONE : ERR_IO;
+    if (ret == ERR_NONE)
+    {
+        ret = reserve_content(imgfs_file, image_size, &stream->offset);
+    }
+    if (ret != ERR_NONE)
+    {
+        EVP_MD_CTX_free(stream->sha);
+        stream->sha = NULL;
+        return ret;
+    }
+    stream->size = image_size;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Writes the next piece of the content of an image being inserted.
+ *******************************************************************/
+int do_insert_stream_write(struct imgfs_file *imgfs_file, struct imgfs_insert_stream *stream,
+                           const void *buffer, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(stream->sha);
+    M_REQUIRE_NON_NULL(buffer);
+    if (size > stream->size - stream->written)
+    {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-            // Initialize the height and width to be determined
+    if (!EVP_DigestUpdate(stream->sha, buffer, size))
+    {
+        return ERR_IO;
+    }
+    const int ret = write_content(imgfs_file, stream->offset + stream->written, buffer, size);
+    if (ret == ERR_NONE)
+    {
+        stream->written += size;
+    }
+    return ret;
+}
+
+/********************************************************************
+ * Finishes inserting an image once its whole content is written.
+ *******************************************************************/
+int do_insert_stream_end(struct imgfs_file *imgfs_file, struct imgfs_insert_stream *stream,
+                         const char *img_id)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(stream->sha);
+    M_REQUIRE_NON_NULL(img_id);
+
+    int ret = stream->written == stream->size ? ERR_NONE : ERR_INVALID_ARGUMENT;
+
+    // Find an empty entry in the metadata table
+    uint32_t i = NO_SLOT;
+    if (ret == ERR_NONE)
+    {
+        i = imgfs_index_find_free(imgfs_file);
+        ret = i == NO_SLOT ? ERR_IMGFS_FULL : ERR_NONE;
+    }
+    if (ret == ERR_NONE && !EVP_DigestFinal_ex(stream->sha, imgfs_file->metadata[i].SHA, NULL))
+    {
+        ret = ERR_IO;
+    }
+
+    // The resolution is read from the content in the file, through the page cache
+    if (ret == ERR_NONE)
+    {
+        const uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+        const uint64_t map_offset = stream->offset - stream->offset % page_size;
+        const size_t map_size = stream->size + (size_t)(stream->offset - map_offset);
+        char *const mapping = mmap(NULL, map_size, PROT_READ, MAP_SHARED,
+                                   fileno(imgfs_file->file), (off_t)map_offset);
+        if (mapping == MAP_FAILED)
+        {
+            ret = ERR_IO;
+        }
+        else
+        {
             uint32_t height = 0;
             uint32_t width = 0;
-            int ret = ERR_NONE;
-
-            ret = get_resolution(&height, &width, image_buffer, image_size);
-            if (ret != ERR_NONE)
+            ret = get_resolution(&height, &width, mapping + (stream->offset - map_offset), stream->size);
+            munmap(mapping, map_size);
+            if (ret == ERR_NONE)
             {
-                return ret;
+                ret = describe_image(imgfs_file, i, img_id, width, height);
             }
+        }
+    }
 
-            imgfs_file->metadata[i].orig_res[WIDTH_INDEX] = width;
-            imgfs_file->metadata[i].orig_res[HEIGHT_INDEX] = height;
+    // A duplicated content is already in the imgFS: its room is not needed
+    const int keep_room = ret == ERR_NONE && imgfs_file->metadata[i].offset[ORIG_RES] == OFFSET_ZERO;
+    if (ret == ERR_NONE)
+    {
+        ret = commit_image(imgfs_file, i, keep_room ? stream->offset : OFFSET_ZERO, stream->size);
+    }
+    if (keep_room)
+    {
+        EVP_MD_CTX_free(stream->sha);
+        stream->sha = NULL;
+    }
+    else
+    {
+        do_insert_stream_abort(imgfs_file, stream);
+    }
+    return ret;
+}
 
-            ret = do_name_and_content_dedup(imgfs_file, i);
-            if (ret != ERR_NONE)
-            {
-                return ret;
-            }
+/********************************************************************
+ * Gives up inserting an image.
+ *******************************************************************/
+void do_insert_stream_abort(struct imgfs_file *imgfs_file, struct imgfs_insert_stream *stream)
+{
+    if (stream == NULL)
+    {
+        return;
+    }
+    if (stream->sha != NULL && imgfs_file != NULL && imgfs_file->file != NULL)
+    {
+        release_content(imgfs_file, stream->offset, stream->size);
+    }
+    EVP_MD_CTX_free(stream->sha);
+    stream->sha = NULL;
+}
 
-            // Check if image was not duplicated
-            if (imgfs_file->metadata[i].offset[ORIG_RES] == OFFSET_ZERO)
-            {
-                if (fseek(imgfs_file->file, 0, SEEK_END))
-                {
-                    return ERR_IO;
-                }
-
-                // Update the metadata
-                imgfs_file->metadata[i].offset[ORIG_RES] = (uint64_t)ftell(imgfs_file->file);
-                imgfs_file->metadata[i].offset[THUMB_RES] = EMPTY;
-                imgfs_file->metadata[i].offset[SMALL_RES] = EMPTY;
-
-                imgfs_file->metadata[i].size[ORIG_RES] = (uint32_t)image_size;
-                imgfs_file->metadata[i].size[THUMB_RES] = EMPTY;
-                imgfs_file->metadata[i].size[SMALL_RES] = EMPTY;
-
-                if (fwrite(image_buffer, image_size, ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
-                {
-                    return ERR_IO;
-                }
-            }
+/********************************************************************
+ * Hashes and finds the resolution of every image of a batch assigned
+ * to one thread.
+ *******************************************************************/
+static void *probe_images(void *arg)
+{
+    struct batch_probe_job *job = arg;
+    for (size_t k = job->first; k < job->nb_images; k += job->stride)
+    {
+        struct batch_probe *probe = &job->probes[k];
+        const struct imgfs_batch_image *image = &job->images[k];
+        if (image->img_id == NULL || image->image_buffer == NULL || image->image_size == 0)
+        {
+            probe->result = ERR_INVALID_ARGUMENT;
+        }
+        else if (strlen(image->img_id) > MAX_IMG_ID)
+        {
+            probe->result = ERR_INVALID_IMGID;
+        }
+        else if (SHA256((const unsigned char *)image->image_buffer, image->image_size, probe->SHA) == NULL)
+        {
+            probe->result = ERR_IO;
+        }
+        else
+        {
+            probe->result = get_resolution(&probe->height, &probe->width, image->image_buffer, image->image_size);
+        }
+    }
+    return NULL;
+}
 
-            imgfs_file->metadata[i].is_valid = NON_EMPTY;
+/********************************************************************
+ * Probes all the images of a batch, with several threads.
+ *******************************************************************/
+static void probe_batch(const struct imgfs_batch_image *images, struct batch_probe *probes, size_t nb_images)
+{
+    const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nb_threads = nb_cpus > 0 ? (size_t)nb_cpus : 1;
+    if (nb_threads > BATCH_MAX_THREADS)
+    {
+        nb_threads = BATCH_MAX_THREADS;
+    }
+    if (nb_threads > nb_images)
+    {
+        nb_threads = nb_images;
+    }
 
-            // Update the header
-            imgfs_file->header.nb_files++;
-            imgfs_file->header.version++;
+    struct batch_probe_job jobs[BATCH_MAX_THREADS];
+    pthread_t threads[BATCH_MAX_THREADS];
+    for (size_t t = 0; t < nb_threads; t++)
+    {
+        jobs[t] = (struct batch_probe_job){.images = images, .probes = probes, .nb_images = nb_images,
+                                           .first = t, .stride = nb_threads};
+    }
 
-            // Write the header and the corresponding metadata to disk
-            if (fseek(imgfs_file->file, OFFSET_ZERO, SEEK_SET))
-            {
-                return ERR_IO;
-            }
+    size_t started = 1;
+    while (started < nb_threads && !pthread_create(&threads[started], NULL, probe_images, &jobs[started]))
+    {
+        started++;
+    }
 
-            if (fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
-            {
-                return ERR_IO;
-            }
+    // The calling thread takes its own share, and the shares of the threads which could not start
+    probe_images(&jobs[0]);
+    for (size_t t = started; t < nb_threads; t++)
+    {
+        probe_images(&jobs[t]);
+    }
+    for (size_t t = 1; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+}
 
-            if (fseek(imgfs_file->file, i * sizeof(struct img_metadata), SEEK_CUR))
-            {
-                return ERR_IO;
-            }
-            if (fwrite(&(imgfs_file->metadata[i]), sizeof(struct img_metadata), ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
-            {
-                return ERR_IO;
-            }
-            break;
+/********************************************************************
+ * Forgets the images of a batch which were inserted in memory only.
+ *******************************************************************/
+static void unrecord_batch(struct imgfs_file *imgfs_file, struct imgfs_batch_image *images,
+                           const uint32_t *slots, size_t nb_images, int error)
+{
+    for (size_t k = 0; k < nb_images; k++)
+    {
+        if (slots[k] != NO_SLOT)
+        {
+            imgfs_index_remove(imgfs_file, slots[k]);
+            imgfs_file->metadata[slots[k]].is_valid = EMPTY;
+            imgfs_file->header.nb_files--;
+            imgfs_file->header.version--;
+            images[k].result = error;
         }
     }
-    return ERR_NONE;
+}
+
+/********************************************************************
+ * Inserts several images into the imgFS at once.
+ *******************************************************************/
+int do_insert_batch(struct imgfs_batch_image *images, size_t nb_images, struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(images);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (nb_images == 0)
+    {
+        return ERR_NONE;
+    }
+
+    struct batch_probe *probes = calloc(nb_images, sizeof(struct batch_probe));
+    uint32_t *slots = calloc(nb_images, sizeof(uint32_t));
+    const void **contents = calloc(nb_images, sizeof(void *));
+    size_t *sizes = calloc(nb_images, sizeof(size_t));
+    if (probes == NULL || slots == NULL || contents == NULL || sizes == NULL)
+    {
+        free(probes);
+        free(slots);
+        free(contents);
+        free(sizes);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    probe_batch(images, probes, nb_images);
+
+    // Room for every content: the duplicated ones are given back below
+    size_t room = 0;
+    for (size_t k = 0; k < nb_images; k++)
+    {
+        slots[k] = NO_SLOT;
+        images[k].result = probes[k].result;
+        if (probes[k].result == ERR_NONE)
+        {
+            room += images[k].image_size;
+        }
+    }
+    uint64_t base = OFFSET_ZERO;
+    int ret = room > 0 ? reserve_content(imgfs_file, room, &base) : ERR_NONE;
+    size_t reserved = ret == ERR_NONE ? room : 0;
+
+    // Insert the images in memory in their order, so that each one is
+    // deduplicated against the previous ones
+    uint64_t end = base;
+    size_t nb_contents = 0;
+    size_t nb_inserted = 0;
+    for (size_t k = 0; ret == ERR_NONE && k < nb_images; k++)
+    {
+        if (images[k].result != ERR_NONE)
+        {
+            continue;
+        }
+
+        const uint32_t i = imgfs_file->header.nb_files < imgfs_file->header.max_files
+                           ? imgfs_index_find_free(imgfs_file) : NO_SLOT;
+        if (i == NO_SLOT)
+        {
+            images[k].result = ERR_IMGFS_FULL;
+            continue;
+        }
+
+        memcpy(imgfs_file->metadata[i].SHA, probes[k].SHA, SHA256_DIGEST_LENGTH);
+        images[k].result = describe_image(imgfs_file, i, images[k].img_id, probes[k].width, probes[k].height);
+        if (images[k].result != ERR_NONE)
+        {
+            continue;
+        }
+
+        uint64_t offset = OFFSET_ZERO;
+        if (imgfs_file->metadata[i].offset[ORIG_RES] == OFFSET_ZERO)
+        {
+            offset = end;
+            end += images[k].image_size;
+            contents[nb_contents] = images[k].image_buffer;
+            sizes[nb_contents] = images[k].image_size;
+            nb_contents++;
+        }
+        record_image(imgfs_file, i, offset, images[k].image_size);
+        slots[k] = i;
+        nb_inserted++;
+    }
+
+    // All the new contents in one sequential write, then the header and
+    // the new metadata once
+    if (ret == ERR_NONE)
+    {
+        ret = write_contents(imgfs_file, base, contents, sizes, nb_contents);
+    }
+    if (ret == ERR_NONE && end < base + reserved)
+    {
+        ret = release_content(imgfs_file, end, reserved - (size_t)(end - base));
+        reserved = (size_t)(end - base);
+    }
+    if (ret == ERR_NONE && nb_inserted > 0)
+    {
+        ret = write_header(imgfs_file);
+    }
+    for (size_t k = 0; ret == ERR_NONE && k < nb_images; k++)
+    {
+        if (slots[k] != NO_SLOT)
+        {
+            ret = write_metadata(imgfs_file, slots[k]);
+        }
+    }
+    if (ret == ERR_NONE && nb_inserted > 0)
+    {
+        ret = commit_writes(imgfs_file);
+    }
+
+    if (ret != ERR_NONE)
+    {
+        unrecord_batch(imgfs_file, images, slots, nb_images, ret);
+        if (reserved > 0)
+        {
+            release_content(imgfs_file, base, reserved);
+        }
+    }
+    free(probes);
+    free(slots);
+    free(contents);
+    free(sizes);
+    return ret;
 }
@@ -0,0 +1,404 @@
+/**
+ * @file imgfs_resize.c
+ * @brief Background creation of the missing resolutions of an imgFS.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#include "imgfs_resize.h"
+#include "image_content.h"
+#include "imgfs_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct resize_job
+{
+    char img_id[MAX_IMG_ID + NULL_TERMINATOR];
+    unsigned int resolutions; // set of RES_MASK() of the resolutions to create
+    int result;
+    int done;
+    size_t waiters;          // requests waiting for the job, the last one frees it
+    pthread_cond_t finished; // signaled when done is set
+    struct resize_job *next; // in the pending or the running list
+};
+
+/********************************************************************
+ * Finds a job of an image creating at least the given resolutions in
+ * a list of jobs
+ *******************************************************************/
+static struct resize_job *find_job(struct resize_job *jobs, const char *img_id, unsigned int resolutions)
+{
+    while (jobs != NULL && ((jobs->resolutions & resolutions) != resolutions || strcmp(jobs->img_id, img_id)))
+    {
+        jobs = jobs->next;
+    }
+    return jobs;
+}
+
+/********************************************************************
+ * Returns a job creating the given resolutions of an image: a job
+ * already pending or running if any, otherwise a new pending one. The
+ * lock of the pool must be held.
+ *******************************************************************/
+static struct resize_job *queue_job(struct imgfs_resize_pool *pool, const char *img_id, unsigned int resolutions)
+{
+    struct resize_job *job = find_job(pool->pending, img_id, resolutions);
+    if (job == NULL)
+    {
+        job = find_job(pool->running, img_id, resolutions);
+    }
+    if (job != NULL)
+    {
+        return job;
+    }
+
+    // A pending job of the same image can create more resolutions with the same decoding
+    job = find_job(pool->pending, img_id, 0);
+    if (job != NULL)
+    {
+        job->resolutions |= resolutions;
+        return job;
+    }
+
+    job = calloc(ONE_ELEMENT, sizeof(struct resize_job));
+    if (job == NULL)
+    {
+        return NULL;
+    }
+    if (pthread_cond_init(&job->finished, NULL))
+    {
+        free(job);
+        return NULL;
+    }
+    strcpy(job->img_id, img_id);
+    job->resolutions = resolutions;
+    if (pool->last_pending != NULL)
+    {
+        pool->last_pending->next = job;
+    }
+    else
+    {
+        pool->pending = job;
+    }
+    pool->last_pending = job;
+    pthread_cond_signal(&pool->work);
+    return job;
+}
+
+/********************************************************************
+ * Frees a job. The lock of the pool must be held.
+ *******************************************************************/
+static void free_job(struct resize_job *job)
+{
+    pthread_cond_destroy(&job->finished);
+    free(job);
+}
+
+/********************************************************************
+ * Marks a job as done and wakes up its waiters, or frees it if nobody
+ * waits for it. The lock of the pool must be held.
+ *******************************************************************/
+static void finish_job(struct resize_job *job, int result)
+{
+    if (job->waiters == 0)
+    {
+        free_job(job);
+        return;
+    }
+    job->result = result;
+    job->done = NON_EMPTY;
+    pthread_cond_broadcast(&job->finished);
+}
+
+/********************************************************************
+ * Resizes an image. Only the final store holds the exclusive lock.
+ * The original is read back from the imgFS and decoded here: the
+ * insert does not decode it, and its body may have been streamed.
+ *******************************************************************/
+static int run_job(struct imgfs_resize_pool *pool, const struct resize_job *job)
+{
+    struct imgfs_file *imgfs_file = pool->imgfs_file;
+
+    pthread_rwlock_rdlock(pool->imgfs_lock);
+    const uint32_t slot = imgfs_index_find_id(imgfs_file, job->img_id, NO_SLOT);
+    if (slot == NO_SLOT)
+    {
+        pthread_rwlock_unlock(pool->imgfs_lock);
+        return ERR_IMAGE_NOT_FOUND;
+    }
+    const struct img_metadata *metadata = &imgfs_file->metadata[slot];
+    unsigned int missing = 0;
+    for (int res = 0; res < NB_RES; res++)
+    {
+        if ((job->resolutions & RES_MASK(res)) && metadata->offset[res] == 0)
+        {
+            missing |= RES_MASK(res);
+        }
+    }
+    if (missing == 0)
+    {
+        pthread_rwlock_unlock(pool->imgfs_lock);
+        return ERR_NONE;
+    }
+
+    const struct imgfs_header header = imgfs_file->header;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    memcpy(sha, metadata->SHA, SHA256_DIGEST_LENGTH);
+    const uint32_t orig_size = metadata->size[ORIG_RES];
+    void *orig_img = malloc(orig_size);
+    int ret = orig_img == NULL ? ERR_OUT_OF_MEMORY
+                               : read_content(imgfs_file, metadata->offset[ORIG_RES], orig_img, orig_size);
+    pthread_rwlock_unlock(pool->imgfs_lock);
+    if (ret != ERR_NONE)
+    {
+        free(orig_img);
+        return ret;
+    }
+
+    // Decoding, resizing and encoding do not need the imgFS
+    void *resized_img[NB_RES];
+    size_t resized_size[NB_RES];
+    ret = resize_contents(&header, missing, orig_img, orig_size, resized_img, resized_size);
+    free(orig_img);
+    orig_img = NULL;
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->nb_resized++;
+    pthread_mutex_unlock(&pool->lock);
+
+    // The image may have been deleted, replaced or resized in between
+    pthread_rwlock_wrlock(pool->imgfs_lock);
+    const uint32_t index = imgfs_index_find_id(imgfs_file, job->img_id, NO_SLOT);
+    if (index != NO_SLOT && !memcmp(imgfs_file->metadata[index].SHA, sha, SHA256_DIGEST_LENGTH))
+    {
+        for (int res = 0; res < NB_RES; res++)
+        {
+            if (imgfs_file->metadata[index].offset[res] != 0)
+            {
+                free(resized_img[res]);
+                resized_img[res] = NULL;
+            }
+        }
+        ret = store_resized_contents(imgfs_file, index, resized_img, resized_size);
+    }
+    pthread_rwlock_unlock(pool->imgfs_lock);
+
+    for (int res = 0; res < NB_RES; res++)
+    {
+        free(resized_img[res]);
+    }
+    return ret;
+}
+
+/********************************************************************
+ * Worker thread: runs the pending jobs one after the other
+ *******************************************************************/
+static void *resize_worker(void *arg)
+{
+    struct imgfs_resize_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->pending == NULL && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stopping)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        struct resize_job *job = pool->pending;
+        pool->pending = job->next;
+        if (pool->pending == NULL)
+        {
+            pool->last_pending = NULL;
+        }
+        job->next = pool->running;
+        pool->running = job;
+        pthread_mutex_unlock(&pool->lock);
+
+        const int result = run_job(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        struct resize_job **link = &pool->running;
+        while (*link != job)
+        {
+            link = &(*link)->next;
+        }
+        *link = job->next;
+        if (result != ERR_NONE && job->waiters == 0)
+        {
+            fprintf(stderr, "resize_worker(): %s: %s\n", job->img_id, ERR_MSG(result));
+        }
+        finish_job(job, result);
+    }
+}
+
+/********************************************************************
+ * Starts the workers of a resize pool.
+ *******************************************************************/
+int imgfs_resize_start(struct imgfs_resize_pool *pool, struct imgfs_file *imgfs_file,
+                       pthread_rwlock_t *imgfs_lock, size_t nb_workers)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_lock);
+    if (nb_workers == 0)
+    {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(pool, 0, sizeof(struct imgfs_resize_pool));
+    pool->imgfs_file = imgfs_file;
+    pool->imgfs_lock = imgfs_lock;
+    pool->workers = calloc(nb_workers, sizeof(pthread_t));
+    if (pool->workers == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (pthread_mutex_init(&pool->lock, NULL) || pthread_cond_init(&pool->work, NULL))
+    {
+        free(pool->workers);
+        pool->workers = NULL;
+        return ERR_THREADING;
+    }
+
+    for (; pool->nb_workers < nb_workers; pool->nb_workers++)
+    {
+        if (pthread_create(&pool->workers[pool->nb_workers], NULL, resize_worker, pool))
+        {
+            imgfs_resize_stop(pool);
+            return ERR_THREADING;
+        }
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Checks the parameters of a request and the state of the pool
+ *******************************************************************/
+static int check_request(const struct imgfs_resize_pool *pool, const char *img_id, unsigned int resolutions)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(img_id);
+    if (resolutions == 0 || (resolutions & ~(RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES))))
+    {
+        return ERR_RESOLUTIONS;
+    }
+    if (strlen(img_id) > MAX_IMG_ID)
+    {
+        return ERR_INVALID_IMGID;
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Has an image resized by the workers, and waits until it is done.
+ *******************************************************************/
+int imgfs_resize_wait(struct imgfs_resize_pool *pool, const char *img_id, int resolution)
+{
+    if (resolution == ORIG_RES)
+    {
+        return ERR_NONE;
+    }
+    if (resolution != THUMB_RES && resolution != SMALL_RES)
+    {
+        return ERR_RESOLUTIONS;
+    }
+    const int ret = check_request(pool, img_id, RES_MASK(resolution));
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return ERR_THREADING;
+    }
+    struct resize_job *job = queue_job(pool, img_id, RES_MASK(resolution));
+    if (job == NULL)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    job->waiters++;
+    while (!job->done)
+    {
+        pthread_cond_wait(&job->finished, &pool->lock);
+    }
+    const int result = job->result;
+    if (--job->waiters == 0)
+    {
+        free_job(job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return result;
+}
+
+/********************************************************************
+ * Has resolutions of an image created by the workers, without waiting.
+ *******************************************************************/
+int imgfs_resize_submit(struct imgfs_resize_pool *pool, const char *img_id, unsigned int resolutions)
+{
+    const int ret = check_request(pool, img_id, resolutions);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    const int stopping = pool->stopping;
+    const struct resize_job *job = stopping ? NULL : queue_job(pool, img_id, resolutions);
+    pthread_mutex_unlock(&pool->lock);
+    if (stopping)
+    {
+        return ERR_THREADING;
+    }
+    return job == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+/********************************************************************
+ * Stops the workers once their current jobs are done.
+ *******************************************************************/
+void imgfs_resize_stop(struct imgfs_resize_pool *pool)
+{
+    if (pool == NULL || pool->workers == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = NON_EMPTY;
+    for (struct resize_job *job = pool->pending; job != NULL;)
+    {
+        struct resize_job *next = job->next;
+        finish_job(job, ERR_THREADING);
+        job = next;
+    }
+    pool->pending = NULL;
+    pool->last_pending = NULL;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->nb_workers; i++)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->nb_workers = EMPTY;
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+}
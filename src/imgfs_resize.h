@@ -0,0 +1,93 @@
+/**
+ * @file imgfs_resize.h
+ * @brief Background creation of the missing resolutions of an imgFS.
+ *
+ * A pool of worker threads resizes the images of an imgFS shared by
+ * several threads. The original is read under the shared lock of the
+ * imgFS and resized without any lock; only the final append and
+ * metadata update take the exclusive lock. Concurrent requests for the
+ * same missing resolution of the same image wait for a single job, and
+ * the resolutions of an image requested together share its decoding.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <pthread.h>
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct resize_job;
+
+struct imgfs_resize_pool
+{
+    struct imgfs_file *imgfs_file;    // imgFS whose images are resized
+    pthread_rwlock_t *imgfs_lock;     // lock protecting imgfs_file
+    pthread_t *workers;
+    size_t nb_workers;
+    struct resize_job *pending;       // jobs not started yet, oldest first
+    struct resize_job *last_pending;
+    struct resize_job *running;       // jobs being resized
+    int stopping;                     // set by imgfs_resize_stop()
+    size_t nb_resized;                // number of images resized so far
+    pthread_mutex_t lock;             // protects the jobs, stopping and nb_resized
+    pthread_cond_t work;              // signaled when a job is pending
+};
+
+/**
+ * @brief Starts the workers of a resize pool.
+ *
+ * @param pool The pool to start
+ * @param imgfs_file The imgFS whose images are resized
+ * @param imgfs_lock The lock protecting imgfs_file
+ * @param nb_workers The number of worker threads
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_resize_start(struct imgfs_resize_pool *pool, struct imgfs_file *imgfs_file,
+                       pthread_rwlock_t *imgfs_lock, size_t nb_workers);
+
+/**
+ * @brief Has an image resized by the workers, and waits until it is done.
+ *
+ * Must be called without holding the lock of the imgFS. If a job for the
+ * same image and resolution is already pending or running, waits for it
+ * instead of starting another one. Succeeds without resizing anything if
+ * the resolution already exists, or if the image was deleted or replaced
+ * while being resized: the caller must look for the image again.
+ *
+ * @param pool The pool
+ * @param img_id The ID of the image to be resized
+ * @param resolution THUMB_RES or SMALL_RES
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_resize_wait(struct imgfs_resize_pool *pool, const char *img_id, int resolution);
+
+/**
+ * @brief Has resolutions of an image created by the workers, without
+ *        waiting for them.
+ *
+ * @param pool The pool
+ * @param img_id The ID of the image to be resized
+ * @param resolutions The set of RES_MASK(THUMB_RES) and RES_MASK(SMALL_RES) to create
+ * @return Some error code. 0 if the job was queued.
+ */
+int imgfs_resize_submit(struct imgfs_resize_pool *pool, const char *img_id, unsigned int resolutions);
+
+/**
+ * @brief Stops the workers once their current jobs are done. The pending
+ *        jobs are dropped: their waiters get ERR_THREADING.
+ *
+ * @param pool The pool to stop
+ */
+void imgfs_resize_stop(struct imgfs_resize_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
@@ -16,11 +16,14 @@
 #include <unistd.h>
 #include <stdlib.h> // abort()
 
+// Set by the signal handler: the server is then shut down from main()
+static volatile sig_atomic_t stop_requested = 0;
+
 /********************************************************************/
 static void signal_handler(int sig_num _unused)
 {
-    server_shutdown();
-    exit(0);
+    stop_requested = 1;
+    http_interrupt();
 }
 
 /********************************************************************/
@@ -47,9 +50,14 @@ static void set_signal_handler(void)
 int main(int argc, char *argv[])
 {
     set_signal_handler();
-    server_startup(argc, argv);
-    int ret = ERR_NONE;
-    while ((ret = http_receive()) == ERR_NONE);
+    int ret = server_startup(argc, argv);
+    if (ret != ERR_NONE)
+    {
+        fprintf(stderr, "server_startup(): %s\n", ERR_MSG(ret));
+        return ret;
+    }
+    while (!stop_requested && (ret = http_receive()) == ERR_NONE);
 
-    return 0;
+    server_shutdown();
+    return ret;
 }
@@ -9,24 +9,378 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <pthread.h>
+#include <sched.h>  // sched_yield
+#include <time.h>   // clock_gettime
+#include <unistd.h> // dup, close
 #include <vips/vips.h>
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "imgfs_gbcollect.h"
+#include "imgfs_index.h"
+#include "imgfs_resize.h"
+#include "image_content.h" // RES_MASK
 #include "http_net.h"
 #include "imgfs_server_service.h"
 
 // Main in-memory structure for imgFS
 static struct imgfs_file fs_file;
 static uint16_t server_port;
+static const char *imgfs_filename;
 
 #define URI_ROOT "/imgfs"
-static pthread_mutex_t imgfs_mutex;
+// Reads of the imgFS share the lock, changes to its metadata or its size take it exclusively
+static pthread_rwlock_t imgfs_lock;
+
+// Garbage collection running in the background, protected by imgfs_lock
+static struct imgfs_gbcollect gbcollect;
+static int gbcollect_running;
+static int gbcollect_stopping; // set by server_shutdown(), checked between two steps
+static pthread_t gbcollect_thread;
+static int gbcollect_joinable; // whether gbcollect_thread was started and not joined yet
+
+// Number of metadata slots copied each time the garbage collector holds the lock
+#define GBCOLLECT_STEP_SLOTS 8
+#define GBCOLLECT_TMP_SUFFIX ".gc"
+// Longest wait of the garbage collection for the streamed inserts writing into the old file
+#define GBCOLLECT_WRITERS_WAIT_MS 30000
+
+// Streamed inserts write into the imgFS file without holding imgfs_lock:
+// the garbage collection must not replace the file meanwhile
+static struct
+{
+    size_t writing;  // number of streamed inserts writing into the file
+    int replacing;   // set while the garbage collection replaces the file
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} streamed_inserts = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+// Size of the pieces of a streamed insert read from the connection
+#define STREAMED_INSERT_CHUNK STREAMED_BODY_SIZE
+
+// Missing resolutions are created in the background by these threads
+static struct imgfs_resize_pool resize_pool;
+#define RESIZE_WORKERS 4
+
+// The updates of the header and metadata are synced to the disk by groups
+#define GROUP_COMMIT_UPDATES 32   // updates synced together
+#define GROUP_COMMIT_DELAY_MS 200 // longest time an update waits to be synced
+
+// Syncs the updates waiting for too long when no further update comes
+static struct
+{
+    pthread_t thread;
+    int started;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+} group_commit = {.lock = PTHREAD_MUTEX_INITIALIZER, .stop = PTHREAD_COND_INITIALIZER};
+
+// Number of accepted connections which may wait for each worker thread
+#define QUEUED_CONNECTIONS_PER_WORKER 8
+
+// Cache of the images read most recently
+#define IMAGE_CACHE_BUDGET (64 * 1024 * 1024)           // bytes of image content
+#define IMAGE_CACHE_MAX_IMAGE (IMAGE_CACHE_BUDGET / 16) // larger images are sent from the file
+#define IMAGE_CACHE_BUCKETS 4096                        // power of two
+
+/*
+ * Image content shared by the cache and the replies being sent: the
+ * last of them to release it frees it.
+ */
+struct image_buffer
+{
+    size_t refs; // protected by the lock of the cache
+    uint32_t size;
+    char content[];
+};
+
+struct cached_image
+{
+    char img_id[MAX_IMG_ID + NULL_TERMINATOR];
+    int res;
+    struct image_buffer *buffer;
+    struct cached_image *next_in_bucket;
+    struct cached_image *newer; // neighbours in the LRU list
+    struct cached_image *older;
+};
+
+struct image_cache
+{
+    struct cached_image *buckets[IMAGE_CACHE_BUCKETS];
+    struct cached_image *newest;
+    struct cached_image *oldest;
+    size_t used;  // bytes of the cached images
+    size_t count; // number of cached images
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    pthread_mutex_t lock;
+};
+
+static struct image_cache image_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Server mode arguments
+#define THREAD_POOL_MODE "threads"
+#define EVENT_LOOP_MODE "epoll"
+
+/**********************************************************************
+ * Finds the bucket of an image, with FNV-1a
+ ********************************************************************** */
+static struct cached_image **cache_bucket(const char *img_id, int res)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = img_id; *c != '\0'; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t)res) * 16777619u;
+    return &image_cache.buckets[hash & (IMAGE_CACHE_BUCKETS - 1)];
+}
+
+/**********************************************************************
+ * Drops a reference to an image content. The lock of the cache must be held.
+ ********************************************************************** */
+static void buffer_unref(struct image_buffer *buffer)
+{
+    if (--buffer->refs == 0)
+    {
+        free(buffer);
+    }
+}
+
+/**********************************************************************
+ * Releases an image content returned by get_image()
+ ********************************************************************** */
+static void release_image(struct image_buffer *buffer)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    buffer_unref(buffer);
+    pthread_mutex_unlock(&image_cache.lock);
+}
+
+/**********************************************************************
+ * Removes an image from the LRU list. The lock of the cache must be held.
+ ********************************************************************** */
+static void lru_unlink(struct cached_image *image)
+{
+    if (image->newer != NULL)
+        image->newer->older = image->older;
+    else
+        image_cache.newest = image->older;
+    if (image->older != NULL)
+        image->older->newer = image->newer;
+    else
+        image_cache.oldest = image->newer;
+    image->newer = NULL;
+    image->older = NULL;
+}
+
+/**********************************************************************
+ * Puts an image at the head of the LRU list. The lock of the cache must be held.
+ ********************************************************************** */
+static void lru_push(struct cached_image *image)
+{
+    image->older = image_cache.newest;
+    image->newer = NULL;
+    if (image_cache.newest != NULL)
+        image_cache.newest->newer = image;
+    else
+        image_cache.oldest = image;
+    image_cache.newest = image;
+}
+
+/**********************************************************************
+ * Removes an image from the cache. The lock of the cache must be held.
+ ********************************************************************** */
+static void cache_remove(struct cached_image *image)
+{
+    struct cached_image **link = cache_bucket(image->img_id, image->res);
+    while (*link != image)
+    {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = image->next_in_bucket;
+    lru_unlink(image);
+
+    image_cache.used -= image->buffer->size;
+    image_cache.count--;
+    buffer_unref(image->buffer);
+    free(image);
+}
+
+/**********************************************************************
+ * Looks for an image in the cache. The lock of the cache must be held.
+ ********************************************************************** */
+static struct cached_image *cache_find(const char *img_id, int res)
+{
+    struct cached_image *image = *cache_bucket(img_id, res);
+    while (image != NULL && (image->res != res || strcmp(image->img_id, img_id)))
+    {
+        image = image->next_in_bucket;
+    }
+    return image;
+}
+
+/**********************************************************************
+ * Returns a new reference to a cached image content, or NULL
+ ********************************************************************** */
+static struct image_buffer *cache_get(const char *img_id, int res)
+{
+    struct image_buffer *buffer = NULL;
+    pthread_mutex_lock(&image_cache.lock);
+    struct cached_image *image = cache_find(img_id, res);
+    if (image != NULL)
+    {
+        lru_unlink(image);
+        lru_push(image);
+        buffer = image->buffer;
+        buffer->refs++;
+        image_cache.hits++;
+    }
+    else
+    {
+        image_cache.misses++;
+    }
+    pthread_mutex_unlock(&image_cache.lock);
+    return buffer;
+}
+
+/**********************************************************************
+ * Adds an image content to the cache, evicting the least recently used
+ * images to stay within the budget
+ ********************************************************************** */
+static void cache_put(const char *img_id, int res, struct image_buffer *buffer)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    struct cached_image *image = NULL;
+    if (cache_find(img_id, res) == NULL)
+    {
+        image = calloc(ONE_ELEMENT, sizeof(struct cached_image));
+    }
+    // Already cached by a concurrent read, or no memory: not cached
+    if (image == NULL)
+    {
+        pthread_mutex_unlock(&image_cache.lock);
+        return;
+    }
+
+    while (image_cache.used + buffer->size > IMAGE_CACHE_BUDGET && image_cache.oldest != NULL)
+    {
+        cache_remove(image_cache.oldest);
+        image_cache.evictions++;
+    }
+
+    strncpy(image->img_id, img_id, MAX_IMG_ID);
+    image->res = res;
+    image->buffer = buffer;
+    buffer->refs++;
+
+    struct cached_image **bucket = cache_bucket(img_id, res);
+    image->next_in_bucket = *bucket;
+    *bucket = image;
+    lru_push(image);
+    image_cache.used += buffer->size;
+    image_cache.count++;
+    pthread_mutex_unlock(&image_cache.lock);
+}
+
+/**********************************************************************
+ * Removes every resolution of an image from the cache
+ ********************************************************************** */
+static void cache_invalidate(const char *img_id)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    for (int res = 0; res < NB_RES; res++)
+    {
+        struct cached_image *image = cache_find(img_id, res);
+        if (image != NULL)
+        {
+            cache_remove(image);
+        }
+    }
+    pthread_mutex_unlock(&image_cache.lock);
+}
+
+/**********************************************************************
+ * Empties the cache
+ ********************************************************************** */
+static void cache_clear(void)
+{
+    pthread_mutex_lock(&image_cache.lock);
+    while (image_cache.oldest != NULL)
+    {
+        cache_remove(image_cache.oldest);
+    }
+    pthread_mutex_unlock(&image_cache.lock);
+}
+
+/**********************************************************************
+ * Writes the grouped updates of the imgFS once they are due, until
+ * server_shutdown() stops it
+ ********************************************************************** */
+static void *group_commit_worker(void *arg _unused)
+{
+    pthread_mutex_lock(&group_commit.lock);
+    while (!group_commit.stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (GROUP_COMMIT_DELAY_MS / 2) * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&group_commit.stop, &group_commit.lock, &deadline);
+        if (group_commit.stopping)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&group_commit.lock);
+
+        // Only take the imgFS exclusively when there is something to write
+        pthread_rwlock_rdlock(&imgfs_lock);
+        const int pending = fs_file.pending.updates != EMPTY;
+        pthread_rwlock_unlock(&imgfs_lock);
+        int ret = ERR_NONE;
+        if (pending)
+        {
+            pthread_rwlock_wrlock(&imgfs_lock);
+            ret = commit_due_writes(&fs_file);
+            pthread_rwlock_unlock(&imgfs_lock);
+        }
+        if (ret != ERR_NONE)
+        {
+            fprintf(stderr, "group_commit_worker(): %s\n", ERR_MSG(ret));
+        }
+        pthread_mutex_lock(&group_commit.lock);
+    }
+    pthread_mutex_unlock(&group_commit.lock);
+    return NULL;
+}
+
+/**********************************************************************
+ * Stops the group commit worker; do_close() writes what is left
+ ********************************************************************** */
+static void group_commit_stop(void)
+{
+    if (!group_commit.started)
+    {
+        return;
+    }
+    pthread_mutex_lock(&group_commit.lock);
+    group_commit.stopping = NON_EMPTY;
+    pthread_cond_signal(&group_commit.stop);
+    pthread_mutex_unlock(&group_commit.lock);
+    pthread_join(group_commit.thread, NULL);
+    group_commit.started = EMPTY;
+}
 
 /********************************************************************/ /**
                                                                         * Startup function. Create imgFS file and load in-memory structure.
-                                                                        * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+                                                                        * Pass the imgFS file name as argv[1], optionnaly port number as argv[2]
+                                                                        * optionnaly the number of worker threads as argv[3]
+                                                                        * and optionnaly the server mode ("threads" or "epoll") as argv[4]
                                                                         ********************************************************************** */
 int server_startup(int argc, char **argv)
 {
@@ -39,6 +393,7 @@ int server_startup(int argc, char **argv)
     }
 
     char *filename = argv[1];
+    imgfs_filename = filename;
     int temp_port = 0;
 
     // server_port takes the value of the port number passed as argument if it's valid, otherwise it takes the default value
@@ -61,24 +416,69 @@ int server_startup(int argc, char **argv)
         server_port = DEFAULT_LISTENING_PORT;
     }
 
-    if (pthread_mutex_init(&imgfs_mutex, NULL))
+    if (argc > 3)
+    {
+        const uint16_t workers = atouint16(argv[3]);
+        if (http_set_pool_size(workers, (size_t)workers * QUEUED_CONNECTIONS_PER_WORKER) != ERR_NONE)
+        {
+            vips_shutdown();
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    if (argc > 4)
+    {
+        const int event_loop = !strcmp(argv[4], EVENT_LOOP_MODE);
+        if ((!event_loop && strcmp(argv[4], THREAD_POOL_MODE))
+            || http_set_mode(event_loop ? HTTP_EVENT_LOOP : HTTP_THREAD_POOL) != ERR_NONE)
+        {
+            vips_shutdown();
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    if (pthread_rwlock_init(&imgfs_lock, NULL))
     {
         vips_shutdown();
         return ERR_THREADING;
     }
 
     int ret = ERR_NONE;
-    ret = do_open(filename, "rb+", &fs_file);
+    ret = do_open_mapped(filename, "rb+", &fs_file);
     if (ret != ERR_NONE)
     {
         vips_shutdown();
         return ret;
     }
+    ret = set_write_policy(&fs_file, GROUP_COMMIT_UPDATES, GROUP_COMMIT_DELAY_MS, IMGFS_DURABILITY_SYNCED);
+    if (ret == ERR_NONE && pthread_create(&group_commit.thread, NULL, group_commit_worker, NULL))
+    {
+        ret = ERR_THREADING;
+    }
+    if (ret != ERR_NONE)
+    {
+        do_close(&fs_file);
+        vips_shutdown();
+        return ret;
+    }
+    group_commit.started = NON_EMPTY;
+
+    ret = imgfs_resize_start(&resize_pool, &fs_file, &imgfs_lock, RESIZE_WORKERS);
+    if (ret != ERR_NONE)
+    {
+        group_commit_stop();
+        do_close(&fs_file);
+        vips_shutdown();
+        return ret;
+    }
     print_header(&fs_file.header);
     EventCallback cb = handle_http_message;
 
-    if (http_init(server_port, cb) == -1)
+    if (http_init(server_port, cb) < 0)
     {
+        imgfs_resize_stop(&resize_pool);
+        group_commit_stop();
+        do_close(&fs_file);
         vips_shutdown();
         return ERR_IO;
     }
@@ -92,9 +492,25 @@ void server_shutdown(void)
 {
     fprintf(stderr, "Shutting down...\n");
     http_close();
+    imgfs_resize_stop(&resize_pool);
+
+    // The garbage collection gives up at its next step
+    pthread_rwlock_wrlock(&imgfs_lock);
+    gbcollect_stopping = NON_EMPTY;
+    pthread_rwlock_unlock(&imgfs_lock);
+    if (gbcollect_joinable)
+    {
+        pthread_join(gbcollect_thread, NULL);
+        gbcollect_joinable = EMPTY;
+    }
+
+    group_commit_stop();
+    pthread_rwlock_wrlock(&imgfs_lock);
     do_close(&fs_file);
+    pthread_rwlock_unlock(&imgfs_lock);
+    cache_clear();
     vips_shutdown();
-    pthread_mutex_destroy(&imgfs_mutex);
+    pthread_rwlock_destroy(&imgfs_lock);
 }
 
 /**********************************************************************
@@ -135,9 +551,9 @@ int handle_list_call(int connection)
 {
     char *json = NULL;
     int ret = ERR_NONE;
-    pthread_mutex_lock(&imgfs_mutex);
+    pthread_rwlock_rdlock(&imgfs_lock);
     ret = do_list(&fs_file, JSON, &json);
-    pthread_mutex_unlock(&imgfs_mutex);
+    pthread_rwlock_unlock(&imgfs_lock);
     if (ret != ERR_NONE)
     {
         free(json);
@@ -154,21 +570,114 @@ int handle_list_call(int connection)
     return ret;
 }
 
+/**********************************************************************
+ * Gets an image. Cached images are returned at once. Resolutions already
+ * in the imgFS are found under the shared lock; a missing one is created
+ * by the resize workers, which only take the exclusive lock to store it.
+ *
+ * Images small enough to be cached are read (and cached) while the lock
+ * is held, so that a concurrent deletion cannot leave them in the cache:
+ * their content is returned in *buffer, to be released by the caller.
+ * The others are to be sent from *fd, a duplicate of the file descriptor
+ * to be closed by the caller: it keeps the content readable even if a
+ * garbage collection replaces the imgFS file meanwhile.
+ ********************************************************************** */
+static int get_image(const char *img_id, int res, struct image_buffer **buffer,
+                     int *fd, uint64_t *offset, uint32_t *image_size)
+{
+    *buffer = cache_get(img_id, res);
+    if (*buffer != NULL)
+    {
+        *image_size = (*buffer)->size;
+        return ERR_NONE;
+    }
+
+    pthread_rwlock_rdlock(&imgfs_lock);
+    uint32_t slot = imgfs_index_find_id(&fs_file, img_id, NO_SLOT);
+    while (slot != NO_SLOT && fs_file.metadata[slot].offset[res] == 0)
+    {
+        pthread_rwlock_unlock(&imgfs_lock);
+        const int ret = imgfs_resize_wait(&resize_pool, img_id, res);
+        if (ret != ERR_NONE)
+        {
+            return ret;
+        }
+
+        // The image may have changed in between: look for it again
+        pthread_rwlock_rdlock(&imgfs_lock);
+        slot = imgfs_index_find_id(&fs_file, img_id, NO_SLOT);
+    }
+    if (slot == NO_SLOT)
+    {
+        pthread_rwlock_unlock(&imgfs_lock);
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    *offset = fs_file.metadata[slot].offset[res];
+    *image_size = fs_file.metadata[slot].size[res];
+    if (*image_size > IMAGE_CACHE_MAX_IMAGE)
+    {
+        *fd = dup(fileno(fs_file.file));
+        pthread_rwlock_unlock(&imgfs_lock);
+        return *fd == -1 ? ERR_IO : ERR_NONE;
+    }
+
+    *buffer = malloc(sizeof(struct image_buffer) + *image_size);
+    if (*buffer == NULL)
+    {
+        pthread_rwlock_unlock(&imgfs_lock);
+        return ERR_OUT_OF_MEMORY;
+    }
+    (*buffer)->refs = ONE_ELEMENT;
+    (*buffer)->size = *image_size;
+    const int ret = read_content(&fs_file, *offset, (*buffer)->content, *image_size);
+    if (ret == ERR_NONE)
+    {
+        cache_put(img_id, res, *buffer);
+    }
+    pthread_rwlock_unlock(&imgfs_lock);
+
+    if (ret != ERR_NONE)
+    {
+        free(*buffer);
+        *buffer = NULL;
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Writes the value of a variable of the query string to out
+ ********************************************************************** */
+static int get_query_var(const struct http_query *query, const char *name, char *out, size_t out_len)
+{
+    const int len = http_query_get(query, name, out, out_len);
+    if (len == 0)
+    {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    return len < 0 ? len : ERR_NONE;
+}
+
 /**********************************************************************
  * Reply with the image requested.
  ********************************************************************** */
-int handle_read_call(struct http_message *msg, int connection)
+int handle_read_call(struct http_message *msg _unused, const struct http_query *query, int connection)
 {
-    char out_res[MAX_HEADER_SIZE + NULL_TERMINATOR];
+    char out_res[sizeof("thumbnail")]; // longest resolution name
     char out_img_id[MAX_IMG_ID + NULL_TERMINATOR];
 
-    if (http_get_var(&msg->uri, "res", out_res, MAX_HEADER_SIZE) == 0)
+    int ret = get_query_var(query, "res", out_res, sizeof(out_res));
+    if (ret == ERR_RUNTIME)
+    {
+        return reply_error_msg(connection, ERR_RESOLUTIONS);
+    }
+    if (ret == ERR_NONE)
     {
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+        ret = get_query_var(query, "img_id", out_img_id, sizeof(out_img_id));
     }
-    if (http_get_var(&msg->uri, "img_id", out_img_id, MAX_IMG_ID) == 0)
+    if (ret != ERR_NONE)
     {
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+        return reply_error_msg(connection, ret);
     }
     int res = resolution_atoi(out_res);
     if (res == -1)
@@ -176,18 +685,26 @@ int handle_read_call(struct http_message *msg, int connection)
         return reply_error_msg(connection, ERR_RESOLUTIONS);
     }
     uint32_t image_size = 0;
-    char *image_buffer = NULL;
-    int ret = ERR_NONE;
-    pthread_mutex_lock(&imgfs_mutex);
-    ret = do_read(out_img_id, res, &image_buffer, &image_size, &fs_file);
-    pthread_mutex_unlock(&imgfs_mutex);
+    uint64_t offset = 0;
+    int fd = -1;
+    struct image_buffer *buffer = NULL;
+    ret = get_image(out_img_id, res, &buffer, &fd, &offset, &image_size);
     if (ret != ERR_NONE)
     {
         return reply_error_msg(connection, ret);
     }
-    ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg" HTTP_LINE_DELIM, image_buffer, image_size);
-    free(image_buffer);
-    image_buffer = NULL;
+
+    if (buffer != NULL)
+    {
+        ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg" HTTP_LINE_DELIM, buffer->content, image_size);
+        release_image(buffer);
+    }
+    else
+    {
+        // Sent straight from the imgFS file, without going through a buffer
+        ret = http_reply_file(connection, HTTP_OK, "Content-Type: image/jpeg" HTTP_LINE_DELIM, fd, offset, image_size);
+        close(fd);
+    }
     if (ret != ERR_NONE)
     {
         return reply_error_msg(connection, ret);
@@ -198,17 +715,18 @@ int handle_read_call(struct http_message *msg, int connection)
 /**********************************************************************
  * Delete the image requested and reply with 302 OK message.
  ********************************************************************** */
-int handle_delete_call(struct http_message *msg, int connection)
+int handle_delete_call(struct http_message *msg _unused, const struct http_query *query, int connection)
 {
     char out_img_id[MAX_IMG_ID + NULL_TERMINATOR];
-    if (http_get_var(&msg->uri, "img_id", out_img_id, MAX_IMG_ID) == 0)
+    int ret = get_query_var(query, "img_id", out_img_id, sizeof(out_img_id));
+    if (ret != ERR_NONE)
     {
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+        return reply_error_msg(connection, ret);
     }
-    int ret = ERR_NONE;
-    pthread_mutex_lock(&imgfs_mutex);
+    pthread_rwlock_wrlock(&imgfs_lock);
     ret = do_delete(out_img_id, &fs_file);
-    pthread_mutex_unlock(&imgfs_mutex);
+    cache_invalidate(out_img_id);
+    pthread_rwlock_unlock(&imgfs_lock);
     if (ret != ERR_NONE)
     {
         return reply_error_msg(connection, ret);
@@ -216,28 +734,213 @@ int handle_delete_call(struct http_message *msg, int connection)
     return reply_302_msg(connection);
 }
 
+/**********************************************************************
+ * Inserts an image whose body is written into the imgFS as it arrives,
+ * so that it is never held in memory as a whole.
+ ********************************************************************** */
+static int insert_streamed(struct http_message *msg, int connection, const char *img_id, int *eager_resize)
+{
+    const size_t image_size = msg->body.len + msg->body_remaining;
+
+    pthread_mutex_lock(&streamed_inserts.lock);
+    while (streamed_inserts.replacing)
+    {
+        pthread_cond_wait(&streamed_inserts.changed, &streamed_inserts.lock);
+    }
+    streamed_inserts.writing++;
+    pthread_mutex_unlock(&streamed_inserts.lock);
+
+    struct imgfs_insert_stream stream;
+    pthread_rwlock_wrlock(&imgfs_lock);
+    int ret = do_insert_stream_begin(&fs_file, image_size, &stream);
+    pthread_rwlock_unlock(&imgfs_lock);
+
+    // Only the room of the new content is written: no lock is needed
+    char *chunk = NULL;
+    if (ret == ERR_NONE)
+    {
+        ret = do_insert_stream_write(&fs_file, &stream, msg->body.val, msg->body.len);
+        chunk = malloc(STREAMED_INSERT_CHUNK);
+        if (ret == ERR_NONE && chunk == NULL)
+        {
+            ret = ERR_OUT_OF_MEMORY;
+        }
+    }
+    while (ret == ERR_NONE && msg->body_remaining > 0)
+    {
+        const int chunk_size = http_read_body(connection, msg, chunk, STREAMED_INSERT_CHUNK);
+        ret = chunk_size < 0 ? chunk_size : do_insert_stream_write(&fs_file, &stream, chunk, (size_t)chunk_size);
+    }
+    free(chunk);
+    chunk = NULL;
+
+    pthread_rwlock_wrlock(&imgfs_lock);
+    if (ret == ERR_NONE)
+    {
+        ret = do_insert_stream_end(&fs_file, &stream, img_id);
+        cache_invalidate(img_id);
+    }
+    else
+    {
+        do_insert_stream_abort(&fs_file, &stream);
+    }
+    *eager_resize = fs_file.header.flags & IMGFS_EAGER_RESIZE;
+    pthread_rwlock_unlock(&imgfs_lock);
+
+    pthread_mutex_lock(&streamed_inserts.lock);
+    streamed_inserts.writing--;
+    pthread_cond_broadcast(&streamed_inserts.changed);
+    pthread_mutex_unlock(&streamed_inserts.lock);
+    return ret;
+}
+
 /**********************************************************************
  * Insert the image requested and reply with 302 OK message.
  ********************************************************************** */
-int handle_insert_call(struct http_message *msg, int connection)
+int handle_insert_call(struct http_message *msg, const struct http_query *query, int connection)
+{
+    char out_img_id[MAX_IMG_ID + NULL_TERMINATOR];
+    int ret = get_query_var(query, "name", out_img_id, sizeof(out_img_id));
+    if (ret != ERR_NONE)
+    {
+        return reply_error_msg(connection, ret);
+    }
+
+    int eager_resize = EMPTY;
+    if (msg->body_remaining > 0)
+    {
+        ret = insert_streamed(msg, connection, out_img_id, &eager_resize);
+    }
+    else
+    {
+        // The body stays in the connection buffer until the reply is sent
+        pthread_rwlock_wrlock(&imgfs_lock);
+        ret = do_insert(msg->body.val, msg->body.len, out_img_id, &fs_file);
+        cache_invalidate(out_img_id);
+        eager_resize = fs_file.header.flags & IMGFS_EAGER_RESIZE;
+        pthread_rwlock_unlock(&imgfs_lock);
+    }
+
+    if (ret != ERR_NONE)
+    {
+        return reply_error_msg(connection, ret);
+    }
+
+    // The first viewer will not have to wait for the resized images
+    if (eager_resize)
+    {
+        ret = imgfs_resize_submit(&resize_pool, out_img_id, RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES));
+        if (ret != ERR_NONE)
+        {
+            fprintf(stderr, "handle_insert_call(): %s\n", ERR_MSG(ret));
+        }
+    }
+    return reply_302_msg(connection);
+}
+
+/**********************************************************************
+ * Runs the garbage collection. The steps only read the imgFS and run
+ * alongside the other readers; only the final swap is exclusive.
+ ********************************************************************** */
+static void *gbcollect_worker(void *arg _unused)
 {
-    char out_img_id[MAX_IMG_ID];
-    if (http_get_var(&msg->uri, "name", out_img_id, MAX_IMG_ID) == 0)
+    int ret = ERR_NONE;
+    int done = EMPTY;
+    int stopped = EMPTY;
+    while (ret == ERR_NONE && !done && !stopped)
     {
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+        pthread_rwlock_rdlock(&imgfs_lock);
+        stopped = gbcollect_stopping;
+        if (!stopped)
+        {
+            ret = imgfs_gbcollect_step(&gbcollect, GBCOLLECT_STEP_SLOTS);
+            done = imgfs_gbcollect_done(&gbcollect);
+        }
+        pthread_rwlock_unlock(&imgfs_lock);
+        sched_yield();
+    }
+
+    // Let the streamed inserts still writing into the old file finish. A body
+    // read gives up once its client is silent, but a client trickling its
+    // body could last forever: the swap is given up rather than the inserts.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += GBCOLLECT_WRITERS_WAIT_MS / 1000;
+    pthread_mutex_lock(&streamed_inserts.lock);
+    streamed_inserts.replacing = NON_EMPTY;
+    int waited = 0;
+    while (streamed_inserts.writing > 0 && !stopped && waited == 0)
+    {
+        waited = pthread_cond_timedwait(&streamed_inserts.changed, &streamed_inserts.lock, &deadline);
+    }
+    if (streamed_inserts.writing > 0 && ret == ERR_NONE && !stopped)
+    {
+        ret = ERR_THREADING;
     }
-    char *image_data = (char *)malloc(msg->body.len);
-    if (image_data == NULL)
+    pthread_mutex_unlock(&streamed_inserts.lock);
+
+    pthread_rwlock_wrlock(&imgfs_lock);
+    stopped = stopped || gbcollect_stopping;
+    if (ret == ERR_NONE && !stopped)
     {
-        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+        ret = imgfs_gbcollect_finish(&gbcollect, imgfs_filename);
     }
-    memcpy(image_data, msg->body.val, msg->body.len);
+    else
+    {
+        imgfs_gbcollect_abort(&gbcollect);
+    }
+    gbcollect_running = EMPTY;
+    pthread_rwlock_unlock(&imgfs_lock);
 
-    pthread_mutex_lock(&imgfs_mutex);
-    int ret = do_insert(image_data, msg->body.len, out_img_id, &fs_file);
-    free(image_data);
-    image_data = NULL;
-    pthread_mutex_unlock(&imgfs_mutex);
+    pthread_mutex_lock(&streamed_inserts.lock);
+    streamed_inserts.replacing = EMPTY;
+    pthread_cond_broadcast(&streamed_inserts.changed);
+    pthread_mutex_unlock(&streamed_inserts.lock);
+
+    if (ret != ERR_NONE)
+    {
+        fprintf(stderr, "gbcollect_worker(): %s\n", ERR_MSG(ret));
+    }
+    return NULL;
+}
+
+/**********************************************************************
+ * Start a garbage collection in the background and reply with 302 OK message.
+ ********************************************************************** */
+int handle_gbcollect_call(int connection)
+{
+    char tmp_path[FILENAME_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s" GBCOLLECT_TMP_SUFFIX, imgfs_filename) >= (int)sizeof(tmp_path))
+    {
+        return reply_error_msg(connection, ERR_INVALID_FILENAME);
+    }
+
+    int ret = ERR_NONE;
+    pthread_rwlock_wrlock(&imgfs_lock);
+    if (!gbcollect_running && !gbcollect_stopping)
+    {
+        // The previous worker is done with imgfs_lock: it can be joined while holding it
+        if (gbcollect_joinable)
+        {
+            pthread_join(gbcollect_thread, NULL);
+            gbcollect_joinable = EMPTY;
+        }
+        ret = imgfs_gbcollect_start(&gbcollect, &fs_file, tmp_path);
+        if (ret == ERR_NONE)
+        {
+            if (pthread_create(&gbcollect_thread, NULL, gbcollect_worker, NULL))
+            {
+                imgfs_gbcollect_abort(&gbcollect);
+                ret = ERR_THREADING;
+            }
+            else
+            {
+                gbcollect_running = NON_EMPTY;
+                gbcollect_joinable = NON_EMPTY;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&imgfs_lock);
 
     if (ret != ERR_NONE)
     {
@@ -247,12 +950,101 @@ int handle_insert_call(struct http_message *msg, int connection)
 }
 
 /**********************************************************************
- * Simple handling of http message. TO BE UPDATED WEEK 13
+ * Reply with the counters of the image cache in JSON format.
+ ********************************************************************** */
+int handle_stats_call(int connection)
+{
+    char json[ERR_MSG_SIZE];
+    pthread_mutex_lock(&image_cache.lock);
+    const int json_len = snprintf(json, sizeof(json),
+                                  "{ \"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, "
+                                  "\"images\": %zu, \"bytes\": %zu }",
+                                  (unsigned long)image_cache.hits, (unsigned long)image_cache.misses,
+                                  (unsigned long)image_cache.evictions, image_cache.count, image_cache.used);
+    pthread_mutex_unlock(&image_cache.lock);
+    if (json_len < 0 || json_len >= (int)sizeof(json))
+    {
+        return reply_error_msg(connection, ERR_RUNTIME);
+    }
+    return http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM, json, (size_t)json_len);
+}
+
+// An endpoint of the imgFS API: URI_ROOT "/" followed by its name
+struct route
+{
+    const char *name;
+    size_t name_len;
+    const char *method;            // NULL for any method
+    int (*handle)(int connection); // either this handler, or this one
+    int (*handle_query)(struct http_message *msg, const struct http_query *query, int connection);
+};
+
+#define ROUTE(name) name, sizeof(name) - 1
+
+// The routes, sorted by name (as memcmp() orders them) for find_route()
+static const struct route routes[] = {
+    { ROUTE("delete"), NULL, NULL, handle_delete_call },
+    { ROUTE("gbcollect"), NULL, handle_gbcollect_call, NULL },
+    { ROUTE("insert"), "POST", NULL, handle_insert_call },
+    { ROUTE("list"), NULL, handle_list_call, NULL },
+    { ROUTE("read"), NULL, NULL, handle_read_call },
+    { ROUTE("stats"), NULL, handle_stats_call, NULL },
+};
+
+/**********************************************************************
+ * Tells whether a path is exactly the given one
+ ********************************************************************** */
+static int path_is(const struct http_string *path, const char *expected, size_t expected_len)
+{
+    return path->len == expected_len && !memcmp(path->val, expected, expected_len);
+}
+
+/**********************************************************************
+ * Compares a name with the one of a route, for bsearch(): a shorter
+ * name comes before the longer ones it starts.
+ ********************************************************************** */
+static int compare_route(const void *name, const void *route)
+{
+    const struct http_string *key = name;
+    const struct route *element = route;
+    const size_t len = key->len < element->name_len ? key->len : element->name_len;
+    const int order = memcmp(key->val, element->name, len);
+    return order != 0 ? order : (key->len > element->name_len) - (key->len < element->name_len);
+}
+
+/**********************************************************************
+ * Finds the route of a path, NULL if it has none
+ ********************************************************************** */
+static const struct route *find_route(const struct http_string *path)
+{
+    static const char root[] = URI_ROOT "/";
+    const size_t root_len = sizeof(root) - 1;
+    if (path->len <= root_len || memcmp(path->val, root, root_len))
+    {
+        return NULL;
+    }
+
+    // Only the whole name matches: "/imgfs/lists" is not "/imgfs/list"
+    const struct http_string name = { path->val + root_len, path->len - root_len };
+    const struct route *route = bsearch(&name, routes, sizeof(routes) / sizeof(routes[0]), sizeof(routes[0]),
+                                        compare_route);
+    return route != NULL && path_is(&name, route->name, route->name_len) ? route : NULL;
+}
+
+/**********************************************************************
+ * Calls the handler of the route of the message URI.
  ********************************************************************** */
 int handle_http_message(struct http_message *msg, int connection)
 {
     M_REQUIRE_NON_NULL(msg);
-    if (http_match_verb(&msg->uri, "/") || http_match_uri(msg, "/index.html"))
+
+    struct http_string path;
+    int ret = http_uri_path(&msg->uri, &path);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+    if (path_is(&path, ROUTE("/")) || path_is(&path, ROUTE("/" BASE_FILE)))
     {
         return http_serve_file(connection, BASE_FILE);
     }
@@ -260,14 +1052,22 @@ int handle_http_message(struct http_message *msg, int connection)
     debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
                  connection,
                  (int)msg->uri.len, msg->uri.val);
-    if (http_match_uri(msg, URI_ROOT "/list"))
-        return handle_list_call(connection);
-    if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST"))
-        return handle_insert_call(msg, connection);
-    if (http_match_uri(msg, URI_ROOT "/read"))
-        return handle_read_call(msg, connection);
-    if (http_match_uri(msg, URI_ROOT "/delete"))
-        return handle_delete_call(msg, connection);
-
-    return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    const struct route *route = find_route(&path);
+    if (route == NULL || (route->method != NULL && !http_match_verb(&msg->method, route->method)))
+    {
+        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    }
+    if (route->handle != NULL)
+    {
+        return route->handle(connection);
+    }
+
+    // The query string is split once, whatever the number of variables the handler reads
+    struct http_query query;
+    ret = http_parse_query(&msg->uri, &query);
+    if (ret != ERR_NONE)
+    {
+        return reply_error_msg(connection, ret);
+    }
+    return route->handle_query(msg, &query, connection);
 }
@@ -6,14 +6,27 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "util.h"
 
+#include <errno.h>       // for EINTR
 #include <inttypes.h>    // for PRIxN macros
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <stdint.h>      // for uint8_t
 #include <stdio.h>       // for sprintf
 #include <stdlib.h>      // for calloc
 #include <string.h>      // for strcmp
+#include <sys/mman.h>    // for mmap, munmap
+#include <sys/stat.h>    // for fstat
+#include <sys/uio.h>     // for pwritev
+#include <time.h>        // for clock_gettime
+#include <unistd.h>      // for pread, pwrite, fdatasync
+
+// Largest number of buffers of one pwritev() (IOV_MAX on Linux)
+#define MAX_IOVECS 1024
+
+#define BITS_PER_WORD 64
+#define NS_PER_MS 1000000ULL
 
 /*******************************************************************
  * Human-readable SHA
@@ -84,6 +97,9 @@ int do_open(const char *imgfs_filename, const char *open_mode, struct imgfs_file
     {
         return ERR_IO;
     }
+    imgfs_file->mapping = NULL;
+    imgfs_file->mapping_writable = EMPTY;
+    memset(&imgfs_file->pending, 0, sizeof(struct imgfs_pending));
 
     if (fread(&(imgfs_file->header), sizeof(struct imgfs_header), ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
     {
@@ -107,9 +123,86 @@ int do_open(const char *imgfs_filename, const char *open_mode, struct imgfs_file
         return ERR_IO;
     }
 
+    int ret = imgfs_index_build(imgfs_file);
+    if (ret != ERR_NONE)
+    {
+        free(imgfs_file->metadata);
+        imgfs_file->metadata = NULL;
+        fclose(imgfs_file->file);
+        return ret;
+    }
+
     return ERR_NONE;
 }
 
+/*******************************************************************
+ * Size of the header and metadata region of an imgfs file.
+ */
+static size_t mapping_size(const struct imgfs_header *header)
+{
+    return sizeof(struct imgfs_header) + (size_t)header->max_files * sizeof(struct img_metadata);
+}
+
+/*******************************************************************
+ * Open imgfs files with their header and metadata mapped in memory.
+ */
+int do_open_mapped(const char *imgfs_filename, const char *open_mode, struct imgfs_file *imgfs_file)
+{
+    // Check if arguments are valid
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(open_mode);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    imgfs_file->file = fopen(imgfs_filename, open_mode);
+    if (imgfs_file->file == NULL)
+    {
+        return ERR_IO;
+    }
+    imgfs_file->mapping = NULL;
+    memset(&imgfs_file->pending, 0, sizeof(struct imgfs_pending));
+
+    if (fread(&(imgfs_file->header), sizeof(struct imgfs_header), ONE_ELEMENT, imgfs_file->file) != ONE_ELEMENT)
+    {
+        fclose(imgfs_file->file);
+        return ERR_IO;
+    }
+
+    // Accessing a mapping beyond the end of the file would raise SIGBUS
+    const size_t size = mapping_size(&imgfs_file->header);
+    struct stat file_stat;
+    if (fstat(fileno(imgfs_file->file), &file_stat) || (size_t)file_stat.st_size < size)
+    {
+        fclose(imgfs_file->file);
+        return ERR_IO;
+    }
+
+    imgfs_file->mapping_writable = strchr(open_mode, '+') != NULL;
+    imgfs_file->mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               imgfs_file->mapping_writable ? MAP_SHARED : MAP_PRIVATE,
+                               fileno(imgfs_file->file), 0);
+    if (imgfs_file->mapping == MAP_FAILED)
+    {
+        imgfs_file->mapping = NULL;
+        fclose(imgfs_file->file);
+        return ERR_IO;
+    }
+    imgfs_file->metadata = (struct img_metadata *)((struct imgfs_header *)imgfs_file->mapping + 1);
+
+    int ret = imgfs_index_build(imgfs_file);
+    if (ret != ERR_NONE)
+    {
+        munmap(imgfs_file->mapping, size);
+        imgfs_file->mapping = NULL;
+        imgfs_file->metadata = NULL;
+        fclose(imgfs_file->file);
+        return ret;
+    }
+
+    return ERR_NONE;
+}
+
+static int flush_writes(struct imgfs_file *imgfs_file, int sync);
+
 /*******************************************************************
  * Close imgfs files.
  */
@@ -119,14 +212,443 @@ void do_close(struct imgfs_file *imgfs_file)
     {
         if (imgfs_file->file != NULL)
         {
+            flush_writes(imgfs_file, imgfs_file->pending.durability == IMGFS_DURABILITY_SYNCED);
             fclose(imgfs_file->file);
             imgfs_file->file = NULL;
         }
-        free(imgfs_file->metadata);
+        free(imgfs_file->pending.dirty_slots);
+        imgfs_file->pending.dirty_slots = NULL;
+        imgfs_index_free(imgfs_file);
+        if (imgfs_file->mapping != NULL)
+        {
+            munmap(imgfs_file->mapping, mapping_size(&imgfs_file->header));
+            imgfs_file->mapping = NULL;
+        }
+        else
+        {
+            free(imgfs_file->metadata);
+        }
         imgfs_file->metadata = NULL;
     }
 }
 
+/*******************************************************************
+ * Write a whole buffer at the given offset of a file.
+ */
+static int write_all(int fd, const void *buffer, size_t size, uint64_t offset)
+{
+    const char *const bytes = buffer;
+    size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t n = pwrite(fd, bytes + done, size - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return ERR_IO;
+        }
+        done += (size_t)n;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Offset of a metadata entry in the imgfs file.
+ */
+static uint64_t metadata_offset(uint32_t index)
+{
+    return sizeof(struct imgfs_header) + (uint64_t)index * sizeof(struct img_metadata);
+}
+
+/*******************************************************************
+ * Whether a metadata entry changed since the last flush.
+ */
+static int slot_dirty(const struct imgfs_pending *pending, uint32_t index)
+{
+    return (pending->dirty_slots[index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1;
+}
+
+/*******************************************************************
+ * Record that the header changed.
+ */
+int write_header(struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    if (imgfs_file->mapping != NULL)
+    {
+        if (!imgfs_file->mapping_writable)
+        {
+            return ERR_IO;
+        }
+        memcpy(imgfs_file->mapping, &(imgfs_file->header), sizeof(struct imgfs_header));
+        return ERR_NONE;
+    }
+
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    imgfs_file->pending.header_dirty = NON_EMPTY;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Record that one metadata entry changed.
+ */
+int write_metadata(struct imgfs_file *imgfs_file, uint32_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (index >= imgfs_file->header.max_files)
+    {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // A mapped entry is already in the file
+    if (imgfs_file->mapping != NULL)
+    {
+        return imgfs_file->mapping_writable ? ERR_NONE : ERR_IO;
+    }
+
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    struct imgfs_pending *pending = &imgfs_file->pending;
+    if (pending->dirty_slots == NULL)
+    {
+        const size_t words = (imgfs_file->header.max_files + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        pending->dirty_slots = calloc(words, sizeof(uint64_t));
+        if (pending->dirty_slots == NULL)
+        {
+            // Without room to remember it, the entry is written right away
+            return write_all(fileno(imgfs_file->file), &(imgfs_file->metadata[index]),
+                             sizeof(struct img_metadata), metadata_offset(index));
+        }
+    }
+    pending->dirty_slots[index / BITS_PER_WORD] |= 1ULL << (index % BITS_PER_WORD);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Write the changed header and metadata entries in ascending offset
+ * order, and wait until they are on the disk if asked.
+ */
+static int flush_writes(struct imgfs_file *imgfs_file, int sync)
+{
+    struct imgfs_pending *pending = &imgfs_file->pending;
+    const int fd = fileno(imgfs_file->file);
+
+    if (pending->header_dirty)
+    {
+        if (write_all(fd, &(imgfs_file->header), sizeof(struct imgfs_header), 0) != ERR_NONE)
+        {
+            return ERR_IO;
+        }
+        pending->header_dirty = EMPTY;
+    }
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    uint32_t i = 0;
+    while (pending->dirty_slots != NULL && i < max_files)
+    {
+        if (pending->dirty_slots[i / BITS_PER_WORD] == 0)
+        {
+            i = (i / BITS_PER_WORD + 1) * BITS_PER_WORD;
+            continue;
+        }
+        if (!slot_dirty(pending, i))
+        {
+            i++;
+            continue;
+        }
+
+        // Consecutive entries are consecutive in the file: one write for all of them
+        uint32_t end = i + 1;
+        while (end < max_files && slot_dirty(pending, end))
+        {
+            end++;
+        }
+        if (write_all(fd, &(imgfs_file->metadata[i]), (end - i) * sizeof(struct img_metadata),
+                      metadata_offset(i)) != ERR_NONE)
+        {
+            return ERR_IO;
+        }
+        for (; i < end; i++)
+        {
+            pending->dirty_slots[i / BITS_PER_WORD] &= ~(1ULL << (i % BITS_PER_WORD));
+        }
+    }
+
+    if (sync)
+    {
+        if (imgfs_file->mapping != NULL
+            && msync(imgfs_file->mapping, mapping_size(&imgfs_file->header), MS_SYNC))
+        {
+            return ERR_IO;
+        }
+        if (fdatasync(fd))
+        {
+            return ERR_IO;
+        }
+    }
+    pending->updates = EMPTY;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Current time, in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 * NS_PER_MS + (uint64_t)ts.tv_nsec;
+}
+
+/*******************************************************************
+ * End an update of the header and metadata.
+ */
+int commit_writes(struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    struct imgfs_pending *pending = &imgfs_file->pending;
+    const uint64_t now = now_ns();
+    if (pending->updates == EMPTY)
+    {
+        pending->first_update_ns = now;
+    }
+    pending->updates++;
+
+    if (pending->updates < pending->max_updates
+        && (pending->max_delay_ms == 0 || now - pending->first_update_ns < pending->max_delay_ms * NS_PER_MS))
+    {
+        return ERR_NONE;
+    }
+    return flush_writes(imgfs_file, pending->durability == IMGFS_DURABILITY_SYNCED);
+}
+
+/*******************************************************************
+ * Write the pending updates once the oldest has waited long enough.
+ */
+int commit_due_writes(struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    const struct imgfs_pending *pending = &imgfs_file->pending;
+    if (pending->updates == EMPTY || pending->max_delay_ms == 0
+        || now_ns() - pending->first_update_ns < pending->max_delay_ms * NS_PER_MS)
+    {
+        return ERR_NONE;
+    }
+    return flush_writes(imgfs_file, pending->durability == IMGFS_DURABILITY_SYNCED);
+}
+
+/*******************************************************************
+ * Choose when the updates of the header and metadata are written.
+ */
+int set_write_policy(struct imgfs_file *imgfs_file, uint32_t max_updates,
+                     uint32_t max_delay_ms, int durability)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (durability != IMGFS_DURABILITY_WRITTEN && durability != IMGFS_DURABILITY_SYNCED)
+    {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const int ret = flush_writes(imgfs_file, durability == IMGFS_DURABILITY_SYNCED);
+    if (ret != ERR_NONE)
+    {
+        return ret;
+    }
+    imgfs_file->pending.max_updates = max_updates;
+    imgfs_file->pending.max_delay_ms = max_delay_ms;
+    imgfs_file->pending.durability = durability;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Write every pending change and wait until it is on the disk.
+ */
+int do_flush(struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    return flush_writes(imgfs_file, NON_EMPTY);
+}
+
+/*******************************************************************
+ * Read a content of the imgfs file.
+ */
+int read_content(const struct imgfs_file *imgfs_file, uint64_t offset, void *buffer, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    const int fd = fileno(imgfs_file->file);
+    char *const bytes = buffer;
+    size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t n = pread(fd, bytes + done, size - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0) // Error or unexpected end of file
+        {
+            return ERR_IO;
+        }
+        done += (size_t)n;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Append a content at the end of the imgfs file.
+ */
+int append_content(struct imgfs_file *imgfs_file, const void *buffer, size_t size, uint64_t *offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(offset);
+
+    const int fd = fileno(imgfs_file->file);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat))
+    {
+        return ERR_IO;
+    }
+
+    const int ret = write_all(fd, buffer, size, (uint64_t)file_stat.st_size);
+    if (ret == ERR_NONE)
+    {
+        *offset = (uint64_t)file_stat.st_size;
+    }
+    return ret;
+}
+
+/*******************************************************************
+ * Write a content at the given offset of the imgfs file.
+ */
+int write_content(struct imgfs_file *imgfs_file, uint64_t offset, const void *buffer, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    return write_all(fileno(imgfs_file->file), buffer, size, offset);
+}
+
+/*******************************************************************
+ * Write several contents one after the other, with as few system
+ * calls as possible.
+ */
+int write_contents(struct imgfs_file *imgfs_file, uint64_t offset,
+                   const void *const buffers[], const size_t sizes[], size_t count)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffers);
+    M_REQUIRE_NON_NULL(sizes);
+
+    const int fd = fileno(imgfs_file->file);
+    struct iovec iov[MAX_IOVECS];
+    size_t next = 0;   // first content not given to pwritev() yet
+    size_t skip = 0;   // bytes of that content already written
+    while (next < count)
+    {
+        // Empty contents are left out, so that writing nothing means an error
+        int iovcnt = 0;
+        for (size_t i = next; i < count && iovcnt < MAX_IOVECS; i++)
+        {
+            const size_t done = i == next ? skip : 0;
+            if (sizes[i] == done)
+            {
+                continue;
+            }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+            iov[iovcnt].iov_base = (char *)buffers[i] + done;
+#pragma GCC diagnostic pop
+            iov[iovcnt].iov_len = sizes[i] - done;
+            iovcnt++;
+        }
+        if (iovcnt == 0)
+        {
+            break;
+        }
+
+        ssize_t n = pwritev(fd, iov, iovcnt, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return ERR_IO;
+        }
+        offset += (uint64_t)n;
+
+        // Skip what was written, which may end in the middle of a content
+        while (next < count && (size_t)n >= sizes[next] - skip)
+        {
+            n -= (ssize_t)(sizes[next] - skip);
+            skip = 0;
+            next++;
+        }
+        skip += (size_t)n;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Reserve room for a content at the end of the imgfs file.
+ */
+int reserve_content(struct imgfs_file *imgfs_file, size_t size, uint64_t *offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(offset);
+
+    const int fd = fileno(imgfs_file->file);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) || ftruncate(fd, file_stat.st_size + (off_t)size))
+    {
+        return ERR_IO;
+    }
+    *offset = (uint64_t)file_stat.st_size;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Give back a reserved room, if nothing was appended after it.
+ */
+int release_content(struct imgfs_file *imgfs_file, uint64_t offset, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    const int fd = fileno(imgfs_file->file);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat))
+    {
+        return ERR_IO;
+    }
+
+    // Otherwise the room stays unused until the next garbage collection
+    if ((uint64_t)file_stat.st_size == offset + size && ftruncate(fd, (off_t)offset))
+    {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
 /*******************************************************************
  * Transforms resolution string to its int value.
  */
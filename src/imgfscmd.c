@@ -15,7 +15,7 @@
 #include <string.h>
 #include <vips/vips.h>
 
-#define NB_COMMANDS 6
+#define NB_COMMANDS 8
 #define FIRST_ARG 1
 
 typedef int (*command)(int argc, char *argv[]);
@@ -28,8 +28,10 @@ typedef struct
 command_mapping commands[NB_COMMANDS] = {{"list", do_list_cmd},
                                          {"create", do_create_cmd},
                                          {"insert", do_insert_cmd},
+                                         {"insert-batch", do_insert_batch_cmd},
                                          {"read", do_read_cmd},
                                          {"delete", do_delete_cmd},
+                                         {"gc", do_gbcollect_cmd},
                                          {"help", help}};
 
 /*******************************************************************************
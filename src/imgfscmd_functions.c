@@ -7,11 +7,15 @@
 
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "image_content.h" // for lazily_resize_all
+#include "imgfs_index.h"  // for imgfs_index_find_id
 #include "util.h" // for _unused
 
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <dirent.h>   // for opendir, readdir
+#include <sys/stat.h> // for stat
 
 // default values
 static const uint32_t default_max_files = 128;
@@ -31,6 +35,9 @@ static const uint16_t MAX_SMALL_RES = 512;
 
 #define TWO_ELEMENTS 2
 
+// Number of image files read in memory and inserted at once by insert-batch
+#define BATCH_SIZE 256
+
 /**********************************************************************
  * Displays some explanations.
  ********************************************************************** */
@@ -55,11 +62,17 @@ int help(int useless _unused, char **useless_too _unused)
     printf("          -small_res <X_RES> <Y_RES>: resolution for small images.\n");
     printf("                                  default value is %" PRIu16 "x%" PRIu16 "\n", default_small_res, default_small_res);
     printf("                                  maximum value is %" PRIu16 "x%" PRIu16 "\n", MAX_SMALL_RES, MAX_SMALL_RES);
+    printf("          -eager_resize: create the thumbnail and small images when inserting.\n");
     printf("  read   <imgFS_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n");
     printf("      read an image from the imgFS and save it to a file.\n");
     printf("      default resolution is \"original\".\n");
     printf("  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n");
+    printf("  insert-batch <imgFS_filename> <directory|list_filename>: insert the images of a directory,\n");
+    printf("      or the ones listed one per line in a file. The ID of each image is its file name\n");
+    printf("      without extension.\n");
     printf("  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n");
+    printf("  gc <imgFS_filename> <tmp imgFS_filename>: performs garbage collecting on imgFS.\n");
+    printf("      requires a temporary filename for copying the imgFS.\n");
 
     return ERR_NONE;
 }
@@ -218,7 +231,7 @@ int do_list_cmd(int argc, char **argv)
     struct imgfs_file file_to_create;
     memset(&file_to_create, 0, sizeof(file_to_create));
 
-    ret = do_open(file_name, "rb", &file_to_create);
+    ret = do_open_mapped(file_name, "rb", &file_to_create);
     if (ret != ERR_NONE)
         return ret;
 
@@ -251,6 +264,7 @@ int do_create_cmd(int argc, char **argv)
     uint32_t max_files = default_max_files;
     uint16_t thumb_width = default_thumb_res, thumb_height = default_thumb_res,
              small_width = default_small_res, small_height = default_small_res;
+    uint32_t flags = EMPTY;
 
     if (argc > ONE_ELEMENT)
     {
@@ -282,6 +296,10 @@ int do_create_cmd(int argc, char **argv)
                 small_height = atouint16(argv[i + 2]);
                 i += TWO_ELEMENTS;
             }
+            else if (!strcmp(argv[i], "-eager_resize"))
+            {
+                flags |= IMGFS_EAGER_RESIZE;
+            }
             else
                 return ERR_INVALID_ARGUMENT;
         }
@@ -296,7 +314,8 @@ int do_create_cmd(int argc, char **argv)
         return ERR_RESOLUTIONS;
 
     struct imgfs_header header = {.max_files = max_files,
-                                  .resized_res = {thumb_width, thumb_height, small_width, small_height}};
+                                  .resized_res = {thumb_width, thumb_height, small_width, small_height},
+                                  .flags = flags};
 
     struct imgfs_file imgfs_file;
     imgfs_file.header = header;
@@ -330,7 +349,7 @@ int do_delete_cmd(int argc, char **argv)
     struct imgfs_file imgfs_file;
     int ret = ERR_NONE;
 
-    ret = do_open(filename, "r+b", &imgfs_file);
+    ret = do_open_mapped(filename, "r+b", &imgfs_file);
     if (ret != ERR_NONE)
         return ret;
 
@@ -357,7 +376,7 @@ int do_read_cmd(int argc, char **argv)
 
     struct imgfs_file myfile;
     zero_init_var(myfile);
-    int error = do_open(argv[0], "rb+", &myfile);
+    int error = do_open_mapped(argv[0], "rb+", &myfile);
     if (error != ERR_NONE)
         return error;
 
@@ -394,7 +413,7 @@ int do_insert_cmd(int argc, char **argv)
 
     struct imgfs_file myfile;
     zero_init_var(myfile);
-    int error = do_open(argv[0], "rb+", &myfile);
+    int error = do_open_mapped(argv[0], "rb+", &myfile);
     if (error != ERR_NONE)
         return error;
 
@@ -412,6 +431,259 @@ int do_insert_cmd(int argc, char **argv)
     error = do_insert(image_buffer, image_size, argv[1], &myfile);
     free(image_buffer);
     image_buffer = NULL;
+
+    // No background worker outlives the command: create the resized images now
+    if (error == ERR_NONE && (myfile.header.flags & IMGFS_EAGER_RESIZE))
+    {
+        error = lazily_resize_all(RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES), &myfile,
+                                  imgfs_index_find_id(&myfile, argv[1], NO_SLOT));
+    }
     do_close(&myfile);
     return error;
 }
+
+/********************************************************************
+ * Compares two paths, for qsort()
+ *******************************************************************/
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/********************************************************************
+ * Adds a path to a growing list of paths
+ *******************************************************************/
+static int add_path(char ***paths, size_t *nb_paths, size_t *capacity, char *path)
+{
+    if (path == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (*nb_paths == *capacity)
+    {
+        const size_t new_capacity = *capacity == 0 ? BATCH_SIZE : 2 * *capacity;
+        char **new_paths = realloc(*paths, new_capacity * sizeof(char *));
+        if (new_paths == NULL)
+        {
+            free(path);
+            return ERR_OUT_OF_MEMORY;
+        }
+        *paths = new_paths;
+        *capacity = new_capacity;
+    }
+    (*paths)[(*nb_paths)++] = path;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Lists the image files to insert: the files of a directory, in
+ * alphabetical order, or the paths given one per line by a file.
+ *******************************************************************/
+static int list_batch_files(const char *source, char ***paths, size_t *nb_paths)
+{
+    size_t capacity = 0;
+    *paths = NULL;
+    *nb_paths = 0;
+    int ret = ERR_NONE;
+
+    DIR *dir = opendir(source);
+    if (dir != NULL)
+    {
+        const struct dirent *entry = NULL;
+        while (ret == ERR_NONE && (entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] == '.')
+            {
+                continue;
+            }
+            char *path = malloc(strlen(source) + strlen(entry->d_name) + 2 * NULL_TERMINATOR);
+            if (path != NULL)
+            {
+                sprintf(path, "%s/%s", source, entry->d_name);
+            }
+            struct stat st;
+            if (path != NULL && (stat(path, &st) || !S_ISREG(st.st_mode)))
+            {
+                free(path);
+                continue;
+            }
+            ret = add_path(paths, nb_paths, &capacity, path);
+        }
+        closedir(dir);
+        if (ret == ERR_NONE && *nb_paths > 0)
+        {
+            qsort(*paths, *nb_paths, sizeof(char *), compare_paths);
+        }
+    }
+    else
+    {
+        FILE *list = fopen(source, "r");
+        if (list == NULL)
+        {
+            return ERR_IO;
+        }
+        char *line = NULL;
+        size_t line_size = 0;
+        ssize_t len = 0;
+        while (ret == ERR_NONE && (len = getline(&line, &line_size, list)) != -1)
+        {
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            {
+                line[--len] = '\0';
+            }
+            if (len > 0)
+            {
+                ret = add_path(paths, nb_paths, &capacity, strdup(line));
+            }
+        }
+        free(line);
+        fclose(list);
+    }
+
+    if (ret != ERR_NONE)
+    {
+        for (size_t i = 0; i < *nb_paths; i++)
+        {
+            free((*paths)[i]);
+        }
+        free(*paths);
+        *paths = NULL;
+        *nb_paths = 0;
+    }
+    return ret;
+}
+
+/********************************************************************
+ * Makes the ID of an image from its path: its file name, without
+ * extension.
+ *******************************************************************/
+static char *image_id_of(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    const char *extension = strrchr(name, '.');
+    const size_t len = extension == NULL || extension == name ? strlen(name) : (size_t)(extension - name);
+    return strndup(name, len);
+}
+
+/********************************************************************
+ * Inserts one batch of image files into the imgFS.
+ *******************************************************************/
+static int insert_batch_files(struct imgfs_file *imgfs_file, char *const *paths, size_t nb_paths)
+{
+    struct imgfs_batch_image images[BATCH_SIZE];
+    const char *image_paths[BATCH_SIZE];
+    size_t nb_images = 0;
+    int first_error = ERR_NONE;
+
+    for (size_t i = 0; i < nb_paths; i++)
+    {
+        char *image_buffer = NULL;
+        uint32_t image_size = 0;
+        char *img_id = image_id_of(paths[i]);
+        int ret = img_id == NULL ? ERR_OUT_OF_MEMORY : read_disk_image(paths[i], &image_buffer, &image_size);
+        if (ret != ERR_NONE)
+        {
+            fprintf(stderr, "%s: %s\n", paths[i], ERR_MSG(ret));
+            first_error = first_error == ERR_NONE ? ret : first_error;
+            free(img_id);
+            continue;
+        }
+        images[nb_images] = (struct imgfs_batch_image){.img_id = img_id, .image_buffer = image_buffer,
+                                                       .image_size = image_size};
+        image_paths[nb_images] = paths[i];
+        nb_images++;
+    }
+
+    int ret = do_insert_batch(images, nb_images, imgfs_file);
+    for (size_t i = 0; i < nb_images; i++)
+    {
+        int result = ret == ERR_NONE ? images[i].result : ret;
+
+        // No background worker outlives the command: create the resized images now
+        if (result == ERR_NONE && (imgfs_file->header.flags & IMGFS_EAGER_RESIZE))
+        {
+            result = lazily_resize_all(RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES), imgfs_file,
+                                       imgfs_index_find_id(imgfs_file, images[i].img_id, NO_SLOT));
+        }
+        if (result != ERR_NONE)
+        {
+            fprintf(stderr, "%s: %s\n", image_paths[i], ERR_MSG(result));
+            first_error = first_error == ERR_NONE ? result : first_error;
+        }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+        free((char *)images[i].img_id);
+        free((char *)images[i].image_buffer);
+#pragma GCC diagnostic pop
+    }
+    return first_error;
+}
+
+/********************************************************************
+ * Inserts all the images of a directory or of a list into the imgFS.
+ *******************************************************************/
+int do_insert_batch_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < TWO_ELEMENTS)
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > TWO_ELEMENTS)
+        return ERR_INVALID_COMMAND;
+
+    char **paths = NULL;
+    size_t nb_paths = 0;
+    int error = list_batch_files(argv[1], &paths, &nb_paths);
+    if (error != ERR_NONE)
+        return error;
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    error = do_open_mapped(argv[0], "rb+", &myfile);
+
+    // Keep every update of the run pending, so that the header and metadata
+    // are written once at the end instead of once per batch and per resized image
+    if (error == ERR_NONE)
+    {
+        error = set_write_policy(&myfile, UINT32_MAX, 0, IMGFS_DURABILITY_WRITTEN);
+        if (error != ERR_NONE)
+        {
+            do_close(&myfile);
+        }
+    }
+
+    // The files are read BATCH_SIZE at a time, so that they do not all stay in memory
+    int first_error = ERR_NONE;
+    for (size_t first = 0; error == ERR_NONE && first < nb_paths; first += BATCH_SIZE)
+    {
+        const size_t count = nb_paths - first < BATCH_SIZE ? nb_paths - first : BATCH_SIZE;
+        const int ret = insert_batch_files(&myfile, paths + first, count);
+        first_error = first_error == ERR_NONE ? ret : first_error;
+    }
+    if (error == ERR_NONE)
+    {
+        error = do_flush(&myfile);
+        do_close(&myfile);
+    }
+
+    for (size_t i = 0; i < nb_paths; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    return error != ERR_NONE ? error : first_error;
+}
+
+/********************************************************************
+ * Performs garbage collecting on the imgFS.
+ *******************************************************************/
+int do_gbcollect_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < TWO_ELEMENTS)
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > TWO_ELEMENTS)
+        return ERR_INVALID_COMMAND;
+
+    return do_gbcollect(argv[0], argv[1]);
+}
@@ -32,7 +32,17 @@ int do_delete_cmd(int argc, char* argv[]);
  *******************************************************************/
 int do_insert_cmd(int argc, char* argv[]);
 
+/********************************************************************
+ * Inserts all the images of a directory or of a list into the imgFS.
+ *******************************************************************/
+int do_insert_batch_cmd(int argc, char* argv[]);
+
 /********************************************************************
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Performs garbage collecting on the imgFS.
+ *******************************************************************/
+int do_gbcollect_cmd(int argc, char* argv[]);
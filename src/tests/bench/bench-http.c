@@ -0,0 +1,120 @@
+/**
+ * @file bench-http.c
+ * @brief Measures the parsing of a request received in pieces: parsed
+ *        again from its start after each piece (http_parse_message()),
+ *        or from where the previous piece stopped (http_parser_execute()).
+ *        Then measures the search of the delimiters of its headers, one
+ *        byte at a time or vectorized (see http_scan.h).
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#include "bench.h"
+#include "http_prot.h"
+#include "http_scan.h"
+
+#include <string.h>
+
+#define ITERATIONS 2000
+#define SCAN_ITERATIONS 200000
+
+// Headers of a request sent by a browser, as in the unit tests
+static const char request[] =
+    "POST /imgfs/insert?&name=papillon.jpg HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0" HTTP_LINE_DELIM
+    "Accept: */*" HTTP_LINE_DELIM "Accept-Language: fr,fr-FR;q=0.8,en-US;q=0.5,en;q=0.3" HTTP_LINE_DELIM
+    "Accept-Encoding: gzip, deflate, br" HTTP_LINE_DELIM "Referer: http://localhost:8000/index.html" HTTP_LINE_DELIM
+    "Content-Length: 12" HTTP_LINE_DELIM "Origin: http://localhost:8000" HTTP_LINE_DELIM "DNT: 1" HTTP_LINE_DELIM
+    "Connection: keep-alive" HTTP_LINE_DELIM "Sec-Fetch-Dest: empty" HTTP_LINE_DELIM
+    "Sec-Fetch-Mode: cors" HTTP_LINE_DELIM "Sec-Fetch-Site: same-origin" HTTP_HDR_END_DELIM "Hello world!";
+
+static const size_t piece_sizes[] = { 1, 16, 128, sizeof(request) - 1 };
+
+/**
+ * @brief Time to parse the request received in pieces of the given size,
+ *        in nanoseconds per request. Exits if it is not parsed.
+ */
+static double parse_in_pieces(size_t piece_size, int incremental)
+{
+    const size_t length = sizeof(request) - 1;
+    char stream[sizeof(request)];
+    struct http_message message;
+    struct http_parser parser;
+    int content_len = 0;
+
+    const double start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        // Like the server, received bytes are followed by a null character
+        memset(stream, 0, sizeof(stream));
+        http_parser_init(&parser);
+        int ret = 0;
+        for (size_t received = 0; ret == 0 && received < length;)
+        {
+            const size_t n = received + piece_size > length ? length - received : piece_size;
+            memcpy(stream + received, request + received, n);
+            received += n;
+            ret = incremental ? http_parser_execute(&parser, stream, received, &message, &content_len)
+                              : http_parse_message(stream, received, &message, &content_len);
+        }
+        if (ret != 1 || message.body.len != 12)
+        {
+            fprintf(stderr, "request not parsed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (bench_now_ns() - start) / ITERATIONS;
+}
+
+/**
+ * @brief Time to find every ':' and line end of the request, as the
+ *        parser does, in nanoseconds per request.
+ */
+static double scan_delimiters(int vectorized)
+{
+    const size_t length = sizeof(request) - 1;
+    size_t found = 0;
+
+    const double start = bench_now_ns();
+    for (int i = 0; i < SCAN_ITERATIONS; i++)
+    {
+        for (size_t pos = 0; pos < length; pos++)
+        {
+            pos = vectorized ? http_scan(request, pos, length, ':', '\r')
+                             : http_scan_scalar(request, pos, length, ':', '\r');
+            found++;
+        }
+    }
+    const double elapsed = bench_now_ns() - start;
+
+    // Keeps the compiler from skipping the searches
+    static volatile size_t sink;
+    sink = found;
+    return elapsed / SCAN_ITERATIONS;
+}
+
+int main(void)
+{
+    printf("%zu bytes of request, %d iterations\n", sizeof(request) - 1, ITERATIONS);
+    printf("%-12s %16s %16s %8s\n", "piece (B)", "from start (ns)", "resumed (ns)", "speedup");
+    for (size_t i = 0; i < sizeof(piece_sizes) / sizeof(piece_sizes[0]); i++)
+    {
+        const double again = parse_in_pieces(piece_sizes[i], 0);
+        const double resumed = parse_in_pieces(piece_sizes[i], 1);
+        printf("%-12zu %16.0f %16.0f %7.1fx\n", piece_sizes[i], again, resumed, again / resumed);
+    }
+
+#if defined(__AVX2__)
+    const char *vector = "AVX2";
+#elif defined(__SSE2__)
+    const char *vector = "SSE2";
+#else
+    const char *vector = "none";
+#endif
+    const double scalar = scan_delimiters(0);
+    const double vectorized = scan_delimiters(1);
+    printf("\n%-12s %16s %16s %8s\n", "delimiters", "bytewise (ns)", "vectorized (ns)", "speedup");
+    printf("%-12s %16.0f %16.0f %7.1fx\n", vector, scalar, vectorized, scalar / vectorized);
+    return EXIT_SUCCESS;
+}
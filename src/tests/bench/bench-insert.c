@@ -0,0 +1,176 @@
+/**
+ * @file bench-insert.c
+ * @brief Measures the memory the server allocates to insert an uploaded
+ *        image: the previous copy of the body, the body inserted where it
+ *        was received, and a body streamed in pieces (see http_read_body()).
+ *
+ * Built with -Wl,--wrap for the allocation functions, so that every
+ * allocation of the imgFS code is counted.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#include "bench.h"
+#include "http_net.h" // for STREAMED_BODY_SIZE
+#include "imgfs.h"
+
+#include <string.h>
+#include <vips/vips.h>
+
+#define ITERATIONS 16
+#define CHUNK_SIZE STREAMED_BODY_SIZE // same as the insert handler of the server
+#define NB_INSERTS 3 // copied, direct and streamed
+#define BENCH_IMGFS "/tmp/bench-insert.imgfs"
+
+static const size_t body_sizes[] = { 16 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+
+static size_t allocated; // bytes requested to the allocator since the last reset
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocated += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocated += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocated += size;
+    return __real_realloc(ptr, size);
+}
+
+// A body whose resolution is found in its start of frame, made unique by its number
+static void make_body(char *body, size_t size, int number)
+{
+    static const char header[] = {
+        '\xFF', '\xD8', '\xFF', '\xC0', 0, 11, 8, 0, 16, 0, 32, 1, 1, 0x11, 0
+    };
+    memset(body, 0, size);
+    memcpy(body, header, sizeof(header));
+    memcpy(body + sizeof(header), &number, sizeof(number));
+}
+
+// What handle_insert_call() did before: copy the body, then insert the copy
+static int insert_copied(struct imgfs_file *file, const char *body, size_t size, const char *img_id)
+{
+    char *copy = malloc(size);
+    if (copy == NULL)
+    {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(copy, body, size);
+    const int ret = do_insert(copy, size, img_id, file);
+    free(copy);
+    return ret;
+}
+
+static int insert_direct(struct imgfs_file *file, const char *body, size_t size, const char *img_id)
+{
+    return do_insert(body, size, img_id, file);
+}
+
+// Only the bytes of the current piece are in memory: the rest is still in the socket
+static int insert_streamed(struct imgfs_file *file, const char *body, size_t size, const char *img_id)
+{
+    struct imgfs_insert_stream stream;
+    int ret = do_insert_stream_begin(file, size, &stream);
+    char *chunk = malloc(CHUNK_SIZE);
+    for (size_t done = 0; ret == ERR_NONE && done < size; done += CHUNK_SIZE)
+    {
+        const size_t chunk_size = size - done < CHUNK_SIZE ? size - done : CHUNK_SIZE;
+        memcpy(chunk, body + done, chunk_size);
+        ret = do_insert_stream_write(file, &stream, chunk, chunk_size);
+    }
+    free(chunk);
+    if (ret != ERR_NONE)
+    {
+        do_insert_stream_abort(file, &stream);
+        return ret;
+    }
+    return do_insert_stream_end(file, &stream, img_id);
+}
+
+static void run(struct imgfs_file *file, const char *name,
+                int (*insert)(struct imgfs_file *, const char *, size_t, const char *),
+                char *body, size_t size)
+{
+    size_t total = 0;
+    double time = 0;
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        char img_id[MAX_IMG_ID];
+        snprintf(img_id, sizeof(img_id), "%s%d", name, i);
+        make_body(body, size, (int) file->header.nb_files);
+
+        allocated = 0;
+        const double start = bench_now_ns();
+        if (insert(file, body, size, img_id) != ERR_NONE)
+        {
+            fprintf(stderr, "%s insert failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+        time += bench_now_ns() - start;
+        total += allocated;
+    }
+
+    printf("%-10s %10zu %18.1f %14.1f\n", name, size,
+           (double) total / ITERATIONS / 1024, time / ITERATIONS / 1e3);
+}
+
+// A new imgFS, opened the way the server opens it
+static void open_imgfs(struct imgfs_file *file)
+{
+    struct imgfs_file created = { .header.max_files = NB_INSERTS * ITERATIONS,
+                                  .header.resized_res = { 64, 64, 256, 256 } };
+    if (do_create(BENCH_IMGFS, &created) != ERR_NONE)
+    {
+        fprintf(stderr, "cannot create %s\n", BENCH_IMGFS);
+        exit(EXIT_FAILURE);
+    }
+    do_close(&created);
+    if (do_open(BENCH_IMGFS, "rb+", file) != ERR_NONE)
+    {
+        fprintf(stderr, "cannot open %s\n", BENCH_IMGFS);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(void)
+{
+    for (size_t i = 0; i < sizeof(body_sizes) / sizeof(body_sizes[0]); i++)
+    {
+        const size_t size = body_sizes[i];
+        char *body = malloc(size);
+        if (body == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+
+        struct imgfs_file file;
+        open_imgfs(&file);
+        if (i == 0)
+        {
+            printf("%-10s %10s %18s %14s\n", "insert", "bytes", "allocated (KiB)", "time (us)");
+        }
+        run(&file, "copied", insert_copied, body, size);
+        run(&file, "direct", insert_direct, body, size);
+        if (size > STREAMED_BODY_SIZE)
+        {
+            run(&file, "streamed", insert_streamed, body, size);
+        }
+        do_close(&file);
+        remove(BENCH_IMGFS);
+        free(body);
+    }
+    return EXIT_SUCCESS;
+}
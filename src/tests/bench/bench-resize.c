@@ -0,0 +1,104 @@
+/**
+ * @file bench-resize.c
+ * @brief Compares creating the resized resolutions from a fully decoded
+ *        original with resize_contents(), which shrinks it while decoding.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#include "bench.h"
+#include "image_content.h"
+#include "imgfs.h"
+
+#include <vips/vips.h>
+
+#define ITERATIONS 20
+
+static const char *const images[] = {
+    "papillon.jpg", "coquelicots.jpg", "foret.jpg", "mure.jpg", "brouillard.jpg"
+};
+
+// What resize_contents() did before: decode everything, then thumbnail
+static int resize_full_decode(const struct imgfs_header *header, void *orig, size_t size)
+{
+    VipsImage *decoded = NULL;
+    if (vips_jpegload_buffer(orig, size, &decoded, NULL))
+    {
+        return ERR_IMGLIB;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        VipsImage *resized = NULL;
+        void *buffer = NULL;
+        size_t buffer_size = 0;
+        if (vips_thumbnail_image(decoded, &resized, header->resized_res[2 * i],
+                                 "height", header->resized_res[2 * i + 1], NULL)
+            || vips_jpegsave_buffer(resized, &buffer, &buffer_size, NULL))
+        {
+            g_object_unref(decoded);
+            return ERR_IMGLIB;
+        }
+        g_object_unref(resized);
+        free(buffer);
+    }
+    g_object_unref(decoded);
+    return ERR_NONE;
+}
+
+static int resize_shrink_on_load(const struct imgfs_header *header, void *orig, size_t size)
+{
+    void *resized[NB_RES] = { NULL };
+    size_t resized_size[NB_RES] = { 0 };
+    const int ret = resize_contents(header, RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES),
+                                    orig, size, resized, resized_size);
+    for (int res = 0; res < NB_RES; res++)
+    {
+        free(resized[res]);
+    }
+    return ret;
+}
+
+static double time_ms(int (*resize)(const struct imgfs_header *, void *, size_t),
+                      const struct imgfs_header *header, void *orig, size_t size)
+{
+    const double start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        if (resize(header, orig, size) != ERR_NONE)
+        {
+            fprintf(stderr, "resizing failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (bench_now_ns() - start) / 1e6 / ITERATIONS;
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    if (VIPS_INIT(argv[0]))
+    {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(ERR_IMGLIB));
+        return EXIT_FAILURE;
+    }
+
+    struct imgfs_header header = { .resized_res = { 64, 64, 256, 256 } };
+
+    printf("%-16s %10s %14s %14s %8s\n", "image", "bytes", "full (ms)", "shrink (ms)", "speedup");
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s%s", DATA_DIR, images[i]);
+        size_t size = 0;
+        char *orig = bench_read_file(path, &size);
+
+        const double full = time_ms(resize_full_decode, &header, orig, size);
+        const double shrink = time_ms(resize_shrink_on_load, &header, orig, size);
+        printf("%-16s %10zu %14.3f %14.3f %7.2fx\n", images[i], size, full, shrink, full / shrink);
+        free(orig);
+    }
+
+    vips_shutdown();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file bench.h
+ * @brief Small helpers shared by the micro-benchmarks.
+ *
+ * @author Morgane Magnin
+ * @author Amene Gafsi
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * @brief Current time of the monotonic clock, in nanoseconds.
+ */
+static inline double bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/**
+ * @brief Reads a whole file in a (to be freed) buffer, exits on failure.
+ */
+static inline char *bench_read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL || fseek(file, 0, SEEK_END))
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    const long length = ftell(file);
+    char *buffer = malloc((size_t) length);
+    rewind(file);
+    if (length < 0 || buffer == NULL || fread(buffer, (size_t) length, 1, file) != 1)
+    {
+        fprintf(stderr, "cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    *size = (size_t) length;
+    return buffer;
+}
@@ -4,6 +4,7 @@
 import os
 import re
 import shlex
+import socket
 import time
 
 from robot.libraries.Process import Process
@@ -56,6 +57,7 @@ class Imgfs:
         self.server_executable = server_exec_path
         self.data_dir = data_dir
         self.server_process = None
+        self.stalled_upload = None
 
         self.utils = Utils(exec_path)
 
@@ -215,6 +217,32 @@ class Imgfs:
         self.errors.compare_exit_code(res, "ERR_NONE")
         self.server_process = None
 
+    def imgfs_stall_upload(self, port, path, content_length):
+        """Sends a POST request and the start of its body, then stays silent."""
+        self.process.process_should_be_running(self.server_process)
+
+        self.logged_commands.append(f"(stalled upload of {content_length} bytes to {path})")
+
+        self.stalled_upload = socket.create_connection(("localhost", int(port)))
+        self.stalled_upload.sendall(
+            f"POST {path} HTTP/1.1\r\nHost: localhost\r\nContent-Length: {content_length}\r\n\r\n0123456789".encode("utf-8")
+        )
+
+    def imgfs_close_stalled_upload(self):
+        if self.stalled_upload:
+            self.stalled_upload.close()
+            self.stalled_upload = None
+
+    def imgfs_interrupt_server(self, timeout):
+        """Sends SIGINT to the server, which must exit cleanly within timeout."""
+        self.logged_commands.append("kill -INT <server pid>")
+
+        self.process.send_signal_to_process("SIGINT", self.server_process)
+        res = self.process.wait_for_process(self.server_process, timeout=timeout, on_timeout="kill")
+        self.builtin.log(res.rc)
+        self.errors.compare_exit_code(res, "ERR_NONE")
+        self.server_process = None
+
     def imgfs_curl(self, *args, expected_err=None, expected_file=None, output_file=None):
         self.process.process_should_be_running(self.server_process)
         
@@ -1,4 +1,5 @@
 #include "http_prot.h"
+#include "http_scan.h"
 #include "test.h"
 #include <check.h>
 
@@ -49,6 +50,30 @@ START_TEST(http_match_uri_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_uri_path_valid)
+{
+    start_test_print;
+
+    struct http_string uri = { "/imgfs/read?res=orig&img_id=pic1", 32 };
+    struct http_string path;
+
+    ck_assert_invalid_arg(http_uri_path(NULL, &path));
+    ck_assert_invalid_arg(http_uri_path(&uri, NULL));
+
+    ck_assert_err_none(http_uri_path(&uri, &path));
+    ck_assert_ptr_eq(path.val, uri.val);
+    ck_assert_int_eq(path.len, strlen("/imgfs/read"));
+
+    // A '?' past the end of the URI does not belong to it
+    uri.len = strlen("/imgfs/read");
+    ck_assert_err_none(http_uri_path(&uri, &path));
+    ck_assert_int_eq(path.len, uri.len);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(http_match_verb_null_params)
 {
@@ -158,6 +183,84 @@ START_TEST(http_get_var_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parse_query_valid)
+{
+    start_test_print;
+
+    const char *str = "/imgfs/read?xres=small&res=orig&&flag&img_id=pic%201";
+    struct http_string uri = {.val = str, .len = strlen(str)};
+    struct http_query query;
+
+    ck_assert_invalid_arg(http_parse_query(NULL, &query));
+    ck_assert_invalid_arg(http_parse_query(&uri, NULL));
+
+    ck_assert_err_none(http_parse_query(&uri, &query));
+    ck_assert_int_eq(query.num_vars, 4);
+    ck_assert(http_match_verb(&query.vars[0].key, "xres"));
+    ck_assert(http_match_verb(&query.vars[2].key, "flag"));
+    ck_assert_int_eq(query.vars[2].value.len, 0);
+    ck_assert(http_match_verb(&query.vars[3].value, "pic%201"));
+
+    // Nothing after the path
+    uri.len = strlen("/imgfs/read");
+    ck_assert_err_none(http_parse_query(&uri, &query));
+    ck_assert_int_eq(query.num_vars, 0);
+
+    // The variables after the first MAX_QUERY_VARS ones are kept for a scan
+    char many[sizeof("/?") + 4 * MAX_QUERY_VARS + sizeof("&last=x")] = "/?";
+    for (int i = 0; i < MAX_QUERY_VARS; i++) {
+        strcat(many, "a=1&");
+    }
+    strcat(many, "&last=x");
+    uri.val = many;
+    uri.len = strlen(many);
+    ck_assert_err_none(http_parse_query(&uri, &query));
+    ck_assert_int_eq(query.num_vars, MAX_QUERY_VARS);
+    char buf[2];
+    ck_assert_int_eq(http_query_get(&query, "last", buf, sizeof(buf)), 1);
+    ck_assert_str_eq(buf, "x");
+    ck_assert_int_eq(http_query_get(&query, "none", buf, sizeof(buf)), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_query_get_valid)
+{
+    start_test_print;
+
+    const char *str = "/imgfs/read?xres=small&res=orig&img_id=pic%201%2b&name=a+b&bad=%4&worse=%zz";
+    struct http_string uri = {.val = str, .len = strlen(str)};
+    struct http_query query;
+    char buf[10];
+
+    ck_assert_err_none(http_parse_query(&uri, &query));
+    ck_assert_invalid_arg(http_query_get(NULL, "res", buf, sizeof(buf)));
+    ck_assert_invalid_arg(http_query_get(&query, NULL, buf, sizeof(buf)));
+    ck_assert_invalid_arg(http_query_get(&query, "res", NULL, sizeof(buf)));
+
+    // res is not mistaken for the end of xres
+    ck_assert_int_eq(http_query_get(&query, "res", buf, sizeof(buf)), 4);
+    ck_assert_str_eq(buf, "orig");
+    ck_assert_int_eq(http_query_get(&query, "xres", buf, sizeof(buf)), 5);
+    ck_assert_str_eq(buf, "small");
+    ck_assert_int_eq(http_query_get(&query, "re", buf, sizeof(buf)), 0);
+
+    ck_assert_int_eq(http_query_get(&query, "img_id", buf, sizeof(buf)), 6);
+    ck_assert_str_eq(buf, "pic 1+");
+    ck_assert_err(http_query_get(&query, "img_id", buf, 6), ERR_RUNTIME);
+    ck_assert_int_eq(http_query_get(&query, "name", buf, sizeof(buf)), 3);
+    ck_assert_str_eq(buf, "a b");
+
+    ck_assert_invalid_arg(http_query_get(&query, "bad", buf, sizeof(buf)));
+    ck_assert_invalid_arg(http_query_get(&query, "worse", buf, sizeof(buf)));
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(http_parse_message_null_params)
 {
@@ -206,6 +309,7 @@ START_TEST(http_parse_message_full_headers_no_content)
 
     ck_assert_http_str_eq(msg.method, "GET");
     ck_assert_http_str_eq(msg.uri, "/imgfs/read?res=orig&img_id=mure.jpg");
+    ck_assert_http_str_eq(msg.version, "HTTP/1.1");
 
     ck_assert_int_eq(msg.num_headers, 3);
     ck_assert_has_header(&msg, "Host", "localhost:8000");
@@ -279,6 +383,157 @@ START_TEST(http_parse_message_full_headers_full_content)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_keep_alive_valid)
+{
+    start_test_print;
+
+    static const struct
+    {
+        const char *request;
+        int keep_alive;
+    } cases[] = {
+        {"GET / HTTP/1.1" HTTP_HDR_END_DELIM, 1},
+        {"GET / HTTP/1.1" HTTP_LINE_DELIM "Connection: close" HTTP_HDR_END_DELIM, 0},
+        {"GET / HTTP/1.1" HTTP_LINE_DELIM "connection: Close" HTTP_HDR_END_DELIM, 0},
+        {"GET / HTTP/1.0" HTTP_HDR_END_DELIM, 0},
+        {"GET / HTTP/1.0" HTTP_LINE_DELIM "Connection: keep-alive" HTTP_HDR_END_DELIM, 1},
+        {"GET /" HTTP_HDR_END_DELIM, 0},
+    };
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_invalid_arg(http_keep_alive(NULL));
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        ck_assert_int_eq(http_parse_message(cases[i].request, strlen(cases[i].request), &msg, &content_len), 1);
+        ck_assert_int_eq(http_keep_alive(&msg), cases[i].keep_alive);
+    }
+    ck_assert_http_str_eq(msg.uri, "/");
+    ck_assert_int_eq(msg.version.len, 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_execute_byte_by_byte)
+{
+    start_test_print;
+
+    const char *str = "POST /imgfs/insert?name=pic HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+                      "content-length: 12" HTTP_HDR_END_DELIM "Hello world!"
+                      "GET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM;
+    const size_t first_len = strlen(str) - strlen("GET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM);
+    struct http_message msg;
+    struct http_parser parser;
+    int content_len = 0;
+
+    // Each piece is copied in a new buffer, as a realloc() may do
+    char *stream = NULL;
+    int ret = 0;
+    http_parser_init(&parser);
+    for (size_t n = 1; ret == 0 && n <= strlen(str); n++) {
+        free(stream);
+        stream = strndup(str, n);
+        ret = http_parser_execute(&parser, stream, n, &msg, &content_len);
+        ck_assert_int_ge(ret, 0);
+        ck_assert_int_le(parser.position, n);
+    }
+    ck_assert_int_eq(ret, 1);
+    ck_assert_int_eq(content_len, 12);
+    ck_assert_int_eq(parser.body_start + (size_t)content_len, first_len);
+    ck_assert_http_str_eq(msg.method, "POST");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/insert?name=pic");
+    ck_assert_int_eq(msg.num_headers, 2);
+    ck_assert_has_header(&msg, "Host", "localhost:8000");
+    ck_assert_http_str_eq(msg.body, "Hello world!");
+    free(stream);
+
+    // The request pipelined after the first one
+    const char *next = str + first_len;
+    http_parser_init(&parser);
+    ck_assert_int_eq(http_parser_execute(&parser, next, strlen(next), &msg, &content_len), 1);
+    ck_assert_http_str_eq(msg.method, "GET");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/list");
+    ck_assert_int_eq(msg.num_headers, 0);
+    ck_assert_int_eq(content_len, 0);
+    ck_assert_ptr_null(msg.body.val);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_execute_malformed)
+{
+    start_test_print;
+
+    struct http_message msg;
+    struct http_parser parser;
+    int content_len = 0;
+    const char *bad[] = {
+        "GET" HTTP_HDR_END_DELIM,
+        "GET / HTTP/1.1\r\rHost: a" HTTP_HDR_END_DELIM,
+        "GET / HTTP/1.1" HTTP_LINE_DELIM "No colon" HTTP_HDR_END_DELIM,
+        "GET / HTTP/1.1" HTTP_LINE_DELIM "Content-Length: -3" HTTP_HDR_END_DELIM,
+        "GET / HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 99999999999" HTTP_HDR_END_DELIM,
+    };
+
+    ck_assert_invalid_arg(http_parser_execute(NULL, "", 0, &msg, &content_len));
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        http_parser_init(&parser);
+        ck_assert_int_lt(http_parser_execute(&parser, bad[i], strlen(bad[i]), &msg, &content_len), 0);
+    }
+
+    // More headers than MAX_HEADERS
+    char many[64 * (MAX_HEADERS + 2)] = "GET / HTTP/1.1" HTTP_LINE_DELIM;
+    for (int i = 0; i <= MAX_HEADERS; i++) {
+        strcat(many, "X-Header: value" HTTP_LINE_DELIM);
+    }
+    strcat(many, HTTP_LINE_DELIM);
+    http_parser_init(&parser);
+    ck_assert_int_lt(http_parser_execute(&parser, many, strlen(many), &msg, &content_len), 0);
+
+    // Empty lines before the request line are skipped
+    const char *str = HTTP_LINE_DELIM "GET /imgfs HTTP/1.1" HTTP_HDR_END_DELIM;
+    http_parser_init(&parser);
+    ck_assert_int_eq(http_parser_execute(&parser, str, strlen(str), &msg, &content_len), 1);
+    ck_assert_http_str_eq(msg.uri, "/imgfs");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_scan_same_as_scalar)
+{
+    start_test_print;
+
+    // Delimiters on both sides of the 16 and 32 bytes boundaries
+    char stream[100];
+    for (size_t i = 0; i < sizeof(stream); i++) {
+        stream[i] = (char) ('a' + i % 26);
+    }
+    stream[15] = ':';
+    stream[33] = '\r';
+    stream[64] = ':';
+    stream[95] = '\r';
+
+    for (size_t from = 0; from <= sizeof(stream); from++) {
+        for (size_t to = from; to <= sizeof(stream); to++) {
+            ck_assert_uint_eq(http_scan(stream, from, to, ':', '\r'), http_scan_scalar(stream, from, to, ':', '\r'));
+            ck_assert_uint_eq(http_scan(stream, from, to, '\r', '\r'), http_scan_scalar(stream, from, to, '\r', '\r'));
+        }
+    }
+    ck_assert_uint_eq(http_scan(stream, 16, sizeof(stream), ':', '\r'), 33);
+    ck_assert_uint_eq(http_scan(stream, 34, sizeof(stream), '\r', '\r'), 95);
+    ck_assert_uint_eq(http_scan(stream, 0, sizeof(stream), '#', '#'), sizeof(stream));
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -286,6 +541,7 @@ Suite *http_test_suite()
 
     Add_Test(s, http_match_uri_null_params);
     Add_Test(s, http_match_uri_valid);
+    Add_Test(s, http_uri_path_valid);
 
     Add_Test(s, http_match_verb_null_params);
     Add_Test(s, http_match_verb_valid);
@@ -295,11 +551,19 @@ Suite *http_test_suite()
     Add_Test(s, http_get_var_too_big);
     Add_Test(s, http_get_var_valid);
 
+    Add_Test(s, http_parse_query_valid);
+    Add_Test(s, http_query_get_valid);
+
     Add_Test(s, http_parse_message_null_params);
     Add_Test(s, http_parse_message_partial_headers);
     Add_Test(s, http_parse_message_full_headers_no_content);
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
+    Add_Test(s, http_keep_alive_valid);
+
+    Add_Test(s, http_parser_execute_byte_by_byte);
+    Add_Test(s, http_parser_execute_malformed);
+    Add_Test(s, http_scan_same_as_scalar);
 
     return s;
 }
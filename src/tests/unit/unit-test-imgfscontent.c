@@ -262,6 +262,85 @@ START_TEST(lazily_resize_valid_fallible)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(lazily_resize_all_single_append)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err(lazily_resize_all(RES_MASK(NB_RES), &file, 0), ERR_RESOLUTIONS);
+    ck_assert_err(lazily_resize_all(RES_MASK(THUMB_RES), &file, 3), ERR_INVALID_IMGID);
+
+    ck_assert_err_none(lazily_resize_all(RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES), &file, 0));
+    const struct img_metadata resized = file.metadata[0];
+    ck_assert_uint_eq(resized.offset[THUMB_RES], 192659);
+    ck_assert_uint_eq(resized.offset[SMALL_RES], 192659 + resized.size[THUMB_RES]);
+
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    const long file_size = ftell(file.file);
+    ck_assert_uint_eq(file_size, 192659 + resized.size[THUMB_RES] + resized.size[SMALL_RES]);
+
+    // Nothing is missing any more
+    ck_assert_err_none(lazily_resize_all(RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES), &file, 0));
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_uint_eq(ftell(file.file), file_size);
+    do_close(&file);
+
+    // Checks that metadata is correctly persisted
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_mem_eq(&file.metadata[0], &resized, sizeof(struct img_metadata));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_contents_both_resolutions)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    void *orig_img = NULL;
+    size_t orig_size = 0;
+    read_file_and_size(&orig_img, DATA_DIR "/papillon.jpg", &orig_size);
+
+    // Both resolutions come from the same shrunk decode
+    void *resized_img[NB_RES];
+    size_t resized_size[NB_RES];
+    ck_assert_err_none(resize_contents(&file.header, RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES),
+                                       orig_img, orig_size, resized_img, resized_size));
+    ck_assert_ptr_null(resized_img[ORIG_RES]);
+
+    for (int res = THUMB_RES; res <= SMALL_RES; res++) {
+        ck_assert_ptr_nonnull(resized_img[res]);
+        VipsImage *image = NULL;
+        ck_assert_int_eq(vips_jpegload_buffer(resized_img[res], resized_size[res], &image, NULL), 0);
+
+        // Fits in the (width, height) of the header, and touches one of its sides
+        const int max_width = file.header.resized_res[2 * res];
+        const int max_height = file.header.resized_res[2 * res + 1];
+        ck_assert_int_le(vips_image_get_width(image), max_width);
+        ck_assert_int_le(vips_image_get_height(image), max_height);
+        ck_assert(vips_image_get_width(image) == max_width || vips_image_get_height(image) == max_height);
+
+        g_object_unref(image);
+        free(resized_img[res]);
+    }
+
+    free(orig_img);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -275,6 +354,8 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, lazily_resize_already_exists);
     Add_Test(s, lazily_resize_valid);
     Add_Test(s, lazily_resize_valid_fallible);
+    Add_Test(s, lazily_resize_all_single_append);
+    Add_Test(s, resize_contents_both_resolutions);
 
     return s;
 }
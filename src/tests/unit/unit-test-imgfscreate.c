@@ -208,6 +208,30 @@ START_TEST(do_create_cmd_all_flags)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_create_cmd_eager_resize)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char *argv[] = {dump, "-eager_resize"};
+    ck_assert_err_none(do_create_cmd(2, argv));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(argv[0], "rb", &file));
+    ck_assert_int_eq(file.header.flags, IMGFS_EAGER_RESIZE);
+    do_close(&file);
+
+    char *argv_default[] = {dump};
+    ck_assert_err_none(do_create_cmd(1, argv_default));
+    ck_assert_err_none(do_open(argv[0], "rb", &file));
+    ck_assert_int_eq(file.header.flags, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_create_cmd_repeating_flags)
 {
@@ -291,6 +315,7 @@ Suite *imgfs_do_create_test_suite()
     Add_Test(s, do_create_cmd_res_too_big);
     Add_Test(s, do_create_cmd_no_flags);
     Add_Test(s, do_create_cmd_all_flags);
+    Add_Test(s, do_create_cmd_eager_resize);
     Add_Test(s, do_create_cmd_repeating_flags);
     Add_Test(s, do_create_cmd_ignores_irrelevant_fields);
 
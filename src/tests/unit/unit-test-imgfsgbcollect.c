@@ -0,0 +1,200 @@
+#include "imgfs.h"
+#include "imgfs_gbcollect.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Size of the header and metadata of test02
+#define TEST02_METADATA_END (sizeof(struct imgfs_header) + 100 * sizeof(struct img_metadata))
+#define PIC1_SIZE 72876
+#define PIC2_SIZE 98119
+
+static size_t file_size(const char *filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return (size_t)st.st_size;
+}
+
+// ======================================================================
+START_TEST(do_gbcollect_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_gbcollect gc;
+
+    ck_assert_invalid_arg(do_gbcollect(NULL, "tmp"));
+    ck_assert_invalid_arg(do_gbcollect(IMGFS("test02"), NULL));
+    ck_assert_err(do_gbcollect("not a file", "tmp"), ERR_IO);
+    ck_assert_invalid_arg(imgfs_gbcollect_start(NULL, &file, "tmp"));
+    ck_assert_invalid_arg(imgfs_gbcollect_start(&gc, NULL, "tmp"));
+    ck_assert_invalid_arg(imgfs_gbcollect_step(NULL, 1));
+    ck_assert_invalid_arg(imgfs_gbcollect_finish(NULL, "tmp"));
+    imgfs_gbcollect_abort(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_removes_deleted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_tmp);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    char *before = NULL;
+    uint32_t before_size = 0;
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &before, &before_size, &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_gbcollect(dump, dump_tmp));
+    ck_assert_int_eq(file_size(dump), TEST02_METADATA_END + PIC2_SIZE);
+    ck_assert_int_ne(access(dump_tmp, F_OK), 0);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 1);
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[1].offset[ORIG_RES], TEST02_METADATA_END);
+
+    char *after = NULL;
+    uint32_t after_size = 0;
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &after, &after_size, &file));
+    ck_assert_int_eq(after_size, before_size);
+    ck_assert_mem_eq(after, before, before_size);
+    ck_assert_err(do_read("pic1", ORIG_RES, &after, &after_size, &file), ERR_IMAGE_NOT_FOUND);
+
+    free(before);
+    free(after);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_keeps_shared_content)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_tmp);
+
+    // Make pic3 share the content of pic2, as deduplication does
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    file.metadata[2] = file.metadata[1];
+    strcpy(file.metadata[2].img_id, "pic3");
+    file.header.nb_files++;
+    ck_assert_err_none(write_metadata(&file, 2));
+    ck_assert_err_none(write_header(&file));
+    do_close(&file);
+
+    ck_assert_err_none(do_gbcollect(dump, dump_tmp));
+    ck_assert_int_eq(file_size(dump), TEST02_METADATA_END + PIC1_SIZE + PIC2_SIZE);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_int_eq(file.metadata[2].offset[ORIG_RES], file.metadata[1].offset[ORIG_RES]);
+    ck_assert_int_ne(file.metadata[0].offset[ORIG_RES], file.metadata[1].offset[ORIG_RES]);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_gbcollect_online)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_tmp);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open_mapped(dump, "rb+", &file));
+
+    struct imgfs_gbcollect gc;
+    ck_assert_err_none(imgfs_gbcollect_start(&gc, &file, dump_tmp));
+    ck_assert_err_none(imgfs_gbcollect_step(&gc, 2));
+    ck_assert(!imgfs_gbcollect_done(&gc));
+
+    // pic1 was already copied: its deletion must still be taken into account
+    ck_assert_err_none(do_delete("pic1", &file));
+
+    while (!imgfs_gbcollect_done(&gc)) {
+        ck_assert_err_none(imgfs_gbcollect_step(&gc, 3));
+    }
+    ck_assert_err_none(imgfs_gbcollect_finish(&gc, dump));
+
+    // The imgFS has been reopened in place
+    ck_assert_ptr_nonnull(file.mapping);
+    ck_assert_int_eq(file.header.nb_files, 1);
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+
+    // The content of pic1 was copied before its deletion: it stays until the next collection
+    ck_assert_int_eq(file_size(dump), TEST02_METADATA_END + PIC1_SIZE + PIC2_SIZE);
+
+    char *image = NULL;
+    uint32_t image_size = 0;
+    ck_assert_err(do_read("pic1", ORIG_RES, &image, &image_size, &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &image, &image_size, &file));
+    ck_assert_int_eq(image_size, PIC2_SIZE);
+
+    free(image);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_gbcollect_abort_removes_copy)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_tmp);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    struct imgfs_gbcollect gc;
+    ck_assert_err_none(imgfs_gbcollect_start(&gc, &file, dump_tmp));
+    ck_assert_err_none(imgfs_gbcollect_step(&gc, 1));
+    ck_assert_int_eq(access(dump_tmp, F_OK), 0);
+    imgfs_gbcollect_abort(&gc);
+    ck_assert_int_ne(access(dump_tmp, F_OK), 0);
+
+    // The imgFS is left untouched
+    ck_assert_int_eq(imgfs_gbcollect_done(&gc), 1);
+    ck_assert_int_eq(file.header.nb_files, 2);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_gbcollect_test_suite()
+{
+    Suite *s = suite_create("Tests for the garbage collection");
+
+    Add_Test(s, do_gbcollect_null_params);
+    Add_Test(s, do_gbcollect_removes_deleted);
+    Add_Test(s, do_gbcollect_keeps_shared_content);
+    Add_Test(s, imgfs_gbcollect_online);
+    Add_Test(s, imgfs_gbcollect_abort_removes_copy);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_gbcollect_test_suite)
@@ -0,0 +1,195 @@
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "test.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+
+// ======================================================================
+START_TEST(imgfs_index_null_params)
+{
+    start_test_print;
+
+    ck_assert_invalid_arg(imgfs_index_build(NULL));
+    ck_assert_int_eq(imgfs_index_find_id(NULL, "pic1", NO_SLOT), NO_SLOT);
+    ck_assert_int_eq(imgfs_index_find_sha(NULL, NULL, NO_SLOT), NO_SLOT);
+    ck_assert_int_eq(imgfs_index_find_free(NULL), NO_SLOT);
+    imgfs_index_free(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_find_after_open)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    ck_assert_ptr_nonnull(file.id_index.buckets);
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic1", NO_SLOT), 0);
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic2", NO_SLOT), 1);
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic1", 0), NO_SLOT);
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic3", NO_SLOT), NO_SLOT);
+    ck_assert_int_eq(imgfs_index_find_free(&file), 2);
+
+    do_close(&file);
+    ck_assert_ptr_null(file.id_index.buckets);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_find_sha_after_open)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    memcpy(sha, file.metadata[1].SHA, SHA256_DIGEST_LENGTH);
+    ck_assert_int_eq(imgfs_index_find_sha(&file, sha, NO_SLOT), 1);
+    ck_assert_int_eq(imgfs_index_find_sha(&file, sha, 1), NO_SLOT);
+
+    sha[0] ^= 0xff;
+    ck_assert_int_eq(imgfs_index_find_sha(&file, sha, NO_SLOT), NO_SLOT);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_follows_delete)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic1", NO_SLOT), NO_SLOT);
+    ck_assert_int_eq(imgfs_index_find_sha(&file, file.metadata[0].SHA, NO_SLOT), NO_SLOT);
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic2", NO_SLOT), 1);
+    ck_assert_err(do_delete("pic1", &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_int_eq(imgfs_index_find_free(&file), 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_churn)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 32, 32 } };
+    ck_assert_err_none(do_create(dump, &file));
+
+    // Repeatedly fill and empty the table, so that tombstones pile up
+    char id[MAX_IMG_ID + NULL_TERMINATOR];
+    for (int round = 0; round < 100; ++round) {
+        for (uint32_t i = 0; i < file.header.max_files; ++i) {
+            snprintf(file.metadata[i].img_id, sizeof(file.metadata[i].img_id), "img%d_%u", round, i);
+            file.metadata[i].is_valid = NON_EMPTY;
+            imgfs_index_add(&file, i);
+        }
+        for (uint32_t i = 0; i < file.header.max_files; ++i) {
+            snprintf(id, sizeof(id), "img%d_%u", round, i);
+            ck_assert_int_eq(imgfs_index_find_id(&file, id, NO_SLOT), i);
+        }
+        for (uint32_t i = 0; i < file.header.max_files; ++i) {
+            imgfs_index_remove(&file, i);
+            file.metadata[i].is_valid = EMPTY;
+        }
+        ck_assert_int_le(file.id_index.used, file.id_index.capacity);
+    }
+    ck_assert_int_eq(imgfs_index_find_id(&file, "img99_0", NO_SLOT), NO_SLOT);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_find_free_lowest_first)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    // More than one bitmap word
+    struct imgfs_file file = { .header.max_files = 150,
+                               .header.resized_res = { 32, 32, 32, 32 } };
+    ck_assert_err_none(do_create(dump, &file));
+
+    for (uint32_t i = 0; i < file.header.max_files; ++i) {
+        ck_assert_int_eq(imgfs_index_find_free(&file), i);
+        snprintf(file.metadata[i].img_id, sizeof(file.metadata[i].img_id), "img%u", i);
+        file.metadata[i].is_valid = NON_EMPTY;
+        imgfs_index_add(&file, i);
+    }
+    ck_assert_int_eq(imgfs_index_find_free(&file), NO_SLOT);
+
+    file.metadata[130].is_valid = EMPTY;
+    imgfs_index_remove(&file, 130);
+    ck_assert_int_eq(imgfs_index_find_free(&file), 130);
+
+    file.metadata[3].is_valid = EMPTY;
+    imgfs_index_remove(&file, 3);
+    ck_assert_int_eq(imgfs_index_find_free(&file), 3);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_linear_fallback)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // Without buckets, lookups must still work
+    imgfs_index_free(&file);
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic2", NO_SLOT), 1);
+    ck_assert_int_eq(imgfs_index_find_id(&file, "pic3", NO_SLOT), NO_SLOT);
+    ck_assert_int_eq(imgfs_index_find_free(&file), 2);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_index_test_suite()
+{
+    Suite *s = suite_create("Tests for the in-memory indexes");
+
+    Add_Test(s, imgfs_index_null_params);
+    Add_Test(s, imgfs_index_find_after_open);
+    Add_Test(s, imgfs_index_find_sha_after_open);
+    Add_Test(s, imgfs_index_follows_delete);
+    Add_Test(s, imgfs_index_churn);
+    Add_Test(s, imgfs_index_find_free_lowest_first);
+    Add_Test(s, imgfs_index_linear_fallback);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_index_test_suite)
@@ -338,6 +338,183 @@ START_TEST(do_insert_write_initializes_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_stream_pieces)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[40861];
+    struct imgfs_file file;
+    struct imgfs_insert_stream stream;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/mure.jpg", 40861);
+
+    ck_assert_err(do_insert_stream_begin(&file, 0, &stream), ERR_INVALID_ARGUMENT);
+    ck_assert_err_none(do_insert_stream_begin(&file, 40861, &stream));
+    ck_assert_uint_eq(stream.offset, 192659);
+
+    // Something appended meanwhile goes after the room of the content
+    uint64_t offset = 0;
+    ck_assert_err_none(append_content(&file, "x", 1, &offset));
+    ck_assert_uint_eq(offset, 192659 + 40861);
+
+    for (size_t done = 0; done < 40861; done += 4096) {
+        const size_t size = 40861 - done < 4096 ? 40861 - done : 4096;
+        ck_assert_err_none(do_insert_stream_write(&file, &stream, image + done, size));
+    }
+    ck_assert_err(do_insert_stream_write(&file, &stream, image, 1), ERR_INVALID_ARGUMENT);
+    ck_assert_err_none(do_insert_stream_end(&file, &stream, "mure"));
+    ck_assert_ptr_null(stream.sha);
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)image, 40861, sha);
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_int_eq(file.metadata[2].is_valid, NON_EMPTY);
+    ck_assert_uint_eq(file.metadata[2].offset[ORIG_RES], 192659);
+    ck_assert_uint_eq(file.metadata[2].size[ORIG_RES], 40861);
+    ck_assert_mem_eq(file.metadata[2].SHA, sha, SHA256_DIGEST_LENGTH);
+    ck_assert_int_ne(file.metadata[2].orig_res[0], 0);
+    do_close(&file);
+
+    char *read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(do_read("mure", ORIG_RES, &read, &read_size, &file));
+    ck_assert_uint_eq(read_size, 40861);
+    ck_assert_mem_eq(read, image, 40861);
+    free(read);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_stream_releases_room)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876];
+    struct imgfs_file file;
+    struct imgfs_insert_stream stream;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+
+    // Same content as pic1: shares its content
+    ck_assert_err_none(do_insert_stream_begin(&file, 72876, &stream));
+    ck_assert_err_none(do_insert_stream_write(&file, &stream, image, 72876));
+    ck_assert_err_none(do_insert_stream_end(&file, &stream, "pic3"));
+    ck_assert_uint_eq(file.metadata[2].offset[ORIG_RES], file.metadata[0].offset[ORIG_RES]);
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_int_eq(ftell(file.file), 192659);
+
+    // Incomplete content
+    ck_assert_err_none(do_insert_stream_begin(&file, 72876, &stream));
+    ck_assert_err_none(do_insert_stream_write(&file, &stream, image, 1000));
+    ck_assert_err(do_insert_stream_end(&file, &stream, "pic4"), ERR_INVALID_ARGUMENT);
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_int_eq(ftell(file.file), 192659);
+
+    // Given up
+    ck_assert_err_none(do_insert_stream_begin(&file, 72876, &stream));
+    do_insert_stream_abort(&file, &stream);
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_int_eq(ftell(file.file), 192659);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_single_append)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char mure[40861];
+    char papillon[72876];
+    char invalid[1000] = {0};
+    struct imgfs_file file;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(mure, DATA_DIR "/mure.jpg", 40861);
+    read_file(papillon, DATA_DIR "/papillon.jpg", 72876);
+
+    struct imgfs_batch_image images[] = {
+        {.img_id = "mure", .image_buffer = mure, .image_size = 40861},
+        {.img_id = "pic1", .image_buffer = mure, .image_size = 40861},
+        {.img_id = "bad", .image_buffer = invalid, .image_size = sizeof(invalid)},
+        {.img_id = "papillon", .image_buffer = papillon, .image_size = 72876},
+        {.img_id = "mure2", .image_buffer = mure, .image_size = 40861},
+    };
+
+    ck_assert_invalid_arg(do_insert_batch(NULL, 1, &file));
+    ck_assert_err_none(do_insert_batch(images, 5, &file));
+    ck_assert_err_none(images[0].result);
+    ck_assert_err(images[1].result, ERR_DUPLICATE_ID);
+    ck_assert_err(images[2].result, ERR_IMGLIB);
+    ck_assert_err_none(images[3].result);
+    ck_assert_err_none(images[4].result);
+    ck_assert_int_eq(file.header.nb_files, 5);
+
+    // Only the content of mure was new: papillon is pic1, mure2 is mure
+    ck_assert_uint_eq(file.metadata[2].offset[ORIG_RES], 192659);
+    ck_assert_uint_eq(file.metadata[3].offset[ORIG_RES], file.metadata[0].offset[ORIG_RES]);
+    ck_assert_uint_eq(file.metadata[4].offset[ORIG_RES], 192659);
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_int_eq(ftell(file.file), 192659 + 40861);
+    do_close(&file);
+
+    // Checks that the header and the metadata are correctly persisted
+    char *read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 5);
+    ck_assert_err_none(do_read("mure2", ORIG_RES, &read, &read_size, &file));
+    ck_assert_uint_eq(read_size, 40861);
+    ck_assert_mem_eq(read, mure, 40861);
+    free(read);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_full)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876];
+    struct imgfs_file file;
+
+    DUPLICATE_FILE(dump, IMGFS("full"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+
+    struct imgfs_batch_image images[] = {
+        {.img_id = "pic", .image_buffer = image, .image_size = 72876},
+    };
+    ck_assert_err_none(do_insert_batch(images, 1, &file));
+    ck_assert_err(images[0].result, ERR_IMGFS_FULL);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -352,6 +529,10 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_valid);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
+    Add_Test(s, do_insert_stream_pieces);
+    Add_Test(s, do_insert_stream_releases_room);
+    Add_Test(s, do_insert_batch_single_append);
+    Add_Test(s, do_insert_batch_full);
 
     return s;
 }
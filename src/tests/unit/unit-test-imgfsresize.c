@@ -0,0 +1,196 @@
+#include "image_content.h"
+#include "imgfs.h"
+#include "imgfs_resize.h"
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define NB_READERS 8
+// Time given to the readers to queue their requests
+#define QUEUEING_DELAY_US 200000
+
+static size_t file_size(const char *filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return (size_t)st.st_size;
+}
+
+static struct imgfs_resize_pool pool;
+
+static void *wait_small_pic1(void *result)
+{
+    *(int *)result = imgfs_resize_wait(&pool, "pic1", SMALL_RES);
+    return NULL;
+}
+
+// ======================================================================
+START_TEST(imgfs_resize_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    pthread_rwlock_t lock;
+
+    ck_assert_invalid_arg(imgfs_resize_start(NULL, &file, &lock, 1));
+    ck_assert_invalid_arg(imgfs_resize_start(&pool, NULL, &lock, 1));
+    ck_assert_invalid_arg(imgfs_resize_start(&pool, &file, NULL, 1));
+    ck_assert_invalid_arg(imgfs_resize_start(&pool, &file, &lock, 0));
+    ck_assert_invalid_arg(imgfs_resize_wait(NULL, "pic1", THUMB_RES));
+    imgfs_resize_stop(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_resize_wait_invalid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    pthread_rwlock_t lock;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(pthread_rwlock_init(&lock, NULL), 0);
+    ck_assert_err_none(imgfs_resize_start(&pool, &file, &lock, 2));
+
+    ck_assert_invalid_arg(imgfs_resize_wait(&pool, NULL, THUMB_RES));
+    ck_assert_err(imgfs_resize_wait(&pool, "pic1", NB_RES), ERR_RESOLUTIONS);
+    ck_assert_err(imgfs_resize_wait(&pool, "nope", THUMB_RES), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(imgfs_resize_wait(&pool, "pic1", ORIG_RES));
+    ck_assert_int_eq(pool.nb_resized, 0);
+
+    imgfs_resize_stop(&pool);
+    pthread_rwlock_destroy(&lock);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_resize_wait_creates_resolution)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    pthread_rwlock_t lock;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const size_t size_before = file_size(dump);
+    ck_assert_int_eq(pthread_rwlock_init(&lock, NULL), 0);
+    ck_assert_err_none(imgfs_resize_start(&pool, &file, &lock, 2));
+
+    ck_assert_err_none(imgfs_resize_wait(&pool, "pic2", THUMB_RES));
+    ck_assert_int_eq(file.metadata[1].offset[THUMB_RES], size_before);
+    ck_assert_int_gt(file.metadata[1].size[THUMB_RES], 0);
+    ck_assert_int_eq(file_size(dump), size_before + file.metadata[1].size[THUMB_RES]);
+
+    // Already there: nothing more to do
+    ck_assert_err_none(imgfs_resize_wait(&pool, "pic2", THUMB_RES));
+    ck_assert_int_eq(pool.nb_resized, 1);
+    ck_assert_int_eq(file_size(dump), size_before + file.metadata[1].size[THUMB_RES]);
+
+    imgfs_resize_stop(&pool);
+    pthread_rwlock_destroy(&lock);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_resize_wait_coalesces)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    pthread_rwlock_t lock;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const size_t size_before = file_size(dump);
+    ck_assert_int_eq(pthread_rwlock_init(&lock, NULL), 0);
+    ck_assert_err_none(imgfs_resize_start(&pool, &file, &lock, 4));
+
+    // Hold the imgFS while the requests pile up: the first job cannot start
+    pthread_rwlock_wrlock(&lock);
+    pthread_t readers[NB_READERS];
+    int results[NB_READERS];
+    for (int i = 0; i < NB_READERS; i++)
+    {
+        ck_assert_int_eq(pthread_create(&readers[i], NULL, wait_small_pic1, &results[i]), 0);
+    }
+    usleep(QUEUEING_DELAY_US);
+    pthread_rwlock_unlock(&lock);
+
+    for (int i = 0; i < NB_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+        ck_assert_err_none(results[i]);
+    }
+    ck_assert_int_eq(pool.nb_resized, 1);
+    ck_assert_int_eq(file_size(dump), size_before + file.metadata[0].size[SMALL_RES]);
+
+    imgfs_resize_stop(&pool);
+    pthread_rwlock_destroy(&lock);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_resize_submit_decodes_once)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    pthread_rwlock_t lock;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const size_t size_before = file_size(dump);
+    ck_assert_int_eq(pthread_rwlock_init(&lock, NULL), 0);
+    ck_assert_err_none(imgfs_resize_start(&pool, &file, &lock, 2));
+
+    ck_assert_err(imgfs_resize_submit(&pool, "pic1", RES_MASK(ORIG_RES)), ERR_RESOLUTIONS);
+    ck_assert_err_none(imgfs_resize_submit(&pool, "pic1", RES_MASK(THUMB_RES) | RES_MASK(SMALL_RES)));
+
+    // Joins the submitted job, or finds both resolutions already there
+    ck_assert_err_none(imgfs_resize_wait(&pool, "pic1", THUMB_RES));
+    ck_assert_int_ne(file.metadata[0].offset[THUMB_RES], 0);
+    ck_assert_int_ne(file.metadata[0].offset[SMALL_RES], 0);
+    ck_assert_int_eq(pool.nb_resized, 1);
+    ck_assert_int_eq(file_size(dump), size_before + file.metadata[0].size[THUMB_RES]
+                     + file.metadata[0].size[SMALL_RES]);
+
+    imgfs_resize_stop(&pool);
+    pthread_rwlock_destroy(&lock);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_resize_test_suite()
+{
+    Suite *s = suite_create("Tests for the background resize workers");
+
+    Add_Test(s, imgfs_resize_null_params);
+    Add_Test(s, imgfs_resize_wait_invalid);
+    Add_Test(s, imgfs_resize_wait_creates_resolution);
+    Add_Test(s, imgfs_resize_wait_coalesces);
+    Add_Test(s, imgfs_resize_submit_decodes_once);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_resize_test_suite)
@@ -52,6 +52,48 @@ START_TEST(get_resolution_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(get_resolution_progressive)
+{
+    start_test_print;
+
+    char image_buffer[72876];
+    read_file(image_buffer, DATA_DIR "/papillon.jpg", 72876);
+
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, image_buffer, 72876));
+
+    ck_assert_uint_eq(height, 800);
+    ck_assert_uint_eq(width, 1200);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(get_resolution_frame_header)
+{
+    start_test_print;
+
+    // Start of image, an empty APP0 segment, fill bytes, then a baseline start of frame
+    const char header[] = {
+        '\xFF', '\xD8', '\xFF', '\xE0', 0, 2, '\xFF', '\xFF', '\xFF', '\xC0', 0, 11,
+        8, 0, 16, 0, 32, 1, 1, 0x11, 0
+    };
+
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, header, sizeof(header)));
+
+    ck_assert_uint_eq(height, 16);
+    ck_assert_uint_eq(width, 32);
+
+    // Truncated in the middle of the start of frame
+    ck_assert_err(get_resolution(&height, &width, header, 14), ERR_IMGLIB);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_get_resolution_test_suite()
 {
@@ -60,6 +102,8 @@ Suite *imgfs_get_resolution_test_suite()
     Add_Test(s, get_resolution_null);
     Add_Test(s, get_resolution_invalid_buffer);
     Add_Test(s, get_resolution_valid);
+    Add_Test(s, get_resolution_progressive);
+    Add_Test(s, get_resolution_frame_header);
 
     return s;
 }
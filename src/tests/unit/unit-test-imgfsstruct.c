@@ -4,7 +4,7 @@
 // ======================================================================
 #define SIZE_imgfs_header 64
 #define SIZE_img_metadata 216
-#define SIZE_imgfs_file   80
+#define SIZE_imgfs_file   200
 
 #define OFFSET_imgfs_header_name        0
 #define OFFSET_imgfs_header_version     32
@@ -22,6 +22,13 @@
 #define OFFSET_imgfs_file_file     0
 #define OFFSET_imgfs_file_header   8
 #define OFFSET_imgfs_file_metadata 72
+#define OFFSET_imgfs_file_id_index 80
+#define OFFSET_imgfs_file_sha_index 104
+#define OFFSET_imgfs_file_free_slots 128
+#define OFFSET_imgfs_file_free_slots_hint 136
+#define OFFSET_imgfs_file_mapping 144
+#define OFFSET_imgfs_file_mapping_writable 152
+#define OFFSET_imgfs_file_pending 160
 
 // ======================================================================
 #define test_member(T, M)                                                                                              \
@@ -90,6 +97,13 @@ START_TEST(imgfs_file)
     test_member(imgfs_file, file);
     test_member(imgfs_file, header);
     test_member(imgfs_file, metadata);
+    test_member(imgfs_file, id_index);
+    test_member(imgfs_file, sha_index);
+    test_member(imgfs_file, free_slots);
+    test_member(imgfs_file, free_slots_hint);
+    test_member(imgfs_file, mapping);
+    test_member(imgfs_file, mapping_writable);
+    test_member(imgfs_file, pending);
 
     end_test_print;
 }
@@ -3,6 +3,7 @@
 #include "test.h"
 #include "util.h"
 #include <check.h>
+#include <unistd.h>
 
 START_TEST(do_open_null_params)
 {
@@ -111,6 +112,291 @@ START_TEST(do_open_correct_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_open_mapped_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+
+    ck_assert_invalid_arg(do_open_mapped(NULL, "rb", &file));
+    ck_assert_invalid_arg(do_open_mapped("asdf", NULL, &file));
+    ck_assert_invalid_arg(do_open_mapped("asdf", "rb", NULL));
+    ck_assert_err(do_open_mapped("not a file", "rb", &file), ERR_IO);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_open_mapped_same_content)
+{
+    start_test_print;
+
+    struct imgfs_file plain_file, mapped_file;
+    ck_assert_err_none(do_open(DATA_DIR "test02.imgfs", "rb", &plain_file));
+    ck_assert_err_none(do_open_mapped(DATA_DIR "test02.imgfs", "rb", &mapped_file));
+
+    ck_assert_ptr_nonnull(mapped_file.mapping);
+    ck_assert_mem_eq(&mapped_file.header, &plain_file.header, sizeof(struct imgfs_header));
+    ck_assert_mem_eq(mapped_file.metadata, plain_file.metadata,
+                     plain_file.header.max_files * sizeof(struct img_metadata));
+
+    do_close(&plain_file);
+    do_close(&mapped_file);
+    ck_assert_ptr_null(mapped_file.mapping);
+    ck_assert_ptr_null(mapped_file.metadata);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_open_mapped_write_back)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    // A read-only mapping is private
+    ck_assert_err_none(do_open_mapped(dump, "rb", &file));
+    file.metadata[0].is_valid = EMPTY;
+    ck_assert_err(write_metadata(&file, 0), ERR_IO);
+    ck_assert_err(write_header(&file), ERR_IO);
+    do_close(&file);
+
+    ck_assert_err_none(do_open_mapped(dump, "rb+", &file));
+    ck_assert_int_eq(file.metadata[0].is_valid, NON_EMPTY);
+    file.metadata[0].is_valid = EMPTY;
+    file.header.nb_files--;
+    ck_assert_err_none(write_metadata(&file, 0));
+    ck_assert_err_none(write_header(&file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.header.nb_files, 1);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(append_and_read_content)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    const char content[] = "some content";
+    uint64_t offset = 0;
+    ck_assert_err_none(append_content(&file, content, sizeof(content), &offset));
+    ck_assert_int_eq(offset, file.metadata[1].offset[ORIG_RES] + file.metadata[1].size[ORIG_RES]);
+
+    char buffer[sizeof(content)];
+    ck_assert_err_none(read_content(&file, offset, buffer, sizeof(buffer)));
+    ck_assert_mem_eq(buffer, content, sizeof(content));
+
+    // Reading past the end of the file fails
+    ck_assert_err(read_content(&file, offset + 1, buffer, sizeof(buffer)), ERR_IO);
+    do_close(&file);
+
+    // Appending to a read-only imgFS fails
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err(append_content(&file, content, sizeof(content), &offset), ERR_IO);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(write_contents_empty_contents)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    const void *const contents[] = {"", "some ", "", "content"};
+    const size_t sizes[] = {0, 5, 0, 7};
+    uint64_t offset = 0;
+    ck_assert_err_none(reserve_content(&file, 12, &offset));
+    ck_assert_err_none(write_contents(&file, offset, contents, sizes, 4));
+
+    char buffer[12];
+    ck_assert_err_none(read_content(&file, offset, buffer, sizeof(buffer)));
+    ck_assert_mem_eq(buffer, "some content", sizeof(buffer));
+    ck_assert_err_none(write_contents(&file, offset, contents, sizes, 1));
+    do_close(&file);
+
+    // A failed write is reported, even when it starts with an empty content
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err(write_contents(&file, offset, contents, sizes, 4), ERR_IO);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+// Number of files of the imgFS, as it is in the file
+static uint32_t nb_files_on_disk(const char *filename)
+{
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(filename, "rb", &file));
+    const uint32_t nb_files = file.header.nb_files;
+    do_close(&file);
+    return nb_files;
+}
+
+// Invalidates a slot and ends the update, the way do_delete() does
+static int invalidate_slot(struct imgfs_file *file, uint32_t index)
+{
+    file->metadata[index].is_valid = EMPTY;
+    file->header.nb_files--;
+    file->header.version++;
+    ck_assert_err_none(write_metadata(file, index));
+    ck_assert_err_none(write_header(file));
+    return commit_writes(file);
+}
+
+// ======================================================================
+START_TEST(write_policy_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    zero_init_var(file);
+
+    ck_assert_invalid_arg(commit_writes(NULL));
+    ck_assert_invalid_arg(commit_writes(&file));
+    ck_assert_invalid_arg(do_flush(NULL));
+    ck_assert_invalid_arg(set_write_policy(NULL, 1, 0, IMGFS_DURABILITY_WRITTEN));
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    ck_assert_invalid_arg(set_write_policy(&file, 1, 0, IMGFS_DURABILITY_SYNCED + 1));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(write_policy_groups_updates)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const uint32_t version = file.header.version;
+    ck_assert_err_none(set_write_policy(&file, 3, 0, IMGFS_DURABILITY_WRITTEN));
+
+    // The first two updates wait for the third one
+    ck_assert_err_none(invalidate_slot(&file, 0));
+    ck_assert_err_none(invalidate_slot(&file, 1));
+    ck_assert_int_eq(file.pending.updates, 2);
+    ck_assert_int_eq(nb_files_on_disk(dump), 2);
+
+    file.metadata[5].unused_16 = 1;
+    ck_assert_err_none(write_metadata(&file, 5));
+    ck_assert_err_none(commit_writes(&file));
+    ck_assert_int_eq(file.pending.updates, 0);
+    ck_assert_int_eq(nb_files_on_disk(dump), 0);
+
+    // Explicit barrier
+    file.header.version++;
+    ck_assert_err_none(write_header(&file));
+    ck_assert_err_none(commit_writes(&file));
+    ck_assert_err_none(do_flush(&file));
+    ck_assert_int_eq(file.pending.updates, 0);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 0);
+    ck_assert_int_eq(file.header.version, version + 3);
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[1].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[5].unused_16, 1);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(write_policy_delay_and_close)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const uint32_t version = file.header.version;
+    ck_assert_err_none(set_write_policy(&file, 100, 1, IMGFS_DURABILITY_SYNCED));
+
+    // An update older than the delay is written with the next one
+    ck_assert_err_none(invalidate_slot(&file, 0));
+    ck_assert_int_eq(nb_files_on_disk(dump), 2);
+    usleep(2000);
+    ck_assert_err_none(invalidate_slot(&file, 1));
+    ck_assert_int_eq(nb_files_on_disk(dump), 0);
+
+    // Pending updates are written when closing
+    ck_assert_err_none(set_write_policy(&file, 100, 0, IMGFS_DURABILITY_WRITTEN));
+    file.header.version++;
+    ck_assert_err_none(write_header(&file));
+    ck_assert_err_none(commit_writes(&file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.version, version + 3);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(write_policy_due_writes)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_invalid_arg(commit_due_writes(NULL));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(set_write_policy(&file, 100, 50, IMGFS_DURABILITY_WRITTEN));
+
+    // Not due yet
+    ck_assert_err_none(invalidate_slot(&file, 0));
+    ck_assert_err_none(commit_due_writes(&file));
+    ck_assert_int_eq(file.pending.updates, 1);
+    ck_assert_int_eq(nb_files_on_disk(dump), 2);
+
+    // Written once the delay has passed, without any further update
+    usleep(60 * 1000);
+    ck_assert_err_none(commit_due_writes(&file));
+    ck_assert_int_eq(file.pending.updates, 0);
+    ck_assert_int_eq(nb_files_on_disk(dump), 1);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_close_null_param)
 {
@@ -128,6 +414,7 @@ START_TEST(do_close_null_file)
     start_test_print;
 
     struct imgfs_file file;
+    zero_init_var(file);
     file.file = NULL;
     file.metadata = malloc(sizeof(struct img_metadata));
 
@@ -147,6 +434,15 @@ Suite *imgfs_tools_suite_RES()
     Add_Test(s, do_open_invalid_mode);
     Add_Test(s, do_open_correct_header);
     Add_Test(s, do_open_correct_metadata);
+    Add_Test(s, do_open_mapped_null_params);
+    Add_Test(s, do_open_mapped_same_content);
+    Add_Test(s, do_open_mapped_write_back);
+    Add_Test(s, append_and_read_content);
+    Add_Test(s, write_contents_empty_contents);
+    Add_Test(s, write_policy_null_params);
+    Add_Test(s, write_policy_groups_updates);
+    Add_Test(s, write_policy_delay_and_close);
+    Add_Test(s, write_policy_due_writes);
 
     Add_Test(s, do_close_null_param);
     Add_Test(s, do_close_null_file);